@@ -42,46 +42,116 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #define BT_PULSE_RETRIES    25000
 
-typedef enum {
-    CONNECT,
-    DISCONNECT,
-    RECONNECT
-} bt_cd_t;
+#define BT_CALL_TIMEOUT     5       /* Default timeout in seconds for trust and disconnect calls */
+#define BT_CONNECT_TIMEOUT  20      /* Default timeout in seconds for connect calls */
+#define BT_RETRIES          3       /* Default number of retries of a connect which fails with a transient error */
+#define BT_RETRY_DELAY      1000    /* Delay in ms before first retry - doubled for each further retry */
+
+#define BT_ADDR_LEN         17      /* Length of a Bluetooth address as text, XX_XX_XX_XX_XX_XX */
+#define BT_MAX_VOLUME       127     /* Maximum AVRCP absolute volume */
+#define BT_NAME_LEN         64
+
+/* BlueZ interfaces used by the plugin - cached properties of all other interfaces are discarded */
+static const char *bt_used_interfaces[] =
+{
+    "org.bluez.Device1",
+    "org.bluez.Battery1",
+    "org.bluez.MediaTransport1",
+    NULL
+};
+
+#define BT_PLAN_FORCE       1   /* Cycle the connection of devices even if already connected */
+#define BT_PLAN_SAVED       2   /* Devices are from saved settings - forget them if connection fails */
 
 typedef enum {
-    INPUT,
-    OUTPUT,
-    BOTH
+    NONE = 0,
+    INPUT = 1,
+    OUTPUT = 2,
+    BOTH = 3
 } bt_dir_t;
 
 typedef struct {
-    const char *device;
-    bt_cd_t conn_disc;
-    bt_dir_t direction;
+    VolumePulsePlugin *vol;     /* Back pointer to plugin */
+    char *device;               /* BlueZ object path of device */
+    bt_dir_t direction;         /* Roles in which device is to be used - NONE to disconnect it */
+    const char *profile;        /* PulseAudio card profile to set once connected */
+    const char *fallback;       /* Profile to set if the preferred profile is not available */
+    gboolean disconnect;        /* Flag to show device is to be disconnected */
+    gboolean connect;           /* Flag to show device is to be connected */
+    gboolean saved;             /* Flag to show device is from saved settings */
+    gboolean started;           /* Flag to show operation has been started */
+    gboolean failed;            /* Flag to show operation has failed */
+    gboolean cancelled;         /* Flag to show operation has been cancelled */
+    gboolean pending;           /* Flag to show a D-Bus call is in progress */
+    GCancellable *cancellable;  /* Cancellable for D-Bus calls */
+    guint source_id;            /* Idle or timeout source for profile poll or retry */
+    int retries;                /* Number of times connect has been retried */
+    int profile_count;          /* Counter for polling read of profile on connection */
+    gint64 start;               /* Time at which operation started */
+    gint64 phase_end[BT_PHASES];    /* Time at which each phase completed, or 0 if not run */
 } bt_operation_t;
 
 /*----------------------------------------------------------------------------*/
 /* Static function prototypes                                                 */
 /*----------------------------------------------------------------------------*/
 
-static void bt_add_operation (VolumePulsePlugin *vol, const char *device, bt_cd_t cd, bt_dir_t dir);
-static void bt_do_operation (VolumePulsePlugin *vol);
-static void bt_next_operation (VolumePulsePlugin *vol);
-static char *bt_to_pa_name (const char *bluez_name, char *type, char *profile);
-static char *bt_from_pa_name (const char *pa_name);
-static int bt_sink_source_compare (char *sink, char *source);
+static gboolean bt_plan_operations (VolumePulsePlugin *vol, const char *cur_out, const char *cur_in, const char *new_out, const char *new_in, gboolean hsp, int flags);
+static void bt_plan_device (VolumePulsePlugin *vol, const char *device, bt_dir_t cur, bt_dir_t dir, gboolean hsp, int flags);
+static gboolean bt_profile_is_a2dp (const char *profile);
+static const char *bt_profile_node (const char *profile);
+static const char *bt_card_headset_profile (VolumePulsePlugin *vol, const char *profile);
+static const char *bt_preferred_profile (VolumePulsePlugin *vol, const char *device, bt_dir_t dir, gboolean hsp);
+static void bt_run_operations (VolumePulsePlugin *vol);
+static void bt_do_operation (bt_operation_t *btop);
+static void bt_operation_done (bt_operation_t *btop);
+static void bt_operation_free (bt_operation_t *btop);
+static void bt_cancel_operations (VolumePulsePlugin *vol);
+static gboolean bt_error_is_transient (GError *error);
+static gboolean bt_retry_connect (gpointer user_data);
+static void bt_forget_saved (bt_operation_t *btop);
+static void bt_phase_done (bt_operation_t *btop, bt_phase_t phase);
+static void bt_record_timing (bt_operation_t *btop);
+static void bt_operations_finished (VolumePulsePlugin *vol);
+static void bt_index_object (VolumePulsePlugin *vol, GDBusObject *object);
+static void bt_cb_index_added (GDBusObjectManager *manager, GDBusObject *object, gpointer user_data);
+static void bt_cb_index_removed (GDBusObjectManager *manager, GDBusObject *object, gpointer user_data);
+static char *bt_pa_address (const char *pa_name, char *buf);
+static char *bt_to_pa_name (VolumePulsePlugin *vol, const char *bluez_name, const char *type, const char *profile, char *buf);
+static char *bt_from_pa_name (VolumePulsePlugin *vol, const char *pa_name);
+static int bt_sink_source_compare (const char *sink, const char *source);
 static void bt_cb_name_owned (GDBusConnection *connection, const gchar *name, const gchar *owner, gpointer user_data);
-static void bt_cb_name_owned_norc (GDBusConnection *connection, const gchar *name, const gchar *owner, gpointer user_data);
+static void bt_cb_object_manager (GObject *source, GAsyncResult *res, gpointer user_data);
+static void bt_reconnect_devices (VolumePulsePlugin *vol);
 static void bt_cb_name_unowned (GDBusConnection *connection, const gchar *name, gpointer user_data);
+static void bt_close_object_manager (VolumePulsePlugin *vol);
+static gboolean bt_interface_used (const char *interface);
+static void bt_strip_proxy (GDBusProxy *proxy, GStrv names);
+static void bt_strip_object (GDBusObject *object);
+static void bt_cb_strip_object (GDBusObjectManager *manager, GDBusObject *object, gpointer user_data);
+static void bt_cb_strip_interface (GDBusObjectManager *manager, GDBusObject *object, GDBusInterface *interface, gpointer user_data);
+static void bt_cb_strip_properties (GDBusObjectManagerClient *manager, GDBusObjectProxy *object_proxy, GDBusProxy *proxy, GVariant *parameters, GStrv inval, gpointer user_data);
+static long bt_get_rss (void);
+static void bt_cb_object_added (GDBusObjectManager *manager, GDBusObject *object, gpointer user_data);
 static void bt_cb_object_removed (GDBusObjectManager *manager, GDBusObject *object, gpointer user_data);
 static void bt_cb_interface_properties (GDBusObjectManagerClient *manager, GDBusObjectProxy *object_proxy, GDBusProxy *proxy, GVariant *parameters, GStrv inval, gpointer user_data);
-static void bt_connect_device (VolumePulsePlugin *vol, const char *device);
+static void bt_connect_device (bt_operation_t *btop);
 static void bt_cb_connected (GObject *source, GAsyncResult *res, gpointer user_data);
 static gboolean bt_get_profile (gpointer user_data);
 static void bt_cb_trusted (GObject *source, GAsyncResult *res, gpointer user_data);
-static void bt_disconnect_device (VolumePulsePlugin *vol, const char *device);
+static void bt_disconnect_device (bt_operation_t *btop);
 static void bt_cb_disconnected (GObject *source, GAsyncResult *res, gpointer user_data);
 static gboolean bt_has_service (VolumePulsePlugin *vol, const gchar *path, const gchar *service);
+static gboolean bt_update_device_count (VolumePulsePlugin *vol, GDBusProxy *proxy);
+static int bt_battery_level (VolumePulsePlugin *vol, const char *path);
+static char *bt_menu_label (VolumePulsePlugin *vol, const char *path, const char *alias);
+static void bt_update_battery (VolumePulsePlugin *vol, const char *path);
+static void bt_cb_battery_added (GDBusObjectManager *manager, GDBusObject *object, GDBusInterface *interface, gpointer user_data);
+static void bt_cb_battery_properties (GDBusObjectManagerClient *manager, GDBusObjectProxy *object_proxy, GDBusProxy *proxy, GVariant *parameters, GStrv inval, gpointer user_data);
+static GDBusProxy *bt_get_transport (VolumePulsePlugin *vol);
+static void bt_forget_transport (VolumePulsePlugin *vol);
+static void bt_cb_volume_set (GObject *source, GAsyncResult *res, gpointer user_data);
+static void bt_cb_transport_properties (GDBusObjectManagerClient *manager, GDBusObjectProxy *object_proxy, GDBusProxy *proxy, GVariant *parameters, GStrv inval, gpointer user_data);
+static void bt_count_all_devices (VolumePulsePlugin *vol);
 static void bt_connect_dialog_show (VolumePulsePlugin *vol, const char *fmt, ...);
 static void bt_connect_dialog_update (VolumePulsePlugin *vol, const char *msg);
 static void bt_connect_dialog_ok (GtkButton *button, VolumePulsePlugin *vol);
@@ -90,106 +160,476 @@ static void bt_connect_dialog_ok (GtkButton *button, VolumePulsePlugin *vol);
 /* Bluetooth operation list management                                        */
 /*----------------------------------------------------------------------------*/
 
-/* Add an operation to the list */
-
-static void bt_add_operation (VolumePulsePlugin *vol, const char *device, bt_cd_t cd, bt_dir_t dir)
+/*
+ * Changes of Bluetooth output and input device are made by a planner, which compares
+ * the requested devices with the current ones and with the actual connection state
+ * of each device, and creates at most one operation per device, with only the steps
+ * that device needs:
+ * - a connected device which is no longer used is disconnected
+ * - a device which is used but not connected is connected
+ * - a connected device which gains a role, or needs a different profile, just has its
+ *   profile and the default sink / source set, without cycling the connection
+ * - a connected device whose roles are unchanged is left alone
+ * BT_PLAN_FORCE causes connected devices to be disconnected and reconnected anyway.
+ * Operations on different devices are independent, so they are all run at once.
+ */
+
+static gboolean bt_plan_operations (VolumePulsePlugin *vol, const char *cur_out, const char *cur_in, const char *new_out, const char *new_in, gboolean hsp, int flags)
 {
-    bt_operation_t *newop = malloc (sizeof (bt_operation_t));
+    const char *devices[4] = { new_out, new_in, cur_out, cur_in };
+    bt_dir_t cur, dir;
+    int dev, prev;
+
+    for (dev = 0; dev < 4; dev++)
+    {
+        if (devices[dev] == NULL) continue;
 
-    newop->device = device;
-    newop->conn_disc = cd;
-    newop->direction = dir;
+        // only plan each device once
+        for (prev = 0; prev < dev; prev++)
+            if (!g_strcmp0 (devices[prev], devices[dev])) break;
+        if (prev < dev) continue;
 
-    vol->bt_ops = g_list_append (vol->bt_ops, newop);
+        cur = (!g_strcmp0 (devices[dev], cur_out) ? OUTPUT : NONE) | (!g_strcmp0 (devices[dev], cur_in) ? INPUT : NONE);
+        dir = (!g_strcmp0 (devices[dev], new_out) ? OUTPUT : NONE) | (!g_strcmp0 (devices[dev], new_in) ? INPUT : NONE);
+        bt_plan_device (vol, devices[dev], cur, dir, hsp, flags);
+    }
+
+    return vol->bt_ops != NULL;
 }
 
-/* Do the first operation in the list */
+/* Work out the steps needed to take a device from its current roles to the requested ones */
 
-static void bt_do_operation (VolumePulsePlugin *vol)
+static void bt_plan_device (VolumePulsePlugin *vol, const char *device, bt_dir_t cur, bt_dir_t dir, gboolean hsp, int flags)
 {
-    if (vol->bt_ops)
+    bt_operation_t *btop;
+    char pacard[BT_NAME_LEN];
+    gboolean connected = bluetooth_is_connected (vol, device);
+    const char *profile = bt_preferred_profile (vol, device, dir, hsp);
+
+    if (dir == NONE && !connected)
     {
-        bt_operation_t *btop = (bt_operation_t *) vol->bt_ops->data;
+        DEBUG ("Plan %s : not connected - nothing to do", device);
+        return;
+    }
 
-        if (btop->conn_disc == DISCONNECT)
+    // a device which is to be used needs its address to find its PulseAudio card
+    if (dir != NONE && bt_to_pa_name (vol, device, "card", NULL, pacard) == NULL)
+    {
+        DEBUG ("Plan %s : device not indexed - cannot be used", device);
+        return;
+    }
+
+    if (!(flags & BT_PLAN_FORCE))
+    {
+        if (dir != NONE && connected && dir == cur)
         {
-            bt_disconnect_device (vol, btop->device);
+            DEBUG ("Plan %s : already connected in same roles - nothing to do", device);
+            return;
         }
-        else
+
+        // a device which is only losing a role may already have the right profile
+        if (dir != NONE && connected && (dir & ~cur) == NONE)
         {
-            bt_connect_device (vol, btop->device);
+            pulse_get_profile (vol, pacard);
+            profile = bt_card_headset_profile (vol, profile);
+            if (!g_strcmp0 (vol->pa_profile, profile))
+            {
+                DEBUG ("Plan %s : already connected with profile %s - nothing to do", device, profile);
+                return;
+            }
         }
     }
-}
 
-/* Advance to the next operation in the list */
+    btop = g_new0 (bt_operation_t, 1);
+    btop->vol = vol;
+    btop->device = g_strdup (device);
+    btop->direction = dir;
+    btop->profile = profile;
+    btop->fallback = dir == OUTPUT && bt_profile_is_a2dp (profile) ? "a2dp_sink" : "headset_head_unit";
+    btop->disconnect = connected && (dir == NONE || (flags & BT_PLAN_FORCE));
+    btop->connect = dir != NONE && (!connected || (flags & BT_PLAN_FORCE));
+    btop->saved = (flags & BT_PLAN_SAVED) ? TRUE : FALSE;
+    btop->cancellable = g_cancellable_new ();
+
+    DEBUG ("Plan %s : %s%s%s", device, btop->disconnect ? "disconnect " : "", btop->connect ? "connect " : "",
+        dir != NONE ? profile : "");
+    vol->bt_ops = g_list_append (vol->bt_ops, btop);
+}
 
-static void bt_next_operation (VolumePulsePlugin *vol)
+/*
+ * PulseAudio offers a profile for each A2DP codec a device supports, with names such
+ * as a2dp_sink_aac or a2dp_sink_ldac, as well as the headset profiles used for calls.
+ * A profile pinned for a device in the profiles dialog is used whenever it connects,
+ * if it suits the roles the device is being connected for - an input always needs a
+ * headset profile. Otherwise A2DP is used for an output and HSP / HFP for an input.
+ */
+
+static const char *bt_preferred_profile (VolumePulsePlugin *vol, const char *device, bt_dir_t dir, gboolean hsp)
 {
-    if (vol->bt_ops)
+    const char *adrs = g_hash_table_lookup (vol->bt_path_index, device);
+    const char *pref = adrs ? device_setting_get_string (vol, "BluetoothProfile", adrs) : NULL;
+
+    if (dir == OUTPUT && !hsp)
     {
-        bt_operation_t *btop = (bt_operation_t *) vol->bt_ops->data;
-        g_free (btop);
-        vol->bt_ops = vol->bt_ops->next;
+        if (pref) return g_intern_string (pref);
+        return "a2dp_sink";
     }
+    if (pref && !bt_profile_is_a2dp (pref)) return g_intern_string (pref);
+    return "headset_head_unit";
+}
+
+/* Check whether a PulseAudio card profile is an A2DP profile */
+
+static gboolean bt_profile_is_a2dp (const char *profile)
+{
+    return g_str_has_prefix (profile, "a2dp_sink");
+}
+
+/*
+ * The headset profile a card offers depends on the device and the PulseAudio backend -
+ * headset_head_unit for HSP, or handsfree_head_unit for an HFP-only device on the native
+ * backend. Once the card has been read by pulse_get_profile, the generic headset profile
+ * is replaced by the one the card actually has.
+ */
+
+static const char *bt_card_headset_profile (VolumePulsePlugin *vol, const char *profile)
+{
+    if (!g_strcmp0 (profile, "headset_head_unit") && vol->pa_headset_profile) return vol->pa_headset_profile;
+    return profile;
+}
+
+/* Get the profile part of the PulseAudio sink / source name for a card profile - all A2DP codecs share one */
+
+static const char *bt_profile_node (const char *profile)
+{
+    if (bt_profile_is_a2dp (profile)) return "a2dp_sink";
+    return profile;
+}
+
+/* Start all planned operations which are not already running */
+
+static void bt_run_operations (VolumePulsePlugin *vol)
+{
+    GList *ops, *op;
+
     if (vol->bt_ops == NULL)
     {
-        if (vol->bt_oname) g_free (vol->bt_oname);
-        if (vol->bt_iname) g_free (vol->bt_iname);
-        vol->bt_oname = NULL;
-        vol->bt_iname = NULL;
+        bt_operations_finished (vol);
+        return;
+    }
+
+    // operations can complete immediately and remove themselves from the list, so iterate a copy
+    ops = g_list_copy (vol->bt_ops);
+    for (op = ops; op != NULL; op = op->next)
+    {
+        bt_operation_t *btop = (bt_operation_t *) op->data;
+        if (btop->started) continue;
+        btop->started = TRUE;
+        btop->start = g_get_monotonic_time ();
+        bt_do_operation (btop);
+    }
+    g_list_free (ops);
+}
+
+/* Do the next step of an operation */
+
+static void bt_do_operation (bt_operation_t *btop)
+{
+    if (btop->disconnect)
+    {
+        bt_disconnect_device (btop);
+    }
+    else if (btop->connect)
+    {
+        bt_connect_device (btop);
+    }
+    else if (btop->direction != NONE)
+    {
+        // device already connected - just set the profile
+        btop->profile_count = 0;
+        btop->source_id = g_idle_add (bt_get_profile, btop);
+    }
+    else bt_operation_done (btop);
+}
+
+/* Remove a completed operation from the list */
+
+static void bt_operation_done (bt_operation_t *btop)
+{
+    VolumePulsePlugin *vol = btop->vol;
+
+    bt_record_timing (btop);
+
+    vol->bt_ops = g_list_remove (vol->bt_ops, btop);
+    bt_operation_free (btop);
+
+    if (vol->bt_ops == NULL) bt_operations_finished (vol);
+}
+
+/* Free the memory used by an operation */
+
+static void bt_operation_free (bt_operation_t *btop)
+{
+    g_object_unref (btop->cancellable);
+    g_free (btop->device);
+    g_free (btop);
+}
+
+/*
+ * Cancel all operations in progress, which is done when the user chooses a different
+ * device while a previous choice is still being connected. Operations waiting for a
+ * D-Bus reply are freed by the reply callback, which sees they have been cancelled.
+ */
+
+static void bt_cancel_operations (VolumePulsePlugin *vol)
+{
+    GList *op;
+
+    for (op = vol->bt_ops; op != NULL; op = op->next)
+    {
+        bt_operation_t *btop = (bt_operation_t *) op->data;
+
+        DEBUG ("Cancelling operation on %s", btop->device);
+        btop->cancelled = TRUE;
+        if (btop->source_id) g_source_remove (btop->source_id);
+        btop->source_id = 0;
+        if (btop->pending) g_cancellable_cancel (btop->cancellable);
+        else bt_operation_free (btop);
+    }
+    g_list_free (vol->bt_ops);
+    vol->bt_ops = NULL;
+}
 
-        // operations now all finished - move all streams to default devices
-        pulse_get_default_sink_source (vol);
-        pulse_move_output_streams (vol);
-        pulse_move_input_streams (vol);
+/* Called once all operations have completed */
+
+static void bt_operations_finished (VolumePulsePlugin *vol)
+{
+    gint64 start = g_get_monotonic_time ();
+    int ms, entry;
+
+    // move all streams to default devices
+    pulse_get_default_sink_source (vol);
+    pulse_move_output_streams (vol);
+    pulse_move_input_streams (vol);
+    pulse_unmute_all_streams (vol);
+
+    // stream moves are shared by all the operations just finished, so add their time to each history entry
+    ms = (g_get_monotonic_time () - start) / 1000;
+    DEBUG ("Streams moved in %d ms", ms);
+    for (entry = 1; entry <= vol->bt_history_batch && entry <= BT_HISTORY; entry++)
+        vol->bt_history[(vol->bt_history_next + BT_HISTORY - entry) % BT_HISTORY].phase_ms[BT_PHASE_STREAMS] = ms;
+    vol->bt_history_batch = 0;
+
+    // close the connection dialog unless it is showing an error
+    if (vol->conn_dialog && !gtk_widget_is_visible (vol->conn_ok)) close_widget (&vol->conn_dialog);
+
+    volumepulse_update_display (vol);
+
+    if (vol->bt_start_time)
+    {
+        DEBUG ("Saved Bluetooth devices ready %.3f s after startup", (g_get_monotonic_time () - vol->bt_start_time) / 1000000.0);
+        vol->bt_start_time = 0;
     }
-    else bt_do_operation (vol);
+}
+
+/*
+ * Each operation records the time at which each of its phases completes. When
+ * the operation is done, the time taken by each phase is logged and kept in a
+ * small history, so the slow part of connecting a device can be identified.
+ */
+
+static void bt_phase_done (bt_operation_t *btop, bt_phase_t phase)
+{
+    btop->phase_end[phase] = g_get_monotonic_time ();
+}
+
+/* Add the phase times of an operation to the history and log them */
+
+static void bt_record_timing (bt_operation_t *btop)
+{
+    static const char *names[BT_PHASES] = { "disconnect", "trust", "connect", "card", "profile", "default", "streams" };
+    VolumePulsePlugin *vol = btop->vol;
+    bt_timing_t *rec = &vol->bt_history[vol->bt_history_next];
+    GString *summary;
+    gint64 prev = btop->start;
+    int phase;
+
+    g_strlcpy (rec->device, btop->device, sizeof (rec->device));
+    rec->start = btop->start;
+    rec->ok = !btop->failed;
+    for (phase = 0; phase < BT_PHASES; phase++)
+    {
+        if (btop->phase_end[phase])
+        {
+            rec->phase_ms[phase] = (btop->phase_end[phase] - prev) / 1000;
+            prev = btop->phase_end[phase];
+        }
+        else rec->phase_ms[phase] = -1;
+    }
+
+    vol->bt_history_next = (vol->bt_history_next + 1) % BT_HISTORY;
+    vol->bt_history_batch++;
+
+    if (!getenv ("DEBUG_VP")) return;
+    summary = g_string_new (NULL);
+    for (phase = 0; phase < BT_PHASES; phase++)
+        if (rec->phase_ms[phase] >= 0) g_string_append_printf (summary, "%s %d ms, ", names[phase], rec->phase_ms[phase]);
+    DEBUG ("Timing for %s : %stotal %d ms%s", rec->device, summary->str, (int) ((prev - btop->start) / 1000), rec->ok ? "" : " (failed)");
+    g_string_free (summary, TRUE);
 }
 
 /*----------------------------------------------------------------------------*/
 /* Bluetooth name remapping                                                   */
 /*----------------------------------------------------------------------------*/
 
-/* Convert the BlueZ name of a device to a PulseAudio sink / source / card */
+/*
+ * PulseAudio names Bluetooth cards, sinks and sources from the device address -
+ * for example bluez_sink.XX_XX_XX_XX_XX_XX.a2dp_sink - while BlueZ names devices
+ * by object path, which also includes the adapter, so the two are mapped through
+ * a pair of tables keyed by address and by path. These are filled from Device1
+ * objects on any adapter, and from the bluez.path property which PulseAudio sets
+ * on Bluetooth cards, sinks and sources.
+ */
+
+void bluetooth_index_device (VolumePulsePlugin *vol, const char *path, const char *address)
+{
+    char *adrs, *ptr;
+
+    if (path == NULL || address == NULL || strlen (address) != BT_ADDR_LEN) return;
+
+    // addresses are held in the form used in PulseAudio names
+    adrs = g_ascii_strup (address, -1);
+    for (ptr = adrs; *ptr; ptr++) if (*ptr == ':') *ptr = '_';
+    if (!g_strcmp0 (g_hash_table_lookup (vol->bt_path_index, path), adrs))
+    {
+        g_free (adrs);
+        return;
+    }
+
+    DEBUG ("Indexing Bluetooth device %s as %s", path, adrs);
+    g_hash_table_insert (vol->bt_path_index, g_strdup (path), g_strdup (adrs));
+    g_hash_table_insert (vol->bt_addr_index, adrs, g_strdup (path));
+    bt_forget_transport (vol);
+}
+
+/* Add an object to the index if it is a BlueZ device */
 
-static char *bt_to_pa_name (const char *bluez_name, char *type, char *profile)
+static void bt_index_object (VolumePulsePlugin *vol, GDBusObject *object)
 {
-    unsigned int b1, b2, b3, b4, b5, b6;
+    GDBusInterface *interface;
+    GVariant *var;
+
+    // media transports are indexed against the device they belong to
+    interface = g_dbus_object_get_interface (object, "org.bluez.MediaTransport1");
+    if (interface)
+    {
+        var = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Device");
+        if (var)
+        {
+            DEBUG ("Indexing media transport %s for %s", g_dbus_object_get_object_path (object), g_variant_get_string (var, NULL));
+            g_hash_table_insert (vol->bt_transports, g_strdup (g_dbus_object_get_object_path (object)), g_variant_dup_string (var, NULL));
+            g_variant_unref (var);
+            bt_forget_transport (vol);
+        }
+        g_object_unref (interface);
+        return;
+    }
+
+    interface = g_dbus_object_get_interface (object, "org.bluez.Device1");
+    if (interface == NULL) return;
+
+    var = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Address");
+    if (var)
+    {
+        bluetooth_index_device (vol, g_dbus_object_get_object_path (object), g_variant_get_string (var, NULL));
+        g_variant_unref (var);
+    }
+    g_object_unref (interface);
+}
 
+/* Callback for BlueZ object added - updates index */
+
+static void bt_cb_index_added (GDBusObjectManager *manager, GDBusObject *object, gpointer user_data)
+{
+    bt_index_object ((VolumePulsePlugin *) user_data, object);
+}
+
+/* Callback for BlueZ object removed - updates index */
+
+static void bt_cb_index_removed (GDBusObjectManager *manager, GDBusObject *object, gpointer user_data)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) user_data;
+    const char *path = g_dbus_object_get_object_path (object);
+    const char *adrs = g_hash_table_lookup (vol->bt_path_index, path);
+
+    if (g_hash_table_remove (vol->bt_transports, path)) bt_forget_transport (vol);
+    if (adrs == NULL) return;
+    g_hash_table_remove (vol->bt_addr_index, adrs);
+    g_hash_table_remove (vol->bt_path_index, path);
+}
+
+/* Extract the address from a PulseAudio Bluetooth card / sink / source name, written into the supplied buffer of BT_NAME_LEN */
+
+static char *bt_pa_address (const char *pa_name, char *buf)
+{
+    const char *adrs;
+
+    buf[0] = 0;
+    if (pa_name == NULL || strncmp (pa_name, "bluez_", 6)) return NULL;
+    adrs = strchr (pa_name, '.');
+    if (adrs == NULL || strlen (adrs + 1) < BT_ADDR_LEN) return NULL;
+    if (adrs[BT_ADDR_LEN + 1] != 0 && adrs[BT_ADDR_LEN + 1] != '.') return NULL;
+    g_strlcpy (buf, adrs + 1, BT_ADDR_LEN + 1);
+    return buf;
+}
+
+/* Convert the BlueZ name of a device to a PulseAudio sink / source / card, written into the supplied buffer of BT_NAME_LEN - returns NULL if the device is not indexed */
+
+static char *bt_to_pa_name (VolumePulsePlugin *vol, const char *bluez_name, const char *type, const char *profile, char *buf)
+{
+    const char *adrs;
+
+    buf[0] = 0;
     if (bluez_name == NULL) return NULL;
-    if (sscanf (bluez_name, "/org/bluez/hci0/dev_%x_%x_%x_%x_%x_%x", &b1, &b2, &b3, &b4, &b5, &b6) != 6)
+    adrs = g_hash_table_lookup (vol->bt_path_index, bluez_name);
+    if (adrs == NULL)
     {
-        DEBUG ("Bluez name invalid : %s", bluez_name);
+        DEBUG ("Bluez name not indexed : %s", bluez_name);
         return NULL;
     }
-    return g_strdup_printf ("bluez_%s.%02X_%02X_%02X_%02X_%02X_%02X%s%s",
-        type, b1, b2, b3, b4, b5, b6, profile ? "." : "", profile ? profile : "");
+    g_snprintf (buf, BT_NAME_LEN, "bluez_%s.%s%s%s", type, adrs, profile ? "." : "", profile ? profile : "");
+    return buf;
 }
 
 /* Convert a PulseAudio sink / source / card to a BlueZ device name */
 
-static char *bt_from_pa_name (const char *pa_name)
+static char *bt_from_pa_name (VolumePulsePlugin *vol, const char *pa_name)
 {
-    unsigned int b1, b2, b3, b4, b5, b6;
-    char *adrs;
+    char adrs[BT_NAME_LEN];
 
-    if (pa_name == NULL) return NULL;
-    if (strstr (pa_name, "bluez") == NULL) return NULL;
-    adrs = strstr (pa_name, ".");
-    if (adrs == NULL) return NULL;
-    if (sscanf (adrs + 1, "%x_%x_%x_%x_%x_%x", &b1, &b2, &b3, &b4, &b5, &b6) != 6) return NULL;
-    return g_strdup_printf ("/org/bluez/hci0/dev_%02X_%02X_%02X_%02X_%02X_%02X", b1, b2, b3, b4, b5, b6);
+    if (bt_pa_address (pa_name, adrs) == NULL) return NULL;
+    return g_strdup (g_hash_table_lookup (vol->bt_addr_index, adrs));
 }
 
 /* Compare a PulseAudio sink and source to see if they are the same BlueZ device */
 
-static int bt_sink_source_compare (char *sink, char *source)
+static int bt_sink_source_compare (const char *sink, const char *source)
+{
+    char sadrs[BT_NAME_LEN], dadrs[BT_NAME_LEN];
+
+    if (bt_pa_address (sink, sadrs) == NULL) return 1;
+    if (bt_pa_address (source, dadrs) == NULL) return 1;
+    return strcmp (sadrs, dadrs);
+}
+
+/* Check whether a PulseAudio sink / source belongs to the BlueZ device with the given object path */
+
+gboolean bluetooth_is_pa_device (VolumePulsePlugin *vol, const char *path, const char *pa_name)
 {
-    if (sink == NULL || source == NULL) return 1;
-    if (strstr (sink, "bluez") == NULL) return 1;
-    if (strstr (source, "bluez") == NULL) return 1;
-    return strncmp (sink + 11, source + 13, 17);
+    char adrs[BT_NAME_LEN];
+
+    if (bt_pa_address (pa_name, adrs) == NULL) return FALSE;
+    return !g_strcmp0 (g_hash_table_lookup (vol->bt_path_index, path), adrs);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -203,67 +643,120 @@ static void bt_cb_name_owned (GDBusConnection *connection, const gchar *name, co
     VolumePulsePlugin *vol = (VolumePulsePlugin *) user_data;
     DEBUG ("Name %s owned on D-Bus", name);
 
-    /* BlueZ exists - get an object manager for it */
+    /* BlueZ exists - start creating an object manager for it, which completes in bt_cb_object_manager */
+    if (vol->bt_cancellable)
+    {
+        g_cancellable_cancel (vol->bt_cancellable);
+        g_object_unref (vol->bt_cancellable);
+    }
+    vol->bt_cancellable = g_cancellable_new ();
+    DEBUG ("Resident size before object manager %ld kB", bt_get_rss ());
+    g_dbus_object_manager_client_new_for_bus (G_BUS_TYPE_SYSTEM, 0, "org.bluez", "/", NULL, NULL, NULL, vol->bt_cancellable, bt_cb_object_manager, vol);
+}
+
+/* Callback for object manager creation completed */
+
+static void bt_cb_object_manager (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) user_data;
+    GDBusObjectManager *objmanager;
+    GList *objects, *obj;
     GError *error = NULL;
-    vol->bt_objmanager = g_dbus_object_manager_client_new_for_bus_sync (G_BUS_TYPE_SYSTEM, 0, "org.bluez", "/", NULL, NULL, NULL, NULL, &error);
+
+    objmanager = g_dbus_object_manager_client_new_for_bus_finish (res, &error);
     if (error)
     {
+        // if cancelled, the plugin may have been destroyed, so don't touch it
+        if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+            g_error_free (error);
+            return;
+        }
+
         DEBUG ("Error getting object manager - %s", error->message);
-        vol->bt_objmanager = NULL;
         g_error_free (error);
+        g_clear_object (&vol->bt_cancellable);
+        return;
     }
-    else
-    {
-        DEBUG ("Reconnecting devices");
-        vol->bt_oname = get_string ("cat ~/.btout 2> /dev/null");
-        if (!g_strcmp0 (vol->bt_oname, ""))
-        {
-            g_free (vol->bt_oname);
-            vol->bt_oname = NULL;
-        }
-        vol->bt_iname = get_string ("cat ~/.btin 2> /dev/null");
-        if (!g_strcmp0 (vol->bt_iname, ""))
-        {
-            g_free (vol->bt_iname);
-            vol->bt_iname = NULL;
-        }
 
-        if (vol->bt_oname || vol->bt_iname) bt_connect_dialog_show (vol, _("Reconnecting Bluetooth devices..."));
-        if (vol->bt_oname) bt_add_operation (vol, vol->bt_oname, DISCONNECT, OUTPUT);
-        if (vol->bt_iname) bt_add_operation (vol, vol->bt_iname, DISCONNECT, INPUT);
-        if (vol->bt_oname)
-        {
-            if (!g_strcmp0 (vol->bt_oname, vol->bt_iname)) bt_add_operation (vol, vol->bt_oname, RECONNECT, BOTH);
-            else bt_add_operation (vol, vol->bt_oname, RECONNECT, OUTPUT);
-        }
-        if (vol->bt_iname && g_strcmp0 (vol->bt_oname, vol->bt_iname)) bt_add_operation (vol, vol->bt_iname, RECONNECT, INPUT);
-        vol->bt_input = vol->bt_iname ? TRUE : FALSE;
-        vol->bt_force_hsp = FALSE;
+    g_clear_object (&vol->bt_cancellable);
+    vol->bt_objmanager = objmanager;
+
+    /* discard properties of interfaces which are not used, now and whenever objects are added or changed */
+    DEBUG ("Resident size with object manager %ld kB", bt_get_rss ());
+    g_signal_connect (vol->bt_objmanager, "object-added", G_CALLBACK (bt_cb_strip_object), vol);
+    g_signal_connect (vol->bt_objmanager, "interface-added", G_CALLBACK (bt_cb_strip_interface), vol);
+    g_signal_connect (vol->bt_objmanager, "interface-proxy-properties-changed", G_CALLBACK (bt_cb_strip_properties), vol);
+    objects = g_dbus_object_manager_get_objects (vol->bt_objmanager);
+    for (obj = objects; obj != NULL; obj = obj->next) bt_strip_object (G_DBUS_OBJECT (obj->data));
+    DEBUG ("Resident size after discarding unused properties %ld kB", bt_get_rss ());
+
+    /* index device paths against addresses, now and whenever devices are added or removed */
+    g_signal_connect (vol->bt_objmanager, "object-added", G_CALLBACK (bt_cb_index_added), vol);
+    g_signal_connect (vol->bt_objmanager, "object-removed", G_CALLBACK (bt_cb_index_removed), vol);
+    for (obj = objects; obj != NULL; obj = obj->next) bt_index_object (vol, G_DBUS_OBJECT (obj->data));
+    g_list_free_full (objects, g_object_unref);
+
+    /* battery levels are only ever updated from signals, never polled */
+    g_signal_connect (vol->bt_objmanager, "interface-added", G_CALLBACK (bt_cb_battery_added), vol);
+    g_signal_connect (vol->bt_objmanager, "interface-proxy-properties-changed", G_CALLBACK (bt_cb_battery_properties), vol);
+
+    /* track hardware volume changes made with the buttons on a headset */
+    if (!vol->input_control)
+        g_signal_connect (vol->bt_objmanager, "interface-proxy-properties-changed", G_CALLBACK (bt_cb_transport_properties), vol);
 
-        bt_do_operation (vol);
+    if (vol->input_control)
+    {
+        /* register callbacks for devices being added or removed */
+        g_signal_connect (vol->bt_objmanager, "object-added", G_CALLBACK (bt_cb_object_added), vol);
+        g_signal_connect (vol->bt_objmanager, "object-removed", G_CALLBACK (bt_cb_object_removed), vol);
+        g_signal_connect (vol->bt_objmanager, "interface-proxy-properties-changed", G_CALLBACK (bt_cb_interface_properties), vol);
+
+        bt_count_all_devices (vol);
+        volumepulse_update_display (vol);
+    }
+    else
+    {
+        if (vol->bt_start_time) DEBUG ("Object manager ready %.3f s after startup", (g_get_monotonic_time () - vol->bt_start_time) / 1000000.0);
+        bt_reconnect_devices (vol);
     }
 }
 
-static void bt_cb_name_owned_norc (GDBusConnection *connection, const gchar *name, const gchar *owner, gpointer user_data)
+/* Reconnect the devices which were in use when the plugin last ran */
+
+static void bt_reconnect_devices (VolumePulsePlugin *vol)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) user_data;
-    DEBUG ("Name %s owned on D-Bus", name);
+    char *oname, *iname;
 
-    /* BlueZ exists - get an object manager for it */
-    GError *error = NULL;
-    vol->bt_objmanager = g_dbus_object_manager_client_new_for_bus_sync (G_BUS_TYPE_SYSTEM, 0, "org.bluez", "/", NULL, NULL, NULL, NULL, &error);
-    if (error)
+    DEBUG ("Reconnecting devices");
+    oname = get_string ("cat ~/.btout 2> /dev/null");
+    if (!g_strcmp0 (oname, ""))
     {
-        DEBUG ("Error getting object manager - %s", error->message);
-        vol->bt_objmanager = NULL;
-        g_error_free (error);
+        g_free (oname);
+        oname = NULL;
+    }
+    iname = get_string ("cat ~/.btin 2> /dev/null");
+    if (!g_strcmp0 (iname, ""))
+    {
+        g_free (iname);
+        iname = NULL;
+    }
+
+    // the output and input are planned together, so if they are different devices they reconnect in parallel,
+    // and a device which BlueZ has already connected just has its profile set rather than being cycled
+    if (bt_plan_operations (vol, NULL, NULL, oname, iname, FALSE, BT_PLAN_SAVED))
+    {
+        bt_connect_dialog_show (vol, _("Reconnecting Bluetooth devices..."));
+        bt_run_operations (vol);
     }
     else
     {
-        /* register callbacks for devices being added or removed */
-        g_signal_connect (vol->bt_objmanager, "object-removed", G_CALLBACK (bt_cb_object_removed), vol);
-        g_signal_connect (vol->bt_objmanager, "interface-proxy-properties-changed", G_CALLBACK (bt_cb_interface_properties), vol);
+        DEBUG ("No saved devices to reconnect");
+        vol->bt_start_time = 0;
     }
+
+    g_free (oname);
+    g_free (iname);
 }
 
 /* Callback for BlueZ disappearing on D-Bus */
@@ -272,9 +765,40 @@ static void bt_cb_name_unowned (GDBusConnection *connection, const gchar *name,
 {
     VolumePulsePlugin *vol = (VolumePulsePlugin *) user_data;
     DEBUG ("Name %s unowned on D-Bus", name);
+    vol->bt_start_time = 0;
+
+    if (vol->bt_cancellable)
+    {
+        g_cancellable_cancel (vol->bt_cancellable);
+        g_clear_object (&vol->bt_cancellable);
+    }
 
+    bt_close_object_manager (vol);
+    g_hash_table_remove_all (vol->bt_transports);
+    bt_forget_transport (vol);
+
+    if (g_hash_table_size (vol->bt_devices))
+    {
+        g_hash_table_remove_all (vol->bt_devices);
+        volumepulse_update_display (vol);
+    }
+}
+
+/* Disconnect signal handlers from the object manager and release it */
+
+static void bt_close_object_manager (VolumePulsePlugin *vol)
+{
     if (vol->bt_objmanager)
     {
+        g_signal_handlers_disconnect_by_func (vol->bt_objmanager, G_CALLBACK (bt_cb_strip_object), vol);
+        g_signal_handlers_disconnect_by_func (vol->bt_objmanager, G_CALLBACK (bt_cb_strip_interface), vol);
+        g_signal_handlers_disconnect_by_func (vol->bt_objmanager, G_CALLBACK (bt_cb_strip_properties), vol);
+        g_signal_handlers_disconnect_by_func (vol->bt_objmanager, G_CALLBACK (bt_cb_index_added), vol);
+        g_signal_handlers_disconnect_by_func (vol->bt_objmanager, G_CALLBACK (bt_cb_index_removed), vol);
+        g_signal_handlers_disconnect_by_func (vol->bt_objmanager, G_CALLBACK (bt_cb_battery_added), vol);
+        g_signal_handlers_disconnect_by_func (vol->bt_objmanager, G_CALLBACK (bt_cb_battery_properties), vol);
+        g_signal_handlers_disconnect_by_func (vol->bt_objmanager, G_CALLBACK (bt_cb_transport_properties), vol);
+        g_signal_handlers_disconnect_by_func (vol->bt_objmanager, G_CALLBACK (bt_cb_object_added), vol);
         g_signal_handlers_disconnect_by_func (vol->bt_objmanager, G_CALLBACK (bt_cb_object_removed), vol);
         g_signal_handlers_disconnect_by_func (vol->bt_objmanager, G_CALLBACK (bt_cb_interface_properties), vol);
         g_object_unref (vol->bt_objmanager);
@@ -282,6 +806,105 @@ static void bt_cb_name_unowned (GDBusConnection *connection, const gchar *name,
     vol->bt_objmanager = NULL;
 }
 
+/*
+ * The object manager creates a proxy for every interface on every BlueZ object,
+ * and cannot be told to skip any - on systems with many BLE devices, most of
+ * these are GATT services, characteristics and descriptors. The plugin only reads
+ * properties of a few interfaces, so the cached properties of all others are
+ * dropped as soon as they are loaded, which is where most of the memory goes.
+ */
+
+static gboolean bt_interface_used (const char *interface)
+{
+    const char **iface;
+
+    for (iface = bt_used_interfaces; *iface; iface++)
+        if (!g_strcmp0 (interface, *iface)) return TRUE;
+    return FALSE;
+}
+
+/* Drop the named cached properties of a proxy for an unused interface, or all of them if names is NULL */
+
+static void bt_strip_proxy (GDBusProxy *proxy, GStrv names)
+{
+    gchar **all = NULL, **name;
+
+    if (bt_interface_used (g_dbus_proxy_get_interface_name (proxy))) return;
+
+    if (names == NULL) names = all = g_dbus_proxy_get_cached_property_names (proxy);
+    if (names == NULL) return;
+    for (name = names; *name; name++) g_dbus_proxy_set_cached_property (proxy, *name, NULL);
+    g_strfreev (all);
+}
+
+/* Drop the cached properties of all unused interfaces on an object */
+
+static void bt_strip_object (GDBusObject *object)
+{
+    GList *interfaces, *iface;
+
+    interfaces = g_dbus_object_get_interfaces (object);
+    for (iface = interfaces; iface != NULL; iface = iface->next) bt_strip_proxy (G_DBUS_PROXY (iface->data), NULL);
+    g_list_free_full (interfaces, g_object_unref);
+}
+
+/* Callbacks for objects or interfaces being added, or properties changing - properties are dropped as above */
+
+static void bt_cb_strip_object (GDBusObjectManager *manager, GDBusObject *object, gpointer user_data)
+{
+    bt_strip_object (object);
+}
+
+static void bt_cb_strip_interface (GDBusObjectManager *manager, GDBusObject *object, GDBusInterface *interface, gpointer user_data)
+{
+    bt_strip_proxy (G_DBUS_PROXY (interface), NULL);
+}
+
+static void bt_cb_strip_properties (GDBusObjectManagerClient *manager, GDBusObjectProxy *object_proxy, GDBusProxy *proxy, GVariant *parameters, GStrv inval, gpointer user_data)
+{
+    GVariantIter iter;
+    const char *name;
+
+    if (bt_interface_used (g_dbus_proxy_get_interface_name (proxy))) return;
+
+    g_variant_iter_init (&iter, parameters);
+    while (g_variant_iter_next (&iter, "{&sv}", &name, NULL))
+        g_dbus_proxy_set_cached_property (proxy, name, NULL);
+}
+
+/* Read the resident set size of the process in kB, for debug reports */
+
+static long bt_get_rss (void)
+{
+    char buf[128];
+    long rss = -1;
+    FILE *fp;
+
+    fp = fopen ("/proc/self/status", "r");
+    if (fp == NULL) return rss;
+    while (fgets (buf, sizeof (buf), fp))
+        if (sscanf (buf, "VmRSS: %ld", &rss) == 1) break;
+    fclose (fp);
+    return rss;
+}
+
+/* Callback for BlueZ device being added */
+
+static void bt_cb_object_added (GDBusObjectManager *manager, GDBusObject *object, gpointer user_data)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) user_data;
+    GDBusInterface *interface;
+
+    DEBUG ("Bluetooth object %s added", g_dbus_object_get_object_path (object));
+
+    interface = g_dbus_object_get_interface (object, "org.bluez.Device1");
+    if (interface)
+    {
+        if (bt_update_device_count (vol, G_DBUS_PROXY (interface))) volumepulse_update_display (vol);
+        g_object_unref (interface);
+    }
+}
+
 /* Callback for BlueZ device disconnecting */
 
 static void bt_cb_object_removed (GDBusObjectManager *manager, GDBusObject *object, gpointer user_data)
@@ -289,6 +912,7 @@ static void bt_cb_object_removed (GDBusObjectManager *manager, GDBusObject *obje
     VolumePulsePlugin *vol = (VolumePulsePlugin *) user_data;
 
     DEBUG ("Bluetooth object %s removed", g_dbus_object_get_object_path (object));
+    g_hash_table_remove (vol->bt_devices, g_dbus_object_get_object_path (object));
     volumepulse_update_display (vol);
 }
 
@@ -301,6 +925,13 @@ static void bt_cb_interface_properties (GDBusObjectManagerClient *manager, GDBus
 
     DEBUG ("Bluetooth object %s property change", g_dbus_proxy_get_object_path (proxy));
 
+    if (!g_strcmp0 (g_dbus_proxy_get_interface_name (proxy), "org.bluez.Device1")
+        && bt_update_device_count (vol, proxy))
+    {
+        volumepulse_update_display (vol);
+        return;
+    }
+
     var = g_variant_lookup_value (parameters, "Trusted", NULL);
     if (var)
     {
@@ -311,34 +942,32 @@ static void bt_cb_interface_properties (GDBusObjectManagerClient *manager, GDBus
 
 /* Connect a BlueZ device */
 
-static void bt_connect_device (VolumePulsePlugin *vol, const char *device)
+static void bt_connect_device (bt_operation_t *btop)
 {
-    GDBusInterface *interface = g_dbus_object_manager_get_interface (vol->bt_objmanager, device, "org.bluez.Device1");
-    DEBUG ("Connecting device %s...", device);
+    VolumePulsePlugin *vol = btop->vol;
+    GDBusInterface *interface = NULL;
+
+    DEBUG ("Connecting device %s...", btop->device);
+    if (vol->bt_objmanager) interface = g_dbus_object_manager_get_interface (vol->bt_objmanager, btop->device, "org.bluez.Device1");
     if (interface)
     {
-        // trust and connect
+        // trust, then connect from the trust callback
+        btop->pending = TRUE;
         g_dbus_proxy_call (G_DBUS_PROXY (interface), "org.freedesktop.DBus.Properties.Set", 
             g_variant_new ("(ssv)", g_dbus_proxy_get_interface_name (G_DBUS_PROXY (interface)), "Trusted", g_variant_new_boolean (TRUE)),
-            G_DBUS_CALL_FLAGS_NONE, -1, NULL, bt_cb_trusted, vol);
-        g_dbus_proxy_call (G_DBUS_PROXY (interface), "Connect", NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, bt_cb_connected, vol);
+            G_DBUS_CALL_FLAGS_NONE, vol->bt_call_timeout, btop->cancellable, bt_cb_trusted, btop);
         g_object_unref (interface);
     }
     else
     {
         // should only happen on a reconnect if the device has been un-paired
-        bt_operation_t *btop = (bt_operation_t *) vol->bt_ops->data;
-
         DEBUG ("Couldn't get device interface from object manager");
         char *msg = g_strdup_printf (_("Bluetooth %s device not found"), btop->direction == INPUT ? "input" : "output");
         bt_connect_dialog_update (vol, msg);
         g_free (msg);
-        if (btop->conn_disc == RECONNECT)
-        {
-            if (btop->direction != OUTPUT) vsystem ("rm -f ~/.btin");
-            if (btop->direction != INPUT) vsystem ("rm -f ~/.btout");
-        }
-        bt_next_operation (vol);
+        bt_forget_saved (btop);
+        btop->failed = TRUE;
+        bt_operation_done (btop);
     }
 }
 
@@ -346,55 +975,124 @@ static void bt_connect_device (VolumePulsePlugin *vol, const char *device)
 
 static void bt_cb_connected (GObject *source, GAsyncResult *res, gpointer user_data)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) user_data;
+    bt_operation_t *btop = (bt_operation_t *) user_data;
     GError *error = NULL;
 
     GVariant *var = g_dbus_proxy_call_finish (G_DBUS_PROXY (source), res, &error);
     if (var) g_variant_unref (var);
 
-    bt_operation_t *btop = (bt_operation_t *) vol->bt_ops->data;
+    btop->pending = FALSE;
+    if (btop->cancelled)
+    {
+        if (error) g_error_free (error);
+        bt_operation_free (btop);
+        return;
+    }
 
     if (error)
     {
         DEBUG ("Connect error %s", error->message);
 
-        // update dialog to show a warning
-        bt_connect_dialog_update (vol, error->message);
-        g_error_free (error);
-        if (btop->conn_disc == RECONNECT)
+        // devices which are briefly out of range or busy often connect on a later attempt
+        if (bt_error_is_transient (error) && btop->retries < btop->vol->bt_retries)
         {
-            if (btop->direction != OUTPUT) vsystem ("rm -f ~/.btin");
-            if (btop->direction != INPUT) vsystem ("rm -f ~/.btout");
+            int delay = BT_RETRY_DELAY << btop->retries;
+            btop->retries++;
+            DEBUG ("Retrying connect %d of %d in %d ms", btop->retries, btop->vol->bt_retries, delay);
+            btop->source_id = g_timeout_add (delay, bt_retry_connect, btop);
+            g_error_free (error);
+            return;
         }
+
+        // update dialog to show a warning
+        bt_connect_dialog_update (btop->vol, error->message);
+
+        // only forget a saved device if the error is not one which might go away
+        if (!bt_error_is_transient (error)) bt_forget_saved (btop);
+        g_error_free (error);
+        btop->failed = TRUE;
+        bt_operation_done (btop);
     }
     else
     {
         DEBUG ("Connected OK - polling for profile");
+        bt_phase_done (btop, BT_PHASE_CONNECT);
 
         // start polling for the PulseAudio profile of the device
-        vol->bt_profile_count = 0;
-        g_idle_add (bt_get_profile, vol);
+        btop->connect = FALSE;
+        btop->profile_count = 0;
+        btop->source_id = g_idle_add (bt_get_profile, btop);
     }
 }
 
+/* Timer callback to retry a failed connect */
+
+static gboolean bt_retry_connect (gpointer user_data)
+{
+    bt_operation_t *btop = (bt_operation_t *) user_data;
+
+    btop->source_id = 0;
+    bt_connect_device (btop);
+    return FALSE;
+}
+
+/* Check whether a D-Bus error is one which a retry might fix - timeouts, and BlueZ errors for devices out of range or busy */
+
+static gboolean bt_error_is_transient (GError *error)
+{
+    static const char *transient[] =
+    {
+        "br-connection-page-timeout",
+        "br-connection-busy",
+        "br-connection-create-socket",
+        "le-connection-abort-by-local",
+        "org.bluez.Error.InProgress",
+        "Host is down",
+        NULL
+    };
+    const char **msg;
+
+    if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT)) return TRUE;
+    for (msg = transient; *msg; msg++)
+        if (strstr (error->message, *msg)) return TRUE;
+    return FALSE;
+}
+
+/* Remove a device which could not be connected from the saved settings */
+
+static void bt_forget_saved (bt_operation_t *btop)
+{
+    if (!btop->saved) return;
+    if (btop->direction & INPUT) vsystem ("rm -f ~/.btin");
+    if (btop->direction & OUTPUT) vsystem ("rm -f ~/.btout");
+}
+
 /* Function polled after connection to get profile to confirm PA has found the device */
 
 static gboolean bt_get_profile (gpointer user_data)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) user_data;
-    bt_operation_t *btop = (bt_operation_t *) vol->bt_ops->data;
-    char *paname, *pacard, *msg;
+    bt_operation_t *btop = (bt_operation_t *) user_data;
+    VolumePulsePlugin *vol = btop->vol;
+    char paname[BT_NAME_LEN], pacard[BT_NAME_LEN], *msg;
+    gboolean ok;
 
-    // some devices take a very long time to be valid PulseAudio cards after connection
-    pacard = bt_to_pa_name (btop->device, "card", NULL);
-    pulse_get_profile (vol, pacard);
-    if (vol->pa_profile == NULL && vol->bt_profile_count++ < BT_PULSE_RETRIES)
+    // the device may have been removed since the operation was planned
+    if (bt_to_pa_name (btop->vol, btop->device, "card", NULL, pacard) == NULL)
     {
-        g_free (pacard);
-        return TRUE;
+        DEBUG ("Bluetooth device not indexed - PulseAudio card not known");
+        btop->source_id = 0;
+        bt_connect_dialog_update (vol, _("Device not found by PulseAudio"));
+        btop->failed = TRUE;
+        bt_operation_done (btop);
+        return FALSE;
     }
 
-    DEBUG ("Profile polled %d times", vol->bt_profile_count);
+    // some devices take a very long time to be valid PulseAudio cards after connection
+    pulse_get_profile (vol, pacard);
+    if (vol->pa_profile == NULL && btop->profile_count++ < BT_PULSE_RETRIES) return TRUE;
+    btop->source_id = 0;
+
+    DEBUG ("Profile polled %d times", btop->profile_count);
 
     if (vol->pa_profile == NULL)
     {
@@ -402,55 +1100,54 @@ static gboolean bt_get_profile (gpointer user_data)
 
         // update dialog to show a warning
         bt_connect_dialog_update (vol, _("Device not found by PulseAudio"));
+        btop->failed = TRUE;
     }
     else
     {
         DEBUG ("Bluetooth device found by PulseAudio with profile %s", vol->pa_profile);
-        if (!pulse_set_profile (vol, pacard, btop->direction == OUTPUT && vol->bt_force_hsp == FALSE ? "a2dp_sink" : "headset_head_unit"))
+        bt_phase_done (btop, BT_PHASE_CARD);
+        btop->profile = bt_card_headset_profile (vol, btop->profile);
+        btop->fallback = bt_card_headset_profile (vol, btop->fallback);
+        ok = pulse_set_profile (vol, pacard, btop->profile);
+        if (!ok && g_strcmp0 (btop->profile, btop->fallback))
+        {
+            // the pinned profile may be for a codec which is no longer available
+            DEBUG ("Profile %s not available - using %s", btop->profile, btop->fallback);
+            btop->profile = btop->fallback;
+            ok = pulse_set_profile (vol, pacard, btop->profile);
+        }
+        if (!ok)
         {
-            DEBUG ("Failed to set device profile : %s", vol->pa_error_msg);
-            msg = g_strdup_printf (_("Could not set profile for device : %s"), vol->pa_error_msg);
+            DEBUG ("Failed to set device profile : %s", pa_strerror (vol->pa_error));
+            msg = g_strdup_printf (_("Could not set profile for device : %s"), pa_strerror (vol->pa_error));
             bt_connect_dialog_update (vol, msg);
             g_free (msg);
+            btop->failed = TRUE;
         }
         else
         {
-            if (btop->direction == OUTPUT && vol->bt_force_hsp == FALSE)
-            {
-                DEBUG ("Profile set to a2dp_sink");
-            }
-            else
-            {
-                DEBUG ("Profile set to headset_head_unit");
-            }
+            DEBUG ("Profile set to %s", btop->profile);
+            bt_phase_done (btop, BT_PHASE_PROFILE);
+            pulse_restore_latency_offsets (vol, pacard);
 
-            if (btop->direction != OUTPUT)
+            if (btop->direction & INPUT)
             {
-                paname = bt_to_pa_name (btop->device, "source", "headset_head_unit");
+                bt_to_pa_name (btop->vol, btop->device, "source", bt_profile_node (btop->profile), paname);
                 pulse_change_source (vol, paname);
                 vsystem ("echo %s > ~/.btin", btop->device);
-                g_free (paname);
             }
 
-            if (btop->direction != INPUT)
+            if (btop->direction & OUTPUT)
             {
-                paname = bt_to_pa_name (btop->device, "sink", btop->direction == OUTPUT && vol->bt_force_hsp == FALSE ? "a2dp_sink" : "headset_head_unit");
+                bt_to_pa_name (btop->vol, btop->device, "sink", bt_profile_node (btop->profile), paname);
                 pulse_change_sink (vol, paname);
                 vsystem ("echo %s > ~/.btout", btop->device);
-                g_free (paname);
             }
+            bt_phase_done (btop, BT_PHASE_DEFAULT);
         }
-
-        if ((vol->bt_input == FALSE || btop->direction != OUTPUT) && !gtk_widget_is_visible (vol->conn_ok))
-            close_widget (&vol->conn_dialog);
     }
-    g_free (pacard);
-
-    pulse_unmute_all_streams (vol);
 
-    bt_next_operation (vol);
-
-    volumepulse_update_display (vol);
+    bt_operation_done (btop);
     return FALSE;
 }
 
@@ -458,10 +1155,19 @@ static gboolean bt_get_profile (gpointer user_data)
 
 static void bt_cb_trusted (GObject *source, GAsyncResult *res, gpointer user_data)
 {
+    bt_operation_t *btop = (bt_operation_t *) user_data;
     GError *error = NULL;
     GVariant *var = g_dbus_proxy_call_finish (G_DBUS_PROXY (source), res, &error);
     if (var) g_variant_unref (var);
 
+    if (btop->cancelled)
+    {
+        btop->pending = FALSE;
+        if (error) g_error_free (error);
+        bt_operation_free (btop);
+        return;
+    }
+
     if (error)
     {
         DEBUG ("Trusting error %s", error->message);
@@ -471,24 +1177,33 @@ static void bt_cb_trusted (GObject *source, GAsyncResult *res, gpointer user_dat
     {
         DEBUG ("Trusted OK");
     }
+    bt_phase_done (btop, BT_PHASE_TRUST);
+
+    // a failure to trust is not fatal, so connect anyway
+    g_dbus_proxy_call (G_DBUS_PROXY (source), "Connect", NULL, G_DBUS_CALL_FLAGS_NONE, btop->vol->bt_connect_timeout, btop->cancellable, bt_cb_connected, btop);
 }
 
 /* Disconnect a BlueZ device */
 
-static void bt_disconnect_device (VolumePulsePlugin *vol, const char *device)
+static void bt_disconnect_device (bt_operation_t *btop)
 {
-    GDBusInterface *interface = g_dbus_object_manager_get_interface (vol->bt_objmanager, device, "org.bluez.Device1");
-    DEBUG ("Disconnecting device %s...", device);
+    VolumePulsePlugin *vol = btop->vol;
+    GDBusInterface *interface = NULL;
+
+    DEBUG ("Disconnecting device %s...", btop->device);
+    btop->disconnect = FALSE;
+    if (vol->bt_objmanager) interface = g_dbus_object_manager_get_interface (vol->bt_objmanager, btop->device, "org.bluez.Device1");
     if (interface)
     {
         // call the disconnect method on BlueZ
-        g_dbus_proxy_call (G_DBUS_PROXY (interface), "Disconnect", NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, bt_cb_disconnected, vol);
+        btop->pending = TRUE;
+        g_dbus_proxy_call (G_DBUS_PROXY (interface), "Disconnect", NULL, G_DBUS_CALL_FLAGS_NONE, vol->bt_call_timeout, btop->cancellable, bt_cb_disconnected, btop);
         g_object_unref (interface);
     }
     else
     {
         DEBUG ("Couldn't get device interface from object manager - device probably already disconnected");
-        bt_next_operation (vol);
+        bt_do_operation (btop);
     }
 }
 
@@ -496,11 +1211,19 @@ static void bt_disconnect_device (VolumePulsePlugin *vol, const char *device)
 
 static void bt_cb_disconnected (GObject *source, GAsyncResult *res, gpointer user_data)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) user_data;
+    bt_operation_t *btop = (bt_operation_t *) user_data;
     GError *error = NULL;
     GVariant *var = g_dbus_proxy_call_finish (G_DBUS_PROXY (source), res, &error);
     if (var) g_variant_unref (var);
 
+    btop->pending = FALSE;
+    if (btop->cancelled)
+    {
+        if (error) g_error_free (error);
+        bt_operation_free (btop);
+        return;
+    }
+
     if (error)
     {
         DEBUG ("Disconnect error %s", error->message);
@@ -510,8 +1233,10 @@ static void bt_cb_disconnected (GObject *source, GAsyncResult *res, gpointer use
     {
         DEBUG ("Disconnected OK");
     }
+    bt_phase_done (btop, BT_PHASE_DISCONNECT);
 
-    bt_next_operation (vol);
+    // carry on with the connect, if there is one
+    bt_do_operation (btop);
 }
 
 /* Check to see if a device has a particular service; i.e. is it input or output */
@@ -549,6 +1274,9 @@ static void bt_connect_dialog_show (VolumePulsePlugin *vol, const char *fmt, ...
     g_vasprintf (&msg, fmt, arg);
     va_end (arg);
 
+    // replace any dialog left over from a cancelled operation
+    if (vol->conn_dialog) close_widget (&vol->conn_dialog);
+
     textdomain (GETTEXT_PACKAGE);
 
     builder = gtk_builder_new_from_file (PACKAGE_DATA_DIR "/ui/lxpanel-modal.ui");
@@ -596,43 +1324,89 @@ static void bt_connect_dialog_ok (GtkButton *button, VolumePulsePlugin *vol)
 
 void bluetooth_init (VolumePulsePlugin *vol)
 {
+    int val;
+
+    /* Read timeout and retry settings */
+    if (!config_setting_lookup_int (vol->settings, "BluetoothTimeout", &val) || val <= 0) val = BT_CALL_TIMEOUT;
+    vol->bt_call_timeout = val * 1000;
+    if (!config_setting_lookup_int (vol->settings, "BluetoothConnectTimeout", &val) || val <= 0) val = BT_CONNECT_TIMEOUT;
+    vol->bt_connect_timeout = val * 1000;
+    if (!config_setting_lookup_int (vol->settings, "BluetoothRetries", &val) || val < 0) val = BT_RETRIES;
+    vol->bt_retries = val;
+
     /* Reset Bluetooth variables */
-    vol->bt_oname = NULL;
-    vol->bt_iname = NULL;
     vol->bt_ops = NULL;
+    vol->bt_history_next = 0;
+    vol->bt_history_batch = 0;
+    vol->bt_start_time = vol->input_control ? 0 : g_get_monotonic_time ();
+    vol->bt_devices = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    vol->bt_path_index = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    vol->bt_addr_index = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    vol->bt_transports = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    vol->bt_transport = NULL;
+    vol->bt_transport_sink = NULL;
+    vol->bt_volume_cancellable = g_cancellable_new ();
+    vol->bt_volume_pending = 0;
+    vol->bt_volume_failed = FALSE;
+
+    vol->bt_cancellable = NULL;
 
     /* Set up callbacks to see if BlueZ is on D-Bus */
-    if (vol->input_control)
-        vol->bt_watcher_id = g_bus_watch_name (G_BUS_TYPE_SYSTEM, "org.bluez", 0, bt_cb_name_owned_norc, bt_cb_name_unowned, vol, NULL);
-    else
-        vol->bt_watcher_id = g_bus_watch_name (G_BUS_TYPE_SYSTEM, "org.bluez", 0, bt_cb_name_owned, bt_cb_name_unowned, vol, NULL);
+    vol->bt_watcher_id = g_bus_watch_name (G_BUS_TYPE_SYSTEM, "org.bluez", 0, bt_cb_name_owned, bt_cb_name_unowned, vol, NULL);
 }
 
 /* Teardown BlueZ interface */
 
 void bluetooth_terminate (VolumePulsePlugin *vol)
 {
-    /* Remove signal handlers on D-Bus object manager */
-    if (vol->bt_objmanager)
+    /* Cancel any device operations in progress */
+    bt_cancel_operations (vol);
+
+    /* Cancel any hardware volume changes in progress */
+    g_cancellable_cancel (vol->bt_volume_cancellable);
+    g_clear_object (&vol->bt_volume_cancellable);
+
+    /* Cancel any pending object manager creation */
+    if (vol->bt_cancellable)
     {
-        g_signal_handlers_disconnect_by_func (vol->bt_objmanager, G_CALLBACK (bt_cb_object_removed), vol);
-        g_signal_handlers_disconnect_by_func (vol->bt_objmanager, G_CALLBACK (bt_cb_interface_properties), vol);
-        g_object_unref (vol->bt_objmanager);
+        g_cancellable_cancel (vol->bt_cancellable);
+        g_clear_object (&vol->bt_cancellable);
     }
-    vol->bt_objmanager = NULL;
+
+    /* Remove signal handlers on D-Bus object manager */
+    bt_close_object_manager (vol);
 
     /* Remove the watch on D-Bus */
     g_bus_unwatch_name (vol->bt_watcher_id);
+
+    g_hash_table_destroy (vol->bt_devices);
+    vol->bt_devices = NULL;
+    g_hash_table_destroy (vol->bt_path_index);
+    vol->bt_path_index = NULL;
+    g_hash_table_destroy (vol->bt_addr_index);
+    vol->bt_addr_index = NULL;
+    bt_forget_transport (vol);
+    g_hash_table_destroy (vol->bt_transports);
+    vol->bt_transports = NULL;
 }
 
 /* Check to see if a Bluetooth device is connected */
 
 gboolean bluetooth_is_connected (VolumePulsePlugin *vol, const char *path)
 {
-    GDBusInterface *interface = g_dbus_object_manager_get_interface (vol->bt_objmanager, path, "org.bluez.Device1");
-    GVariant *var = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Connected");
-    gboolean res = g_variant_get_boolean (var);
-    g_variant_unref (var);
+    GDBusInterface *interface;
+    GVariant *var;
+    gboolean res = FALSE;
+
+    if (!vol->bt_objmanager) return FALSE;
+    interface = g_dbus_object_manager_get_interface (vol->bt_objmanager, path, "org.bluez.Device1");
+    if (!interface) return FALSE;
+    var = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Connected");
+    if (var)
+    {
+        res = g_variant_get_boolean (var);
+        g_variant_unref (var);
+    }
     g_object_unref (interface);
     return res;
 }
@@ -641,189 +1415,426 @@ gboolean bluetooth_is_connected (VolumePulsePlugin *vol, const char *path)
 
 void bluetooth_set_output (VolumePulsePlugin *vol, const char *name, const char *label)
 {
-    bt_connect_dialog_show (vol, _("Connecting Bluetooth device '%s' as output..."), label);
+    char *cur_out, *cur_in;
+    const char *new_in;
 
-    pulse_get_default_sink_source (vol);
-    vol->bt_oname = bt_from_pa_name (vol->pa_default_sink);
-    vol->bt_iname = bt_from_pa_name (vol->pa_default_source);
-    if (vol->bt_oname) pulse_mute_all_streams (vol);
-
-    // If there is a current output device, disconnect it
-    if (vol->bt_oname) bt_add_operation (vol, vol->bt_oname, DISCONNECT, OUTPUT);
+    // a new choice replaces any previous one still in progress
+    bt_cancel_operations (vol);
 
-    // The logic below is complicated by adding the ability to use the option of re-selecting an existing output
-    // to force its reconnection as an output only, disconnecting it as an input and forcing it to the A2DP profile.
-    if (!vol->bt_iname)
-    {
-        // No current input device, so just connect new device as output
-        bt_add_operation (vol, name, CONNECT, OUTPUT);
-    }
-    else
-    {
-        // If current input device was not the same as current output device (and hence not already disconnected), disconnect the current input device
-        if (g_strcmp0 (vol->bt_oname, vol->bt_iname)) bt_add_operation (vol, vol->bt_iname, DISCONNECT, INPUT);
-        bt_add_operation (vol, vol->bt_iname, DISCONNECT, INPUT);
+    bt_connect_dialog_show (vol, _("Connecting Bluetooth device '%s' as output..."), label);
 
-        if (g_strcmp0 (vol->bt_iname, name))
-        {
-            // New output device is not the same as current input device, so connect new output and then reconnect existing input
-            bt_add_operation (vol, name, CONNECT, OUTPUT);
-            bt_add_operation (vol, vol->bt_iname, CONNECT, INPUT);
-        }
-        else
-        {
-            // New output device is the same as current input device
+    pulse_get_default_sink_source (vol);
+    cur_out = bt_from_pa_name (vol, vol->pa_default_sink);
+    cur_in = bt_from_pa_name (vol, vol->pa_default_source);
+    if (cur_out) pulse_mute_all_streams (vol);
 
-            if (vol->bt_oname && !g_strcmp0 (vol->bt_oname, name))
-            {
-                // Current output device exists and is the same as new output device, so connect new device as output only to force A2DP when reconnecting
-                bt_add_operation (vol, name, CONNECT, OUTPUT);
-            }
-            else
-            {
-                // No current output device, or current output device is not the same as new output device, so connect new device as both input and output
-                bt_add_operation (vol, name, CONNECT, BOTH); 
-            }
-        }
-    }
+    // Re-selecting an output which is also the current input makes it an output only, so it can use A2DP;
+    // otherwise the current input is kept.
+    if (cur_out && !g_strcmp0 (cur_out, name) && !g_strcmp0 (cur_in, name)) new_in = NULL;
+    else new_in = cur_in;
 
-    vol->bt_input = FALSE;
-    vol->bt_force_hsp = FALSE;
+    bt_plan_operations (vol, cur_out, cur_in, name, new_in, FALSE, 0);
+    g_free (cur_out);
+    g_free (cur_in);
 
-    bt_do_operation (vol);
+    bt_run_operations (vol);
 }
 
 /* Set a BlueZ device as the default PulseAudio source */
 
 void bluetooth_set_input (VolumePulsePlugin *vol, const char *name, const char *label)
 {
+    char *cur_out, *cur_in;
+
+    // a new choice replaces any previous one still in progress
+    bt_cancel_operations (vol);
+
     bt_connect_dialog_show (vol, _("Connecting Bluetooth device '%s' as input..."), label);
 
     pulse_get_default_sink_source (vol);
-    vol->bt_oname = bt_from_pa_name (vol->pa_default_sink);
-    vol->bt_iname = bt_from_pa_name (vol->pa_default_source);
-    if (vol->bt_oname) pulse_mute_all_streams (vol);
+    cur_out = bt_from_pa_name (vol, vol->pa_default_sink);
+    cur_in = bt_from_pa_name (vol, vol->pa_default_source);
+    if (cur_out) pulse_mute_all_streams (vol);
 
-    // If there is a current input device, disconnect it
-    if (vol->bt_iname) bt_add_operation (vol, vol->bt_iname, DISCONNECT, INPUT);
+    // The current output is kept; any device whose roles change uses the headset profile
+    bt_plan_operations (vol, cur_out, cur_in, cur_out, name, TRUE, 0);
+    g_free (cur_out);
+    g_free (cur_in);
 
-    if (vol->bt_oname && !g_strcmp0 (vol->bt_oname, name))
+    bt_run_operations (vol);
+}
+
+/* Remove a BlueZ device which is the current PulseAudio sink */
+
+void bluetooth_remove_output (VolumePulsePlugin *vol)
+{
+    char *cur_out, *cur_in;
+
+    // a new choice replaces any previous one still in progress
+    bt_cancel_operations (vol);
+
+    vsystem ("rm -f ~/.btout");
+    pulse_get_default_sink_source (vol);
+    cur_out = bt_from_pa_name (vol, vol->pa_default_sink);
+    cur_in = bt_from_pa_name (vol, vol->pa_default_source);
+
+    // disconnects the current output, unless it is also the current input
+    if (bt_plan_operations (vol, cur_out, cur_in, NULL, cur_in, FALSE, 0)) bt_run_operations (vol);
+    g_free (cur_out);
+    g_free (cur_in);
+}
+
+/* Remove a BlueZ device which is the current PulseAudio source */
+
+void bluetooth_remove_input (VolumePulsePlugin *vol)
+{
+    char *cur_out, *cur_in;
+
+    // a new choice replaces any previous one still in progress
+    bt_cancel_operations (vol);
+
+    vsystem ("rm -f ~/.btin");
+    pulse_get_default_sink_source (vol);
+    cur_out = bt_from_pa_name (vol, vol->pa_default_sink);
+    cur_in = bt_from_pa_name (vol, vol->pa_default_source);
+
+    // disconnects the current input, unless it is also the current output, in which case it is put into A2DP
+    if (bt_plan_operations (vol, cur_out, cur_in, cur_out, NULL, FALSE, 0))
     {
-        // Current output device exists and is the same as new input device
+        if (cur_in && !g_strcmp0 (cur_out, cur_in)) bt_connect_dialog_show (vol, _("Reconnecting Bluetooth input device as output only..."));
+        bt_run_operations (vol);
+    }
+    g_free (cur_out);
+    g_free (cur_in);
+}
+
+/* Reconnect the current Bluetooth device if the user changes the profile */
+
+void bluetooth_reconnect (VolumePulsePlugin *vol, const char *name, const char *profile)
+{
+    char *btname, *cur_out, *cur_in, adrs[BT_NAME_LEN];
+
+    btname = bt_from_pa_name (vol, name);
+    if (btname == NULL) return;
+
+    bt_cancel_operations (vol);
 
-        // If current output device was not the same as current input device (and hence not already disconnected), disconnect the current output device
-        if (g_strcmp0 (vol->bt_oname, vol->bt_iname)) bt_add_operation (vol, vol->bt_oname, DISCONNECT, OUTPUT);
+    // remember the profile chosen for the device, so it is used when it next connects
+    if (g_strcmp0 (profile, "off") && bt_pa_address (name, adrs))
+        device_setting_set_string (vol, "BluetoothProfile", adrs, profile);
 
-        // Connect the new device as both input and output
-        bt_add_operation (vol, name, CONNECT, BOTH);
+    pulse_get_default_sink_source (vol);
+    cur_out = bt_from_pa_name (vol, vol->pa_default_sink);
+    if (g_strcmp0 (btname, cur_out) || !g_strcmp0 (profile, "off"))
+    {
+        // an output set to "off" is left as it is
+        g_free (cur_out);
+        cur_out = NULL;
     }
-    else
+    cur_in = bt_from_pa_name (vol, vol->pa_default_source);
+    if (g_strcmp0 (btname, cur_in))
+    {
+        g_free (cur_in);
+        cur_in = NULL;
+    }
+    g_free (btname);
+
+    // an input is disconnected, because changing profile can only ever remove an input;
+    // an output is reconnected to make the new profile take effect
+    if (bt_plan_operations (vol, cur_out, cur_in, cur_out, NULL, !bt_profile_is_a2dp (profile), BT_PLAN_FORCE))
     {
-        // No current output device, or current output device is not the same as new input device
+        if (cur_out)
+        {
+            bt_connect_dialog_show (vol, _("Reconnecting Bluetooth device..."));
+            pulse_mute_all_streams (vol);
+        }
+        bt_run_operations (vol);
+    }
+    g_free (cur_out);
+    g_free (cur_in);
+}
+
+/*
+ * Headsets which report their battery level have a Battery1 interface while they
+ * are connected. Its Percentage is shown in the device menu and in the tooltip,
+ * read from the cached property, which BlueZ keeps current by signals.
+ */
 
-        // If current output device was the same as current input device (and hence has been disconnected), reconnect the current output device
-        if (vol->bt_oname && !g_strcmp0 (vol->bt_oname, vol->bt_iname)) bt_add_operation (vol, vol->bt_oname, CONNECT, OUTPUT);
+static int bt_battery_level (VolumePulsePlugin *vol, const char *path)
+{
+    GDBusInterface *interface;
+    GVariant *var;
+    int level = -1;
 
-        // Connect the new device as input
-        bt_add_operation (vol, name, CONNECT, INPUT);
+    if (!vol->bt_objmanager || !path) return -1;
+    interface = g_dbus_object_manager_get_interface (vol->bt_objmanager, path, "org.bluez.Battery1");
+    if (!interface) return -1;
+    var = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Percentage");
+    if (var)
+    {
+        level = g_variant_get_byte (var);
+        g_variant_unref (var);
     }
+    g_object_unref (interface);
+    return level;
+}
 
-    vol->bt_input = TRUE;
-    vol->bt_force_hsp = TRUE;
+/* Get the battery level of the default Bluetooth output or input, or -1 if there is none */
 
-    bt_do_operation (vol);
+int bluetooth_battery_level (VolumePulsePlugin *vol)
+{
+    char *path;
+    int level;
+
+    path = bt_from_pa_name (vol, vol->input_control ? vol->pa_default_source : vol->pa_default_sink);
+    level = bt_battery_level (vol, path);
+    g_free (path);
+    return level;
 }
 
-/* Remove a BlueZ device which is the current PulseAudio sink */
+/* Create the menu label for a device, including its battery level if known */
 
-void bluetooth_remove_output (VolumePulsePlugin *vol)
+static char *bt_menu_label (VolumePulsePlugin *vol, const char *path, const char *alias)
 {
-    vsystem ("rm -f ~/.btout");
-    pulse_get_default_sink_source (vol);
-    if (strstr (vol->pa_default_sink, "bluez"))
+    int level = bt_battery_level (vol, path);
+
+    if (level < 0) return g_strdup (alias);
+    return g_strdup_printf ("%s (%d%%)", alias, level);
+}
+
+/* Update the menu item and tooltip for a device whose battery level has changed */
+
+static void bt_update_battery (VolumePulsePlugin *vol, const char *path)
+{
+    GDBusInterface *interface;
+    GVariant *var;
+    GList *items, *item;
+    char *label;
+
+    DEBUG ("Bluetooth device %s battery level %d", path, bt_battery_level (vol, path));
+
+    if (vol->menu_devices)
     {
-        if (bt_sink_source_compare (vol->pa_default_sink, vol->pa_default_source))
+        interface = g_dbus_object_manager_get_interface (vol->bt_objmanager, path, "org.bluez.Device1");
+        if (interface)
         {
-            // if the current default sink is Bluetooth and not also the default source, disconnect it
-            vol->bt_oname = bt_from_pa_name (vol->pa_default_sink);
-            bt_add_operation (vol, vol->bt_oname, DISCONNECT, OUTPUT);
-            bt_do_operation (vol);
+            var = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Alias");
+            if (var)
+            {
+                label = bt_menu_label (vol, path, g_variant_get_string (var, NULL));
+                items = gtk_container_get_children (GTK_CONTAINER (vol->menu_devices));
+                for (item = items; item != NULL; item = item->next)
+                    if (!g_strcmp0 (gtk_widget_get_name (GTK_WIDGET (item->data)), path))
+                        gtk_menu_item_set_label (GTK_MENU_ITEM (item->data), label);
+                g_list_free (items);
+                g_free (label);
+                g_variant_unref (var);
+            }
+            g_object_unref (interface);
         }
     }
+
+    // refresh the tooltip if it is showing
+    gtk_widget_trigger_tooltip_query (vol->plugin);
 }
 
-/* Remove a BlueZ device which is the current PulseAudio source */
+/* Callback for interface added - battery levels appear when a device connects */
 
-void bluetooth_remove_input (VolumePulsePlugin *vol)
+static void bt_cb_battery_added (GDBusObjectManager *manager, GDBusObject *object, GDBusInterface *interface, gpointer user_data)
 {
-    vsystem ("rm -f ~/.btin");
-    pulse_get_default_sink_source (vol);
-    if (strstr (vol->pa_default_source, "bluez"))
+    if (!g_strcmp0 (g_dbus_proxy_get_interface_name (G_DBUS_PROXY (interface)), "org.bluez.Battery1"))
+        bt_update_battery ((VolumePulsePlugin *) user_data, g_dbus_object_get_object_path (object));
+}
+
+/* Callback for property change - updates display of battery level */
+
+static void bt_cb_battery_properties (GDBusObjectManagerClient *manager, GDBusObjectProxy *object_proxy, GDBusProxy *proxy, GVariant *parameters, GStrv inval, gpointer user_data)
+{
+    GVariant *var;
+
+    if (g_strcmp0 (g_dbus_proxy_get_interface_name (proxy), "org.bluez.Battery1")) return;
+
+    var = g_variant_lookup_value (parameters, "Percentage", NULL);
+    if (var)
     {
-        if (bt_sink_source_compare (vol->pa_default_sink, vol->pa_default_source))
-        {
-            // if the current default source is Bluetooth and not also the default sink, disconnect it
-            vol->bt_iname = bt_from_pa_name (vol->pa_default_source);
-            bt_add_operation (vol, vol->bt_iname, DISCONNECT, INPUT);
-        }
-        else
+        bt_update_battery ((VolumePulsePlugin *) user_data, g_dbus_proxy_get_object_path (proxy));
+        g_variant_unref (var);
+    }
+}
+
+/*
+ * A2DP headsets which support AVRCP absolute volume have a Volume property on
+ * their media transport. Newer versions of PulseAudio, and PipeWire, give the
+ * sink of such a device hardware volume control, and pass its volume on to the
+ * headset themselves, so the sink volume is used as for any other output. When
+ * the sink does not have hardware volume control, the volume is set and read on
+ * the transport, so the signal is attenuated in the headset rather than scaled
+ * down again in PulseAudio, and changes made with the buttons on the headset
+ * arrive as property change signals rather than needing PulseAudio queries.
+ */
+
+/*
+ * The transport is looked up once each time the default sink changes, and the
+ * result - including there being no transport with a volume - is kept until the
+ * default sink or the set of transports changes, so volume reads and writes need
+ * neither allocations nor a search of the transport index.
+ */
+
+/* Get the media transport of the default output if it has a hardware volume - the proxy is owned by the cache */
+
+static GDBusProxy *bt_get_transport (VolumePulsePlugin *vol)
+{
+    GDBusInterface *interface;
+    GHashTableIter iter;
+    gpointer tpath, dpath;
+    GVariant *var;
+    const char *device;
+    char adrs[BT_NAME_LEN];
+
+    if (vol->input_control || !vol->bt_objmanager || vol->pa_default_sink == NULL) return NULL;
+    if (vol->bt_transport_sink == vol->pa_default_sink) return vol->bt_transport;
+
+    bt_forget_transport (vol);
+    vol->bt_transport_sink = vol->pa_default_sink;
+    if (bt_pa_address (vol->pa_default_sink, adrs) == NULL) return NULL;
+    device = g_hash_table_lookup (vol->bt_addr_index, adrs);
+    if (device == NULL) return NULL;
+
+    g_hash_table_iter_init (&iter, vol->bt_transports);
+    while (g_hash_table_iter_next (&iter, &tpath, &dpath))
+    {
+        if (g_strcmp0 (dpath, device)) continue;
+        interface = g_dbus_object_manager_get_interface (vol->bt_objmanager, tpath, "org.bluez.MediaTransport1");
+        if (interface == NULL) continue;
+        var = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Volume");
+        if (var)
         {
-            // if the current default source and sink are both the same device, disconnect it and reconnect to
-            // put it into A2DP rather than HSP
-            bt_connect_dialog_show (vol, _("Reconnecting Bluetooth input device as output only..."));
-            vol->bt_oname = bt_from_pa_name (vol->pa_default_sink);
-            bt_add_operation (vol, vol->bt_oname, CONNECT, OUTPUT);
-            vol->bt_input = FALSE;
-            vol->bt_force_hsp = FALSE;
+            g_variant_unref (var);
+            DEBUG ("Media transport %s has hardware volume", (char *) tpath);
+            vol->bt_transport = G_DBUS_PROXY (interface);
+            return vol->bt_transport;
         }
+        g_object_unref (interface);
+    }
+    return NULL;
+}
+
+/* Drop the cached media transport, so it is looked up again when next needed */
 
-        bt_do_operation (vol);
+static void bt_forget_transport (VolumePulsePlugin *vol)
+{
+    g_clear_object (&vol->bt_transport);
+    vol->bt_transport_sink = NULL;
+}
+
+/* Get the hardware volume of the default output as 0-100, or -1 if it does not have one */
+
+int bluetooth_get_volume (VolumePulsePlugin *vol)
+{
+    GDBusProxy *proxy;
+    GVariant *var;
+    int volume = -1;
+
+    proxy = bt_get_transport (vol);
+    if (proxy == NULL) return -1;
+    var = g_dbus_proxy_get_cached_property (proxy, "Volume");
+    if (var)
+    {
+        volume = (g_variant_get_uint16 (var) * 100 + BT_MAX_VOLUME / 2) / BT_MAX_VOLUME;
+        g_variant_unref (var);
     }
+    return volume;
 }
 
-/* Reconnect the current Bluetooth device if the user changes the profile */
+/* Set the hardware volume of the default output from 0-100 - returns FALSE if it does not have one */
 
-void bluetooth_reconnect (VolumePulsePlugin *vol, const char *name, const char *profile)
+gboolean bluetooth_set_volume (VolumePulsePlugin *vol, int volume)
 {
-    char *btname = bt_from_pa_name (name);
-    if (btname == NULL) return;
+    GDBusProxy *proxy;
+    GVariant *var;
+    guint16 level;
 
-    pulse_get_default_sink_source (vol);
-    vol->bt_oname = bt_from_pa_name (vol->pa_default_sink);
-    if (g_strcmp0 (btname, vol->bt_oname))
+    proxy = bt_get_transport (vol);
+    if (proxy == NULL) return FALSE;
+
+    if (volume < 0) volume = 0;
+    if (volume > 100) volume = 100;
+    level = (volume * BT_MAX_VOLUME + 50) / 100;
+    DEBUG ("Setting Bluetooth hardware volume %d", level);
+
+    // keep the level from before a run of changes, to put back if the last of them fails
+    if (vol->bt_volume_pending++ == 0)
     {
-        g_free (vol->bt_oname);
-        vol->bt_oname = NULL;
+        var = g_dbus_proxy_get_cached_property (proxy, "Volume");
+        vol->bt_volume_good = var ? g_variant_get_uint16 (var) : level;
+        if (var) g_variant_unref (var);
     }
-    vol->bt_iname = bt_from_pa_name (vol->pa_default_source);
-    if (g_strcmp0 (btname, vol->bt_iname))
+
+    // update the cached value straight away, so reads before the change signal arrives are consistent - the same variant is sent
+    var = g_variant_ref_sink (g_variant_new_uint16 (level));
+    g_dbus_proxy_set_cached_property (proxy, "Volume", var);
+    g_dbus_proxy_call (proxy, "org.freedesktop.DBus.Properties.Set",
+        g_variant_new ("(ssv)", "org.bluez.MediaTransport1", "Volume", var),
+        G_DBUS_CALL_FLAGS_NONE, vol->bt_call_timeout, vol->bt_volume_cancellable, bt_cb_volume_set, vol);
+    g_variant_unref (var);
+    return TRUE;
+}
+
+/* Callback for hardware volume set - if the last change failed, the cached value is put back to the level the headset last accepted */
+
+static void bt_cb_volume_set (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) user_data;
+    GError *error = NULL;
+    GVariant *var = g_dbus_proxy_call_finish (G_DBUS_PROXY (source), res, &error);
+    if (var) g_variant_unref (var);
+
+    if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
     {
-        g_free (vol->bt_iname);
-        vol->bt_iname = NULL;
+        g_error_free (error);
+        return;
     }
-    g_free (btname);
-    if (vol->bt_oname == NULL && vol->bt_iname == NULL) return;
 
-    // disconnect the device if it was an input; don't reconnect, because it was either connected as 
-    // headset, or not connected, so changing profile can only ever disconnect an input...
-    if (vol->bt_iname)
+    vol->bt_volume_pending--;
+    if (error)
     {
-        bt_add_operation (vol, vol->bt_iname, DISCONNECT, INPUT);
-        // in an ideal world, we'd remove the input device as the default Pulse source here, but that seems impossible...
+        DEBUG ("Volume set error %s", error->message);
+        vol->bt_volume_failed = TRUE;
+        g_error_free (error);
     }
+    else vol->bt_volume_failed = FALSE;
+    if (vol->bt_volume_pending) return;
 
-    // if it was an output, reconnect it if the new profile is anything but "off"
-    if (vol->bt_oname && g_strcmp0 (profile, "off"))
+    if (vol->bt_volume_failed)
     {
-        bt_connect_dialog_show (vol, _("Reconnecting Bluetooth device..."));
-        pulse_mute_all_streams (vol);
-        bt_add_operation (vol, vol->bt_oname, CONNECT, OUTPUT);
-        vol->bt_input = FALSE;
-        if (!g_strcmp0 (profile, "headset_head_unit")) vol->bt_force_hsp = TRUE;
-        else vol->bt_force_hsp = FALSE;
+        DEBUG ("Restoring Bluetooth hardware volume %d", vol->bt_volume_good);
+        g_dbus_proxy_set_cached_property (G_DBUS_PROXY (source), "Volume", g_variant_new_uint16 (vol->bt_volume_good));
+        vol->bt_volume_failed = FALSE;
+        if (G_DBUS_PROXY (source) == vol->bt_transport) volumepulse_update_display (vol);
     }
+}
+
+/* Callback for property change - updates display if the hardware volume of the default output changes */
+
+static void bt_cb_transport_properties (GDBusObjectManagerClient *manager, GDBusObjectProxy *object_proxy, GDBusProxy *proxy, GVariant *parameters, GStrv inval, gpointer user_data)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) user_data;
+    GVariant *var;
+
+    if (g_strcmp0 (g_dbus_proxy_get_interface_name (proxy), "org.bluez.MediaTransport1")) return;
+
+    // the cached value is read rather than the changed properties, as looking those up creates a new variant
+    var = g_dbus_proxy_get_cached_property (proxy, "Volume");
+    if (var == NULL) return;
+    g_variant_unref (var);
 
-    bt_do_operation (vol);
+    // a transport may only gain its volume after connection, so look it up again if none was found
+    if (vol->bt_transport == NULL) bt_forget_transport (vol);
+    if (bt_get_transport (vol) == proxy)
+    {
+        DEBUG ("Bluetooth hardware volume changed");
+        volumepulse_update_display (vol);
+    }
 }
 
 /* Loop through the devices BlueZ knows about, adding them to the device menu */
@@ -831,7 +1842,15 @@ void bluetooth_reconnect (VolumePulsePlugin *vol, const char *name, const char *
 void bluetooth_add_devices_to_menu (VolumePulsePlugin *vol)
 {
     vol->separator = FALSE;
-    if (vol->bt_objmanager)
+    if (vol->bt_cancellable)
+    {
+        // object manager is still being created - show a placeholder
+        GtkWidget *mi = gtk_menu_item_new_with_label (_("Loading Bluetooth devices..."));
+        gtk_widget_set_sensitive (mi, FALSE);
+        menu_add_separator (vol, vol->menu_devices);
+        gtk_menu_shell_append (GTK_MENU_SHELL (vol->menu_devices), mi);
+    }
+    else if (vol->bt_objmanager)
     {
         // iterate all the objects the manager knows about
         GList *objects = g_dbus_object_manager_get_objects (vol->bt_objmanager);
@@ -846,7 +1865,9 @@ void bluetooth_add_devices_to_menu (VolumePulsePlugin *vol)
                 GDBusInterface *interface = G_DBUS_INTERFACE (interfaces->data);
                 if (g_strcmp0 (g_dbus_proxy_get_interface_name (G_DBUS_PROXY (interface)), "org.bluez.Device1") == 0)
                 {
-                    if (bt_has_service (vol, g_dbus_proxy_get_object_path (G_DBUS_PROXY (interface)), vol->input_control ? BT_SERV_HSP : BT_SERV_AUDIO_SINK))
+                    const char *path = g_dbus_proxy_get_object_path (G_DBUS_PROXY (interface));
+                    if (vol->input_control ? bt_has_service (vol, path, BT_SERV_HSP) || bt_has_service (vol, path, BT_SERV_HFP)
+                        : bt_has_service (vol, path, BT_SERV_AUDIO_SINK))
                     {
                         GVariant *name = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Alias");
                         GVariant *icon = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Icon");
@@ -855,8 +1876,10 @@ void bluetooth_add_devices_to_menu (VolumePulsePlugin *vol)
                         if (name && icon && paired && trusted && g_variant_get_boolean (paired) && g_variant_get_boolean (trusted))
                         {
                             // create a menu if there isn't one already
+                            char *label = bt_menu_label (vol, objpath, g_variant_get_string (name, NULL));
                             menu_add_separator (vol, vol->menu_devices);
-                            menu_add_item (vol, g_variant_get_string (name, NULL), objpath);
+                            menu_add_item (vol, label, objpath);
+                            g_free (label);
                         }
                         g_variant_unref (name);
                         g_variant_unref (icon);
@@ -892,6 +1915,7 @@ void bluetooth_add_devices_to_profile_dialog (VolumePulsePlugin *vol)
                 if (g_strcmp0 (g_dbus_proxy_get_interface_name (G_DBUS_PROXY (interface)), "org.bluez.Device1") == 0)
                 {
                     if (bt_has_service (vol, g_dbus_proxy_get_object_path (G_DBUS_PROXY (interface)), BT_SERV_HSP)
+                        || bt_has_service (vol, g_dbus_proxy_get_object_path (G_DBUS_PROXY (interface)), BT_SERV_HFP)
                         || bt_has_service (vol, g_dbus_proxy_get_object_path (G_DBUS_PROXY (interface)), BT_SERV_AUDIO_SINK))
                     {
                         GVariant *name = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Alias");
@@ -901,8 +1925,9 @@ void bluetooth_add_devices_to_profile_dialog (VolumePulsePlugin *vol)
                         if (name && icon && paired && trusted && g_variant_get_boolean (paired) && g_variant_get_boolean (trusted))
                         {
                             // only disconnected devices here...
-                            char *pacard = bt_to_pa_name ((char *) objpath, "card", NULL);
-                            pulse_get_profile (vol, pacard);
+                            char pacard[BT_NAME_LEN];
+                            if (bt_to_pa_name (vol, objpath, "card", NULL, pacard)) pulse_get_profile (vol, pacard);
+                            else vol->pa_profile = NULL;
                             if (vol->pa_profile == NULL)
                                 profiles_dialog_add_combo (vol, NULL, vol->profiles_bt_box, 0, g_variant_get_string (name, NULL), NULL);
                         }
@@ -920,45 +1945,73 @@ void bluetooth_add_devices_to_profile_dialog (VolumePulsePlugin *vol)
     }
 }
 
-/* Loop through the devices BlueZ knows about, counting them */
+/*
+ * The number of paired and trusted devices which support the relevant direction is
+ * kept as a set of object paths, built when BlueZ appears on D-Bus and then updated
+ * from object manager signals, so the count can be read without walking all objects.
+ */
 
-int bluetooth_count_devices (VolumePulsePlugin *vol, gboolean input)
+int bluetooth_count_devices (VolumePulsePlugin *vol)
 {
-    int count = 0;
-    if (vol->bt_objmanager)
+    return g_hash_table_size (vol->bt_devices);
+}
+
+/* Check whether a device should be counted and add or remove it from the set - returns TRUE if the set changed */
+
+static gboolean bt_update_device_count (VolumePulsePlugin *vol, GDBusProxy *proxy)
+{
+    const char *path = g_dbus_proxy_get_object_path (proxy);
+    const char *service = vol->input_control ? BT_SERV_HSP : BT_SERV_AUDIO_SINK;
+    gboolean counted = FALSE;
+    GVariantIter iter;
+
+    GVariant *uuids = g_dbus_proxy_get_cached_property (proxy, "UUIDs");
+    GVariant *name = g_dbus_proxy_get_cached_property (proxy, "Alias");
+    GVariant *icon = g_dbus_proxy_get_cached_property (proxy, "Icon");
+    GVariant *paired = g_dbus_proxy_get_cached_property (proxy, "Paired");
+    GVariant *trusted = g_dbus_proxy_get_cached_property (proxy, "Trusted");
+    if (uuids && name && icon && paired && trusted && g_variant_get_boolean (paired) && g_variant_get_boolean (trusted))
     {
-        // iterate all the objects the manager knows about
-        GList *objects = g_dbus_object_manager_get_objects (vol->bt_objmanager);
-        while (objects != NULL)
+        const char *uuid;
+        g_variant_iter_init (&iter, uuids);
+        while (!counted && g_variant_iter_next (&iter, "&s", &uuid))
+            if (!strncasecmp (uuid, service, 8) || (vol->input_control && !strncasecmp (uuid, BT_SERV_HFP, 8))) counted = TRUE;
+    }
+    if (uuids) g_variant_unref (uuids);
+    if (name) g_variant_unref (name);
+    if (icon) g_variant_unref (icon);
+    if (paired) g_variant_unref (paired);
+    if (trusted) g_variant_unref (trusted);
+
+    if (counted == g_hash_table_contains (vol->bt_devices, path)) return FALSE;
+
+    DEBUG ("Bluetooth device %s %s count", path, counted ? "added to" : "removed from");
+    if (counted) g_hash_table_add (vol->bt_devices, g_strdup (path));
+    else g_hash_table_remove (vol->bt_devices, path);
+    return TRUE;
+}
+
+/* Loop through the devices BlueZ knows about, building the set of counted devices */
+
+static void bt_count_all_devices (VolumePulsePlugin *vol)
+{
+    GList *objects, *obj;
+    GDBusInterface *interface;
+
+    g_hash_table_remove_all (vol->bt_devices);
+    if (!vol->bt_objmanager) return;
+
+    objects = g_dbus_object_manager_get_objects (vol->bt_objmanager);
+    for (obj = objects; obj != NULL; obj = obj->next)
+    {
+        interface = g_dbus_object_get_interface (G_DBUS_OBJECT (obj->data), "org.bluez.Device1");
+        if (interface)
         {
-            GDBusObject *object = (GDBusObject *) objects->data;
-            GList *interfaces = g_dbus_object_get_interfaces (object);
-            while (interfaces != NULL)
-            {
-                // if an object has a Device1 interface, it is a Bluetooth device - add it to the list
-                GDBusInterface *interface = G_DBUS_INTERFACE (interfaces->data);
-                if (g_strcmp0 (g_dbus_proxy_get_interface_name (G_DBUS_PROXY (interface)), "org.bluez.Device1") == 0)
-                {
-                    if (bt_has_service (vol, g_dbus_proxy_get_object_path (G_DBUS_PROXY (interface)), input ? BT_SERV_HSP : BT_SERV_AUDIO_SINK))
-                    {
-                        GVariant *name = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Alias");
-                        GVariant *icon = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Icon");
-                        GVariant *paired = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Paired");
-                        GVariant *trusted = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), "Trusted");
-                        if (name && icon && paired && trusted && g_variant_get_boolean (paired) && g_variant_get_boolean (trusted)) count++;
-                        g_variant_unref (name);
-                        g_variant_unref (icon);
-                        g_variant_unref (paired);
-                        g_variant_unref (trusted);
-                    }
-                    break;
-                }
-                interfaces = interfaces->next;
-            }
-            objects = objects->next;
+            bt_update_device_count (vol, G_DBUS_PROXY (interface));
+            g_object_unref (interface);
         }
     }
-    return count;
+    g_list_free_full (objects, g_object_unref);
 }
 
 /* End of file */
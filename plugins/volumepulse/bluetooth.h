@@ -40,7 +40,12 @@ extern void bluetooth_reconnect (VolumePulsePlugin *vol, const char *name, const
 
 extern void bluetooth_add_devices_to_menu (VolumePulsePlugin *vol);
 extern void bluetooth_add_devices_to_profile_dialog (VolumePulsePlugin *vol);
-extern int bluetooth_count_devices (VolumePulsePlugin *vol, gboolean input);
+extern int bluetooth_count_devices (VolumePulsePlugin *vol);
+extern void bluetooth_index_device (VolumePulsePlugin *vol, const char *path, const char *address);
+extern gboolean bluetooth_is_pa_device (VolumePulsePlugin *vol, const char *path, const char *pa_name);
+extern int bluetooth_battery_level (VolumePulsePlugin *vol);
+extern int bluetooth_get_volume (VolumePulsePlugin *vol);
+extern gboolean bluetooth_set_volume (VolumePulsePlugin *vol, int volume);
 
 /* End of file */
 /*----------------------------------------------------------------------------*/
@@ -31,16 +31,47 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "commongui.h"
 
+/*----------------------------------------------------------------------------*/
+/* Local macros and definitions                                               */
+/*----------------------------------------------------------------------------*/
+
+#define SCROLL_STEP     2           /* Volume change for one notch of a scroll wheel */
+#define SCROLL_IDLE     250000      /* Time in us after last scroll event before a gesture is over */
+#define STREAMS_HEIGHT  240         /* Height in pixels of list of application streams before it scrolls */
+
+typedef struct {
+    VolumePulsePlugin *vol;             /* Plugin whose popup contains the row */
+    uint32_t index;                     /* Index of stream */
+    GtkWidget *box;                     /* Row containing controls for stream */
+    GtkWidget *label;                   /* Application name */
+    char *media;                        /* Media name currently shown as tooltip */
+    GtkWidget *scale;                   /* Scale for volume */
+    GtkWidget *mute_check;              /* Checkbox for mute state */
+    gulong scale_handler;               /* Handler for scale widget */
+    gulong mute_handler;                /* Handler for mute_check widget */
+    int channels;                       /* Number of channels in stream */
+    int level;                          /* Volume level currently shown on scale */
+    int mute;                           /* Mute state currently shown on checkbox */
+    gboolean stale;                     /* Flag to show stream was not found by a full update */
+} stream_row_t;
+
 /*----------------------------------------------------------------------------*/
 /* Static function prototypes                                                 */
 /*----------------------------------------------------------------------------*/
 
-static void popup_window_show (GtkWidget *p);
+static void popup_window_create (VolumePulsePlugin *vol);
+static void popup_window_show (VolumePulsePlugin *vol);
+static void popup_window_hide (VolumePulsePlugin *vol);
 static void popup_window_scale_changed (GtkRange *range, VolumePulsePlugin *vol);
 static void popup_window_scale_pressed (GtkWidget *widget, GdkEventButton *event, VolumePulsePlugin *vol);
 static void popup_window_mute_toggled (GtkWidget *widget, VolumePulsePlugin *vol);
 static gboolean popup_mapped (GtkWidget *widget, GdkEvent *event, VolumePulsePlugin *vol);
 static gboolean popup_button_press (GtkWidget *widget, GdkEventButton *event, VolumePulsePlugin *vol);
+static void popup_streams_show (VolumePulsePlugin *vol);
+static void popup_stream_free (gpointer data);
+static void popup_stream_scale_changed (GtkRange *range, stream_row_t *row);
+static void popup_stream_mute_toggled (GtkWidget *widget, stream_row_t *row);
+static gboolean volumepulse_scroll_tick (GtkWidget *widget, GdkFrameClock *clock, gpointer user_data);
 
 /*----------------------------------------------------------------------------*/
 /* Generic helper functions                                                   */
@@ -101,17 +132,88 @@ void close_widget (GtkWidget **wid)
     }
 }
 
+/*
+ * Per-device settings are held in the plugin settings, under the setting name with
+ * the device name appended, and with any characters not valid in a name replaced.
+ */
+
+static char *device_setting_name (const char *setting, const char *device)
+{
+    char *name, *ptr;
+
+    name = g_strdup_printf ("%s_%s", setting, device);
+    for (ptr = name; *ptr; ptr++) if (!g_ascii_isalnum (*ptr)) *ptr = '_';
+    return name;
+}
+
+/* Read a string setting for a device - returns NULL if not set */
+
+const char *device_setting_get_string (VolumePulsePlugin *vol, const char *setting, const char *device)
+{
+    const char *value = NULL;
+    char *name = device_setting_name (setting, device);
+
+    if (!config_setting_lookup_string (vol->settings, name, &value)) value = NULL;
+    g_free (name);
+    return value;
+}
+
+/* Read an integer setting for a device - returns FALSE if not set */
+
+gboolean device_setting_get_int (VolumePulsePlugin *vol, const char *setting, const char *device, int *value)
+{
+    char *name = device_setting_name (setting, device);
+    gboolean res = config_setting_lookup_int (vol->settings, name, value);
+
+    g_free (name);
+    return res;
+}
+
+/* Write a string setting for a device, or remove it if value is NULL */
+
+void device_setting_set_string (VolumePulsePlugin *vol, const char *setting, const char *device, const char *value)
+{
+    char *name = device_setting_name (setting, device);
+
+    if (value) config_group_set_string (vol->settings, name, value);
+    else config_setting_remove (vol->settings, name);
+    lxpanel_config_save (vol->panel);
+    g_free (name);
+}
+
+/* Write an integer setting for a device without saving the config - the caller must save it */
+
+void device_setting_store_int (VolumePulsePlugin *vol, const char *setting, const char *device, int value)
+{
+    char *name = device_setting_name (setting, device);
+
+    config_group_set_int (vol->settings, name, value);
+    g_free (name);
+}
+
+/* Write an integer setting for a device */
+
+void device_setting_set_int (VolumePulsePlugin *vol, const char *setting, const char *device, int value)
+{
+    device_setting_store_int (vol, setting, device, value);
+    lxpanel_config_save (vol->panel);
+}
+
 /*----------------------------------------------------------------------------*/
 /* Volume scale popup window                                                  */
 /*----------------------------------------------------------------------------*/
 
+/*
+ * The popup window is created the first time it is needed and then kept,
+ * being shown and hidden on each click rather than rebuilt. Its controls
+ * are updated along with the icon whenever the display is refreshed, which
+ * costs very little while the window is hidden.
+ */
+
 /* Create the pop-up volume window */
 
-static void popup_window_show (GtkWidget *p)
+static void popup_window_create (VolumePulsePlugin *vol)
 {
-    VolumePulsePlugin *vol = lxpanel_plugin_get_data (p);
-    gint x, y;
-
     /* Create a new window. */
     vol->popup_window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
     gtk_widget_set_name (vol->popup_window, "panelpopup");
@@ -139,9 +241,13 @@ static void popup_window_show (GtkWidget *p)
 
     gtk_container_set_border_width (GTK_CONTAINER (vol->popup_window), 0);
     gtk_scrolled_window_set_shadow_type (GTK_SCROLLED_WINDOW (scrolledwindow), GTK_SHADOW_IN);
-    /* Create a vertical box as the child of the viewport. */
+    /* Create a horizontal box as the child of the viewport, to hold the device and application controls. */
+    GtkWidget *hbox = gtk_box_new (GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_container_add (GTK_CONTAINER (viewport), hbox);
+
+    /* Create a vertical box as the child of the horizontal box. */
     GtkWidget *box = gtk_box_new (GTK_ORIENTATION_VERTICAL, 0);
-    gtk_container_add (GTK_CONTAINER (viewport), box);
+    gtk_box_pack_start (GTK_BOX (hbox), box, FALSE, FALSE, 0);
 
     /* Create a vertical scale as the child of the vertical box. */
     vol->popup_volume_scale = gtk_scale_new (GTK_ORIENTATION_VERTICAL, GTK_ADJUSTMENT (gtk_adjustment_new (100, 0, 100, 0, 0, 0)));
@@ -162,17 +268,66 @@ static void popup_window_show (GtkWidget *p)
     vol->mute_check_handler = g_signal_connect (vol->popup_mute_check, "toggled", G_CALLBACK (popup_window_mute_toggled), vol);
     gtk_widget_set_can_focus (vol->popup_mute_check, FALSE);
 
-    /* Show the window - need to draw the window in order to allow the plugin position helper to get its size */
+    /* Create a scrolled list of application streams alongside the device controls - hidden while there are none. */
+    if (!vol->input_control)
+    {
+        vol->popup_streams_window = gtk_scrolled_window_new (NULL, NULL);
+        gtk_scrolled_window_set_policy (GTK_SCROLLED_WINDOW (vol->popup_streams_window), GTK_POLICY_NEVER, GTK_POLICY_AUTOMATIC);
+        gtk_scrolled_window_set_propagate_natural_height (GTK_SCROLLED_WINDOW (vol->popup_streams_window), TRUE);
+        gtk_scrolled_window_set_max_content_height (GTK_SCROLLED_WINDOW (vol->popup_streams_window), STREAMS_HEIGHT);
+        gtk_widget_set_no_show_all (vol->popup_streams_window, TRUE);
+        gtk_box_pack_start (GTK_BOX (hbox), vol->popup_streams_window, TRUE, TRUE, 0);
+
+        vol->popup_streams_box = gtk_box_new (GTK_ORIENTATION_VERTICAL, 0);
+        gtk_container_add (GTK_CONTAINER (vol->popup_streams_window), vol->popup_streams_box);
+        gtk_widget_show (vol->popup_streams_box);
+
+        vol->popup_streams = g_hash_table_new_full (NULL, NULL, NULL, popup_stream_free);
+    }
+
+    /* Realize the window - need to draw the window in order to allow the plugin position helper to get its size */
     gtk_window_set_position (GTK_WINDOW (vol->popup_window), GTK_WIN_POS_MOUSE);
     gtk_widget_show_all (vol->popup_window);
     gtk_widget_hide (vol->popup_window);
-    lxpanel_plugin_popup_set_position_helper (vol->panel, vol->plugin, vol->popup_window, &x, &y);
-    gdk_window_move (gtk_widget_get_window (vol->popup_window), x, y);
-    gtk_window_present (GTK_WINDOW (vol->popup_window));
+
+    /* New controls are not yet showing the current state */
+    vol->popup_level = -1;
+    vol->popup_mute = -1;
 
     /* Connect the function which hides the window when the mouse is clicked outside it */
     g_signal_connect (G_OBJECT (vol->popup_window), "map-event", G_CALLBACK (popup_mapped), vol);
     g_signal_connect (G_OBJECT (vol->popup_window), "button-press-event", G_CALLBACK (popup_button_press), vol);
+
+    /* Fill the list of streams - from now on it is kept up to date from stream notifications */
+    pulse_update_stream_controls (vol, TRUE);
+}
+
+/* Show the pop-up volume window, creating it if it does not yet exist */
+
+static void popup_window_show (VolumePulsePlugin *vol)
+{
+    gint64 start = g_get_monotonic_time ();
+    gint x, y;
+
+    vol->popup_show_time = start;
+    if (!vol->popup_window) popup_window_create (vol);
+
+    lxpanel_plugin_popup_set_position_helper (vol->panel, vol->plugin, vol->popup_window, &x, &y);
+    gdk_window_move (gtk_widget_get_window (vol->popup_window), x, y);
+    gtk_window_present (GTK_WINDOW (vol->popup_window));
+
+    DEBUG ("Popup shown in %d us", (int) (g_get_monotonic_time () - start));
+}
+
+/* Hide the pop-up volume window and release the pointer grab */
+
+static void popup_window_hide (VolumePulsePlugin *vol)
+{
+    if (vol->popup_window && gtk_widget_get_visible (vol->popup_window))
+    {
+        gtk_widget_hide (vol->popup_window);
+        gdk_seat_ungrab (gdk_display_get_default_seat (gdk_display_get_default ()));
+    }
 }
 
 /* Handler for "value_changed" signal on popup window vertical scale */
@@ -214,10 +369,11 @@ static void popup_window_mute_toggled (GtkWidget *widget, VolumePulsePlugin *vol
     volumepulse_update_display (vol);
 }
 
-/* Handler for "focus-out" signal on popup window */
+/* Handler for "map-event" signal on popup window */
 
 static gboolean popup_mapped (GtkWidget *widget, GdkEvent *event, VolumePulsePlugin *vol)
 {
+    DEBUG ("Popup mapped in %d us", (int) (g_get_monotonic_time () - vol->popup_show_time));
     gdk_seat_grab (gdk_display_get_default_seat (gdk_display_get_default ()), gtk_widget_get_window (widget), GDK_SEAT_CAPABILITY_ALL_POINTING, TRUE, NULL, NULL, NULL, NULL);
     return FALSE;
 }
@@ -226,12 +382,184 @@ static gboolean popup_button_press (GtkWidget *widget, GdkEventButton *event, Vo
 {
     int x, y;
     gtk_window_get_size (GTK_WINDOW (widget), &x, &y);
-    if (event->x < 0 || event->y < 0 || event->x > x || event->y > y)
+    if (event->x < 0 || event->y < 0 || event->x > x || event->y > y) popup_window_hide (vol);
+    return FALSE;
+}
+
+/*
+ * Each application stream has a row in the popup, keyed by stream index. Rows are
+ * added, updated and removed one at a time as stream notifications arrive, and
+ * widgets are only touched when what they show has changed, so the list stays
+ * cheap to maintain however many streams there are. A full update, which is only
+ * needed when the popup is created or notifications have been missed, marks all
+ * rows as stale and then sweeps away those for which no stream was found.
+ */
+
+/* Add or update the row for a stream */
+
+void popup_stream_update (VolumePulsePlugin *vol, uint32_t index, const char *name, const char *media, const char *icon, int channels, int level, gboolean mute)
+{
+    stream_row_t *row;
+
+    if (vol->popup_streams == NULL) return;
+
+    row = g_hash_table_lookup (vol->popup_streams, GUINT_TO_POINTER (index));
+    if (!row)
     {
-        close_widget (&vol->popup_window);
-        gdk_seat_ungrab (gdk_display_get_default_seat (gdk_display_get_default ()));
+        row = g_new0 (stream_row_t, 1);
+        row->vol = vol;
+        row->index = index;
+        row->level = -1;
+        row->mute = -1;
+
+        row->box = gtk_box_new (GTK_ORIENTATION_HORIZONTAL, 5);
+        gtk_box_pack_start (GTK_BOX (row->box), gtk_image_new_from_icon_name (icon, GTK_ICON_SIZE_MENU), FALSE, FALSE, 0);
+
+        row->label = gtk_label_new (NULL);
+        gtk_label_set_xalign (GTK_LABEL (row->label), 0.0);
+        gtk_label_set_ellipsize (GTK_LABEL (row->label), PANGO_ELLIPSIZE_END);
+        gtk_label_set_width_chars (GTK_LABEL (row->label), 12);
+        gtk_label_set_max_width_chars (GTK_LABEL (row->label), 12);
+        gtk_box_pack_start (GTK_BOX (row->box), row->label, FALSE, FALSE, 0);
+
+        row->scale = gtk_scale_new (GTK_ORIENTATION_HORIZONTAL, GTK_ADJUSTMENT (gtk_adjustment_new (0, 0, 100, 0, 0, 0)));
+        g_object_set (row->scale, "width-request", 100, NULL);
+        gtk_scale_set_draw_value (GTK_SCALE (row->scale), FALSE);
+        gtk_widget_set_can_focus (row->scale, FALSE);
+        gtk_box_pack_start (GTK_BOX (row->box), row->scale, TRUE, TRUE, 0);
+        row->scale_handler = g_signal_connect (row->scale, "value-changed", G_CALLBACK (popup_stream_scale_changed), row);
+
+        row->mute_check = gtk_check_button_new ();
+        gtk_widget_set_tooltip_text (row->mute_check, _("Mute"));
+        gtk_widget_set_can_focus (row->mute_check, FALSE);
+        gtk_box_pack_start (GTK_BOX (row->box), row->mute_check, FALSE, FALSE, 0);
+        row->mute_handler = g_signal_connect (row->mute_check, "toggled", G_CALLBACK (popup_stream_mute_toggled), row);
+
+        gtk_box_pack_start (GTK_BOX (vol->popup_streams_box), row->box, FALSE, FALSE, 0);
+        gtk_widget_show_all (row->box);
+
+        g_hash_table_insert (vol->popup_streams, GUINT_TO_POINTER (index), row);
+        popup_streams_show (vol);
     }
-    return FALSE;
+
+    row->stale = FALSE;
+    row->channels = channels;
+
+    if (g_strcmp0 (name, gtk_label_get_text (GTK_LABEL (row->label))))
+        gtk_label_set_text (GTK_LABEL (row->label), name);
+    if (g_strcmp0 (media, row->media))
+    {
+        gtk_widget_set_tooltip_text (row->box, media);
+        g_free (row->media);
+        row->media = g_strdup (media);
+    }
+
+    if (level != row->level || mute != row->mute)
+    {
+        g_signal_handler_block (row->mute_check, row->mute_handler);
+        gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (row->mute_check), mute);
+        g_signal_handler_unblock (row->mute_check, row->mute_handler);
+
+        g_signal_handler_block (row->scale, row->scale_handler);
+        gtk_range_set_value (GTK_RANGE (row->scale), level);
+        g_signal_handler_unblock (row->scale, row->scale_handler);
+
+        gtk_widget_set_sensitive (row->scale, !mute);
+        row->level = level;
+        row->mute = mute;
+    }
+}
+
+/* Remove the row for a stream */
+
+void popup_stream_remove (VolumePulsePlugin *vol, uint32_t index)
+{
+    stream_row_t *row;
+
+    if (vol->popup_streams == NULL) return;
+
+    row = g_hash_table_lookup (vol->popup_streams, GUINT_TO_POINTER (index));
+    if (row)
+    {
+        gtk_widget_destroy (row->box);
+        g_hash_table_remove (vol->popup_streams, GUINT_TO_POINTER (index));
+        popup_streams_show (vol);
+    }
+}
+
+/* Free the data for a stream row once it has been removed from the table */
+
+static void popup_stream_free (gpointer data)
+{
+    stream_row_t *row = (stream_row_t *) data;
+
+    g_free (row->media);
+    g_free (row);
+}
+
+/* Mark all stream rows as stale before a full update */
+
+void popup_streams_mark (VolumePulsePlugin *vol)
+{
+    GHashTableIter iter;
+    gpointer row;
+
+    if (vol->popup_streams == NULL) return;
+
+    g_hash_table_iter_init (&iter, vol->popup_streams);
+    while (g_hash_table_iter_next (&iter, NULL, &row)) ((stream_row_t *) row)->stale = TRUE;
+}
+
+/* Remove stream rows which are still stale after a full update */
+
+void popup_streams_sweep (VolumePulsePlugin *vol)
+{
+    GHashTableIter iter;
+    gpointer row;
+
+    if (vol->popup_streams == NULL) return;
+
+    g_hash_table_iter_init (&iter, vol->popup_streams);
+    while (g_hash_table_iter_next (&iter, NULL, &row))
+    {
+        if (((stream_row_t *) row)->stale)
+        {
+            gtk_widget_destroy (((stream_row_t *) row)->box);
+            g_hash_table_iter_remove (&iter);
+        }
+    }
+    popup_streams_show (vol);
+}
+
+/* Show the list of streams only if there are any */
+
+static void popup_streams_show (VolumePulsePlugin *vol)
+{
+    gboolean show = g_hash_table_size (vol->popup_streams) > 0;
+
+    if (show != gtk_widget_get_visible (vol->popup_streams_window))
+        gtk_widget_set_visible (vol->popup_streams_window, show);
+}
+
+/* Handler for "value_changed" signal on a stream scale */
+
+static void popup_stream_scale_changed (GtkRange *range, stream_row_t *row)
+{
+    VolumePulsePlugin *vol = row->vol;
+
+    row->level = gtk_range_get_value (range);
+    pulse_set_stream_volume (vol, row->index, row->channels, row->level);
+}
+
+/* Handler for "toggled" signal on a stream mute checkbox */
+
+static void popup_stream_mute_toggled (GtkWidget *widget, stream_row_t *row)
+{
+    VolumePulsePlugin *vol = row->vol;
+
+    row->mute = gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (widget));
+    gtk_widget_set_sensitive (row->scale, !row->mute);
+    pulse_set_stream_mute (vol, row->index, row->mute);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -310,8 +638,8 @@ void menu_mark_default (GtkWidget *widget, gpointer data)
     if (!def || !wid) return;
 
     // check to see if either the two names match (for an ALSA device),
-    // or if the BlueZ address from the widget is in the default name */
-    if (!g_strcmp0 (def, wid) || (strstr (wid, "bluez") && strstr (def, wid + 20) && !strstr (def, "monitor")))
+    // or if the BlueZ device of the widget is the default device
+    if (!g_strcmp0 (def, wid) || (strstr (wid, "bluez") && bluetooth_is_pa_device (vol, wid, def) && !strstr (def, "monitor")))
     {
         gulong hid = g_signal_handler_find (widget, G_SIGNAL_MATCH_ID, g_signal_lookup ("activate", GTK_TYPE_CHECK_MENU_ITEM), 0, NULL, NULL, NULL);
         g_signal_handler_block (widget, hid);
@@ -360,6 +688,49 @@ void menu_set_bluetooth_device (GtkWidget *widget, VolumePulsePlugin *vol)
 /* Plugin handlers and graphics                                               */
 /*----------------------------------------------------------------------------*/
 
+/*
+ * Most refreshes are triggered by events which do not affect the default
+ * device, so the state last pushed to GTK is kept and only the parts which
+ * have changed are updated - icon theme lookups in particular are expensive.
+ */
+
+void display_update (VolumePulsePlugin *vol, const char *icon, int level, gboolean mute)
+{
+    gboolean changed = FALSE;
+
+    /* update icon */
+    if (g_strcmp0 (icon, vol->disp_icon))
+    {
+        lxpanel_plugin_set_taskbar_icon (vol->panel, vol->tray_icon, icon);
+        vol->disp_icon = icon;
+        changed = TRUE;
+    }
+
+    /* update popup window controls */
+    if (vol->popup_window && (level != vol->popup_level || mute != vol->popup_mute))
+    {
+        g_signal_handler_block (vol->popup_mute_check, vol->mute_check_handler);
+        gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (vol->popup_mute_check), mute);
+        g_signal_handler_unblock (vol->popup_mute_check, vol->mute_check_handler);
+
+        g_signal_handler_block (vol->popup_volume_scale, vol->volume_scale_handler);
+        gtk_range_set_value (GTK_RANGE (vol->popup_volume_scale), level);
+        g_signal_handler_unblock (vol->popup_volume_scale, vol->volume_scale_handler);
+
+        gtk_widget_set_sensitive (vol->popup_volume_scale, !mute);
+        vol->popup_level = level;
+        vol->popup_mute = mute;
+        changed = TRUE;
+    }
+
+    /* tooltip is generated from this when queried */
+    vol->disp_level = level;
+
+    if (changed) vol->disp_applied++;
+    else vol->disp_skipped++;
+    DEBUG ("Display refresh %s - %d applied, %d skipped", changed ? "applied" : "skipped", vol->disp_applied, vol->disp_skipped);
+}
+
 /* Handler for "button-press-event" signal on main widget. */
 
 gboolean volumepulse_button_press_event (GtkWidget *widget, GdkEventButton *event, VolumePulsePlugin *vol)
@@ -367,8 +738,8 @@ gboolean volumepulse_button_press_event (GtkWidget *widget, GdkEventButton *even
     switch (event->button)
     {
         case 1: /* left-click - show or hide volume popup */
-                if (vol->popup_window) close_widget (&vol->popup_window);
-                else popup_window_show (vol->plugin);
+                if (vol->popup_window && gtk_widget_get_visible (vol->popup_window)) popup_window_hide (vol);
+                else popup_window_show (vol);
                 break;
 
         case 2: /* middle-click - toggle mute */
@@ -376,7 +747,7 @@ gboolean volumepulse_button_press_event (GtkWidget *widget, GdkEventButton *even
                 break;
 
         case 3: /* right-click - show device list */
-                close_widget (&vol->popup_window);
+                popup_window_hide (vol);
                 menu_show (vol);
                 gtk_menu_popup_at_widget (GTK_MENU (vol->menu_devices), vol->plugin, GDK_GRAVITY_NORTH_WEST, GDK_GRAVITY_NORTH_WEST, (GdkEvent *) event);
                 break;
@@ -386,28 +757,87 @@ gboolean volumepulse_button_press_event (GtkWidget *widget, GdkEventButton *even
     return TRUE;
 }
 
+/* Handler for "query-tooltip" signal on main widget - the text is only built when the tooltip is about to be shown */
+
+gboolean volumepulse_query_tooltip (GtkWidget *widget, gint x, gint y, gboolean keyboard_mode, GtkTooltip *tooltip, VolumePulsePlugin *vol)
+{
+    char text[128];
+    int battery = bluetooth_battery_level (vol);
+
+    if (battery >= 0)
+        g_snprintf (text, sizeof (text), "%s %d\n%s %d%%", vol->input_control ? _("Mic volume") : _("Volume control"), vol->disp_level,
+            _("Bluetooth battery"), battery);
+    else
+        g_snprintf (text, sizeof (text), "%s %d", vol->input_control ? _("Mic volume") : _("Volume control"), vol->disp_level);
+    gtk_tooltip_set_text (tooltip, text);
+    return TRUE;
+}
+
+/*
+ * Scroll events are accumulated rather than applied directly - high-resolution
+ * touchpads send many small smooth scroll events per gesture. The accumulated
+ * distance is converted to a volume change once per frame by a tick callback,
+ * which works from the level read at the start of the gesture, so at most one
+ * set operation is sent to PulseAudio for each frame drawn.
+ */
+
 /* Handler for "scroll-event" signal */
 
 void volumepulse_mouse_scrolled (GtkScale *scale, GdkEventScroll *evt, VolumePulsePlugin *vol)
 {
-    if (pulse_get_mute (vol)) return;
+    double delta;
+
+    switch (evt->direction)
+    {
+        case GDK_SCROLL_UP :
+        case GDK_SCROLL_LEFT :      delta = 1.0;
+                                    break;
 
-    /* Update the PulseAudio volume by a step */
-    int val = pulse_get_volume (vol);
+        case GDK_SCROLL_DOWN :
+        case GDK_SCROLL_RIGHT :     delta = -1.0;
+                                    break;
 
-    if (evt->direction == GDK_SCROLL_UP || evt->direction == GDK_SCROLL_LEFT
-        || (evt->direction == GDK_SCROLL_SMOOTH && (evt->delta_x < 0 || evt->delta_y < 0)))
+        case GDK_SCROLL_SMOOTH :    delta = -(evt->delta_x + evt->delta_y);
+                                    break;
+
+        default :                   delta = 0.0;
+                                    break;
+    }
+    if (delta == 0.0) return;
+
+    /* At the start of a gesture, read the current state and start the frame callback */
+    if (!vol->scroll_tick)
     {
-        if (val < 100) val += 2;
+        if (pulse_get_mute (vol)) return;
+        vol->scroll_volume = pulse_get_volume (vol);
+        vol->scroll_tick = gtk_widget_add_tick_callback (vol->plugin, volumepulse_scroll_tick, vol, NULL);
     }
-    else if (evt->direction == GDK_SCROLL_DOWN || evt->direction == GDK_SCROLL_RIGHT
-        || (evt->direction == GDK_SCROLL_SMOOTH && (evt->delta_x > 0 || evt->delta_y > 0)))
+
+    vol->scroll_delta += delta * SCROLL_STEP;
+    vol->scroll_time = g_get_monotonic_time ();
+}
+
+/* Frame callback to apply accumulated scroll distance to the volume */
+
+static gboolean volumepulse_scroll_tick (GtkWidget *widget, GdkFrameClock *clock, gpointer user_data)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) user_data;
+    int step = (int) vol->scroll_delta;
+
+    if (step == 0)
     {
-        if (val > 0) val -= 2;
+        // nothing to apply - stop once the gesture has finished, keeping any fractional remainder
+        if (g_get_monotonic_time () - vol->scroll_time < SCROLL_IDLE) return G_SOURCE_CONTINUE;
+        vol->scroll_tick = 0;
+        return G_SOURCE_REMOVE;
     }
-    pulse_set_volume (vol, val);
+
+    vol->scroll_delta -= step;
+    vol->scroll_volume = CLAMP (vol->scroll_volume + step, 0, 100);
+    pulse_set_volume (vol, vol->scroll_volume);
 
     volumepulse_update_display (vol);
+    return G_SOURCE_CONTINUE;
 }
 
 /*----------------------------------------------------------------------------*/
@@ -420,6 +850,8 @@ void volumepulse_configuration_changed (LXPanel *panel, GtkWidget *plugin)
 {
     VolumePulsePlugin *vol = lxpanel_plugin_get_data (plugin);
 
+    /* icon size may have changed, so force the icon to be reloaded */
+    vol->disp_icon = NULL;
     volumepulse_update_display (vol);
 }
 
@@ -481,11 +913,20 @@ void volumepulse_destructor (gpointer user_data)
 {
     VolumePulsePlugin *vol = (VolumePulsePlugin *) user_data;
 
+    if (vol->scroll_tick) gtk_widget_remove_tick_callback (vol->plugin, vol->scroll_tick);
+
     close_widget (&vol->profiles_dialog);
+    if (vol->profiles_unsaved) lxpanel_config_save (vol->panel);
     close_widget (&vol->conn_dialog);
     close_widget (&vol->popup_window);
     close_widget (&vol->menu_devices);
 
+    if (vol->popup_streams)
+    {
+        g_hash_table_destroy (vol->popup_streams);
+        vol->popup_streams = NULL;
+    }
+
     bluetooth_terminate (vol);
     pulse_terminate (vol);
 
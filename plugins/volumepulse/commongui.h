@@ -28,6 +28,16 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 extern char *get_string (const char *fmt, ...);
 extern int vsystem (const char *fmt, ...);
 extern void close_widget (GtkWidget **wid);
+extern const char *device_setting_get_string (VolumePulsePlugin *vol, const char *setting, const char *device);
+extern gboolean device_setting_get_int (VolumePulsePlugin *vol, const char *setting, const char *device, int *value);
+extern void device_setting_set_string (VolumePulsePlugin *vol, const char *setting, const char *device, const char *value);
+extern void device_setting_store_int (VolumePulsePlugin *vol, const char *setting, const char *device, int value);
+extern void device_setting_set_int (VolumePulsePlugin *vol, const char *setting, const char *device, int value);
+
+extern void popup_stream_update (VolumePulsePlugin *vol, uint32_t index, const char *name, const char *media, const char *icon, int channels, int level, gboolean mute);
+extern void popup_stream_remove (VolumePulsePlugin *vol, uint32_t index);
+extern void popup_streams_mark (VolumePulsePlugin *vol);
+extern void popup_streams_sweep (VolumePulsePlugin *vol);
 
 extern void menu_create (VolumePulsePlugin *vol);
 extern void menu_add_separator (VolumePulsePlugin *vol, GtkWidget *menu);
@@ -35,7 +45,9 @@ extern void menu_mark_default (GtkWidget *widget, gpointer data);
 extern void menu_set_alsa_device (GtkWidget *widget, VolumePulsePlugin *vol);
 extern void menu_set_bluetooth_device (GtkWidget *widget, VolumePulsePlugin *vol);
 
+extern void display_update (VolumePulsePlugin *vol, const char *icon, int level, gboolean mute);
 extern gboolean volumepulse_button_press_event (GtkWidget *widget, GdkEventButton *event, VolumePulsePlugin *vol);
+extern gboolean volumepulse_query_tooltip (GtkWidget *widget, gint x, gint y, gboolean keyboard_mode, GtkTooltip *tooltip, VolumePulsePlugin *vol);
 extern void volumepulse_mouse_scrolled (GtkScale *scale, GdkEventScroll *evt, VolumePulsePlugin *vol);
 extern void volumepulse_configuration_changed (LXPanel *panel, GtkWidget *plugin);
 extern gboolean volumepulse_control_msg (GtkWidget *plugin, const char *cmd);
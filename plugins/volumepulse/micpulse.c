@@ -108,6 +108,19 @@ void profiles_dialog_add_combo (VolumePulsePlugin *vol, GtkListStore *ls, GtkWid
 {
 }
 
+void profiles_dialog_add_latency (VolumePulsePlugin *vol, const char *card, int index, GHashTable *offsets)
+{
+    g_hash_table_destroy (offsets);
+}
+
+void profiles_dialog_set_latency (VolumePulsePlugin *vol, int index, const char *port, int latency, int configured)
+{
+}
+
+void profiles_dialog_add_suspend (VolumePulsePlugin *vol, int index, const char *sink, gboolean enable, int timeout)
+{
+}
+
 /*----------------------------------------------------------------------------*/
 /* Plugin handlers and graphics                                               */
 /*----------------------------------------------------------------------------*/
@@ -116,16 +129,20 @@ void profiles_dialog_add_combo (VolumePulsePlugin *vol, GtkListStore *ls, GtkWid
 
 void volumepulse_update_display (VolumePulsePlugin *vol)
 {
-    pulse_count_devices (vol);
-    if (vol->pa_devices + bluetooth_count_devices (vol, TRUE))
+    /* only show the plugin if there are input devices - counts are maintained from events */
+    gboolean show = pulse_count_devices (vol) + bluetooth_count_devices (vol) > 0;
+    if (show != gtk_widget_get_visible (vol->plugin))
     {
-        gtk_widget_show_all (vol->plugin);
-        gtk_widget_set_sensitive (vol->plugin, TRUE);
-    }
-    else
-    {
-        gtk_widget_hide (vol->plugin);
-        gtk_widget_set_sensitive (vol->plugin, FALSE);
+        if (show)
+        {
+            gtk_widget_show_all (vol->plugin);
+            gtk_widget_set_sensitive (vol->plugin, TRUE);
+        }
+        else
+        {
+            gtk_widget_hide (vol->plugin);
+            gtk_widget_set_sensitive (vol->plugin, FALSE);
+        }
     }
 
     /* read current mute and volume status */
@@ -133,27 +150,8 @@ void volumepulse_update_display (VolumePulsePlugin *vol)
     int level = pulse_get_volume (vol);
     if (mute) level = 0;
 
-    /* update icon */
-    lxpanel_plugin_set_taskbar_icon (vol->panel, vol->tray_icon, mute ? "audio-input-mic-muted" : "audio-input-microphone");
-
-    /* update popup window controls */
-    if (vol->popup_window)
-    {
-        g_signal_handler_block (vol->popup_mute_check, vol->mute_check_handler);
-        gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (vol->popup_mute_check), mute);
-        g_signal_handler_unblock (vol->popup_mute_check, vol->mute_check_handler);
-
-        g_signal_handler_block (vol->popup_volume_scale, vol->volume_scale_handler);
-        gtk_range_set_value (GTK_RANGE (vol->popup_volume_scale), level);
-        g_signal_handler_unblock (vol->popup_volume_scale, vol->volume_scale_handler);
-
-        gtk_widget_set_sensitive (vol->popup_volume_scale, !mute);
-    }
-
-    /* update tooltip */
-    char *tooltip = g_strdup_printf ("%s %d", _("Mic volume"), level);
-    gtk_widget_set_tooltip_text (vol->plugin, tooltip);
-    g_free (tooltip);
+    /* update icon and popup */
+    display_update (vol, mute ? "audio-input-mic-muted" : "audio-input-microphone", level, mute);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -187,13 +185,17 @@ static GtkWidget *volumepulse_constructor (LXPanel *panel, config_setting_t *set
     gtk_button_set_relief (GTK_BUTTON (vol->plugin), GTK_RELIEF_NONE);
     g_signal_connect (vol->plugin, "button-press-event", G_CALLBACK (volumepulse_button_press_event), vol);
     g_signal_connect (vol->plugin, "scroll-event", G_CALLBACK (volumepulse_mouse_scrolled), vol);
-    gtk_widget_add_events (vol->plugin, GDK_SCROLL_MASK);
+    gtk_widget_add_events (vol->plugin, GDK_SCROLL_MASK | GDK_SMOOTH_SCROLL_MASK);
+    gtk_widget_set_has_tooltip (vol->plugin, TRUE);
+    g_signal_connect (vol->plugin, "query-tooltip", G_CALLBACK (volumepulse_query_tooltip), vol);
 
     /* Set up variables */
     vol->input_control = TRUE;
 
     vol->menu_devices = NULL;
     vol->popup_window = NULL;
+    vol->disp_icon = NULL;
+    vol->disp_level = -1;
     vol->profiles_dialog = NULL;
     vol->conn_dialog = NULL;
 
@@ -27,6 +27,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "volumepulse.h"
 #include "commongui.h"
+#include "bluetooth.h"
 
 #include "pulse.h"
 
@@ -45,11 +46,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #define START_PA_OPERATION \
     pa_operation *op; \
-    if (vol->pa_error_msg) \
-    { \
-        g_free (vol->pa_error_msg); \
-        vol->pa_error_msg = NULL; \
-    } \
+    if (vol->pa_mainloop == NULL) return 0; \
+    vol->pa_error = PA_OK; \
     pa_threaded_mainloop_lock (vol->pa_mainloop);
 
 #define END_PA_OPERATION(name) \
@@ -65,42 +63,44 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
     } \
     pa_operation_unref (op); \
     pa_threaded_mainloop_unlock (vol->pa_mainloop); \
-    if (vol->pa_error_msg) return 0; \
+    if (vol->pa_error) return 0; \
     else return 1;
     
 #define PA_VOL_SCALE 655    /* GTK volume scale is 0-100; PA scale is 0-65535 */
 
+#define PA_LL_FRAGMENTS     2       /* Number of fragments for an ALSA sink in low latency mode */
+#define PA_LL_FRAGMENT_SIZE 1024    /* Size in bytes of fragments for an ALSA sink in low latency mode */
+
+#define PA_SUSPEND_TIMEOUT  5       /* Default time in seconds a sink is idle before it is suspended */
+
+#define PA_LEVEL_MUTED      0x100   /* Flag in device level table entries for a muted device */
+
 /*----------------------------------------------------------------------------*/
 /* Static function prototypes                                                 */
 /*----------------------------------------------------------------------------*/
 
 static void pa_cb_state (pa_context *pacontext, void *userdata);
+static void pa_close_connection (VolumePulsePlugin *vol);
 static void pa_error_handler (VolumePulsePlugin *vol, char *name);
 static int pa_set_subscription (VolumePulsePlugin *vol);
 static void pa_cb_subscription (pa_context *pacontext, pa_subscription_event_type_t event, uint32_t idx, void *userdata);
+static gboolean pa_update_source_dispatch (GSource *source, GSourceFunc callback, gpointer userdata);
 static gboolean pa_update_disp_cb (gpointer userdata);
 static void pa_cb_generic_success (pa_context *context, int success, void *userdata);
 static int pa_get_current_vol_mute (VolumePulsePlugin *vol);
 static void pa_cb_get_current_vol_mute (pa_context *context, const pa_sink_info *i, int eol, void *userdata);
 static void pa_cb_get_current_input_vol_mute (pa_context *context, const pa_source_info *i, int eol, void *userdata);
-static int pa_get_channels (VolumePulsePlugin *vol);
-static void pa_cb_get_channels (pa_context *context, const pa_sink_info *i, int eol, void *userdata);
-static int pa_restore_volume (VolumePulsePlugin *vol);
-static int pa_restore_mute (VolumePulsePlugin *vol);
+static void pa_remember_level (VolumePulsePlugin *vol, const char *sinkname, int volume, int mute);
+static gboolean pa_recall_level (VolumePulsePlugin *vol, const char *sinkname, int *volume, int *mute);
 static void pa_cb_get_default_sink_source (pa_context *context, const pa_server_info *i, void *userdata);
-static int pa_set_default_sink (VolumePulsePlugin *vol, const char *sinkname);
 static int pa_get_output_streams (VolumePulsePlugin *vol);
 static void pa_cb_get_output_streams (pa_context *context, const pa_sink_input_info *i, int eol, void *userdata);
-static void pa_list_move_to_default_sink (gpointer data, gpointer userdata);
 static int pa_move_stream_to_default_sink (VolumePulsePlugin *vol, int index);
 static int pa_set_default_source (VolumePulsePlugin *vol, const char *sourcename);
 static int pa_get_input_streams (VolumePulsePlugin *vol);
 static void pa_cb_get_input_streams (pa_context *context, const pa_source_output_info *i, int eol, void *userdata);
-static void pa_list_move_to_default_source (gpointer data, gpointer userdata);
 static int pa_move_stream_to_default_source (VolumePulsePlugin *vol, int index);
-static void pa_list_mute_stream (gpointer data, gpointer userdata);
 static int pa_mute_stream (VolumePulsePlugin *vol, int index);
-static void pa_list_unmute_stream (gpointer data, gpointer userdata);
 static int pa_unmute_stream (VolumePulsePlugin *vol, int index);
 static void pa_cb_get_profile (pa_context *c, const pa_card_info *i, int eol, void *userdata);
 static void pa_cb_get_info_inputs (pa_context *c, const pa_card_info *i, int eol, void *userdata);
@@ -116,8 +116,87 @@ static void pa_cb_replace_cards_with_sources (pa_context *context, const pa_sour
 static void pa_replace_card_with_source_on_match (GtkWidget *widget, gpointer data);
 static void pa_card_check_bt_input_profile (GtkWidget *widget, gpointer data);
 static void pa_cb_add_devices_to_profile_dialog (pa_context *c, const pa_card_info *i, int eol, void *userdata);
-static void pa_cb_count_inputs (pa_context *c, const pa_card_info *i, int eol, void *userdata);
-static void pa_cb_count_outputs (pa_context *c, const pa_card_info *i, int eol, void *userdata);
+static const char *pa_bt_profile_info (const char *profile);
+static void pa_cb_add_latencies_to_profile_dialog (pa_context *c, const pa_sink_info *i, int eol, void *userdata);
+static char *pa_latency_setting (const char *card, const char *port);
+static void pa_cb_restore_latency_offsets (pa_context *c, const pa_card_info *i, int eol, void *userdata);
+static void pa_queue_card_event (VolumePulsePlugin *vol, pa_subscription_event_type_t event, uint32_t idx);
+static void pa_process_card_events (VolumePulsePlugin *vol);
+static int pa_count_card (VolumePulsePlugin *vol, uint32_t index);
+static void pa_cb_count_cards (pa_context *c, const pa_card_info *i, int eol, void *userdata);
+static void pa_index_bt_device (VolumePulsePlugin *vol, pa_proplist *proplist);
+static int pa_get_sink_info (VolumePulsePlugin *vol, const char *sinkname);
+static void pa_cb_get_sink_info (pa_context *c, const pa_sink_info *i, int eol, void *userdata);
+static int pa_find_low_latency_profile (VolumePulsePlugin *vol, uint32_t card);
+static void pa_cb_find_low_latency_profile (pa_context *c, const pa_card_info *i, int eol, void *userdata);
+static int pa_get_module_info (VolumePulsePlugin *vol, uint32_t index);
+static void pa_cb_get_module_info (pa_context *c, const pa_module_info *i, int eol, void *userdata);
+static int pa_load_module (VolumePulsePlugin *vol, const char *name, const char *args);
+static void pa_cb_load_module (pa_context *c, uint32_t idx, void *userdata);
+static int pa_unload_module (VolumePulsePlugin *vol, uint32_t index);
+static char *pa_strip_module_args (const char *args, const char **keys);
+static void pa_reset_low_latency (VolumePulsePlugin *vol);
+static void pa_ignore_reload_removal (VolumePulsePlugin *vol);
+static void pa_show_sink_state (GtkWidget *widget, const pa_sink_info *i);
+static gboolean pa_suspend_idle_setting (VolumePulsePlugin *vol, const char *sink, int *timeout);
+static gboolean pa_any_suspend_idle (VolumePulsePlugin *vol);
+static void pa_sink_state_event (VolumePulsePlugin *vol, pa_subscription_event_type_t event, uint32_t idx);
+static void pa_cb_sink_state (pa_context *c, const pa_sink_info *i, int eol, void *userdata);
+static void pa_update_idle_sinks (VolumePulsePlugin *vol);
+static int pa_get_busy_sinks (VolumePulsePlugin *vol);
+static void pa_cb_get_busy_sinks (pa_context *c, const pa_sink_input_info *i, int eol, void *userdata);
+static int pa_check_idle_sinks (VolumePulsePlugin *vol);
+static void pa_cb_check_idle_sinks (pa_context *c, const pa_sink_info *i, int eol, void *userdata);
+static void pa_start_idle_timer (VolumePulsePlugin *vol, const char *sink, int timeout);
+static void pa_cancel_idle_timer (VolumePulsePlugin *vol, const char *sink);
+static gboolean pa_idle_timeout (gpointer userdata);
+static void pa_idle_timer_free (gpointer userdata);
+static int pa_suspend_sink (VolumePulsePlugin *vol, const char *sinkname, int suspend);
+static void pa_resume_idle_sinks (VolumePulsePlugin *vol);
+static void pa_queue_stream_event (VolumePulsePlugin *vol, pa_subscription_event_type_t event, uint32_t idx);
+static int pa_get_stream_info (VolumePulsePlugin *vol, uint32_t index);
+static void pa_cb_get_stream_info (pa_context *c, const pa_sink_input_info *i, int eol, void *userdata);
+static void pa_load_routing_rules (VolumePulsePlugin *vol);
+static const char *pa_route_target (VolumePulsePlugin *vol, pa_proplist *proplist);
+static void pa_route_new_stream (VolumePulsePlugin *vol, uint32_t idx);
+static void pa_cb_route_output_stream (pa_context *c, const pa_sink_input_info *i, int eol, void *userdata);
+static void pa_cb_route_input_stream (pa_context *c, const pa_source_output_info *i, int eol, void *userdata);
+static void pa_cb_route_moved (pa_context *c, int success, void *userdata);
+static void pa_check_unplug (VolumePulsePlugin *vol);
+static void pa_update_port_states (VolumePulsePlugin *vol);
+static int pa_get_port_states (VolumePulsePlugin *vol, uint32_t card);
+static void pa_cb_get_port_states (pa_context *c, const pa_card_info *i, int eol, void *userdata);
+static gboolean pa_apply_unplug_policy (VolumePulsePlugin *vol, gboolean removed);
+static int pa_apply_sink_batch (VolumePulsePlugin *vol, const char *sinkname, gboolean set_default, int mute, int volume);
+static gboolean pa_wait_batch (VolumePulsePlugin *vol, pa_operation **ops, int nops);
+static int pa_get_device_names (VolumePulsePlugin *vol);
+static void pa_cb_get_sink_name (pa_context *c, const pa_sink_info *i, int eol, void *userdata);
+static void pa_cb_get_source_name (pa_context *c, const pa_source_info *i, int eol, void *userdata);
+static void pa_device_event (VolumePulsePlugin *vol, pa_subscription_event_type_t event, uint32_t idx);
+static gboolean pa_match_name (gpointer key, gpointer value, gpointer user_data);
+static const char *pa_best_device (VolumePulsePlugin *vol);
+static void pa_check_default_removed (VolumePulsePlugin *vol);
+static int pa_move_streams_batch (VolumePulsePlugin *vol, const char *name, gboolean set_default);
+static void pa_load_auto_switch (VolumePulsePlugin *vol);
+static void pa_cb_new_sink (pa_context *c, const pa_sink_info *i, int eol, void *userdata);
+static void pa_cb_new_source (pa_context *c, const pa_source_info *i, int eol, void *userdata);
+static void pa_new_device (VolumePulsePlugin *vol, uint32_t index, const char *name);
+static void pa_check_auto_switch (VolumePulsePlugin *vol);
+
+/*
+ * Display refreshes after notifications are run from a single source which is
+ * created at init and then just marked as ready by the notification callback,
+ * so that any number of notifications between refreshes cause only one
+ * refresh, and no memory is allocated per notification.
+ */
+
+static GSourceFuncs pa_update_source_funcs =
+{
+    NULL,
+    NULL,
+    pa_update_source_dispatch,
+    NULL
+};
 
 /*----------------------------------------------------------------------------*/
 /* PulseAudio controller initialisation / teardown                            */
@@ -137,6 +216,46 @@ void pulse_init (VolumePulsePlugin *vol)
     pa_mainloop_api *paapi;
 
     vol->pa_context = NULL;
+    vol->pa_default_sink = NULL;
+    vol->pa_default_source = NULL;
+    vol->pa_profile = NULL;
+    vol->pa_indices = g_array_sized_new (FALSE, FALSE, sizeof (uint32_t), 16);
+    vol->pa_levels = g_hash_table_new (NULL, NULL);
+    vol->pa_cards = g_hash_table_new (NULL, NULL);
+    vol->pa_card_event_count = 0;
+    vol->pa_card_rescan = TRUE;
+    vol->pa_stream_event_count = 0;
+    vol->pa_stream_rescan = FALSE;
+    vol->pa_keep_routed = FALSE;
+    pa_load_routing_rules (vol);
+    vol->pa_default_card = PA_INVALID_INDEX;
+    vol->pa_default_port = NULL;
+    vol->pa_ports = g_hash_table_new (g_str_hash, g_str_equal);
+    vol->pa_ports_stale = TRUE;
+    vol->pa_card_changed = FALSE;
+    vol->pa_card_removed = FALSE;
+    vol->pa_device_names = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+    vol->pa_default_removed = FALSE;
+    pa_load_auto_switch (vol);
+    vol->pa_switch_target = NULL;
+    vol->pa_ll_card = NULL;
+    vol->pa_ll_module = NULL;
+    vol->pa_ll_args = NULL;
+    pa_reset_low_latency (vol);
+    vol->pa_idle_timers = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    vol->pa_suspended = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    vol->pa_busy_sinks = g_hash_table_new (NULL, NULL);
+    vol->pa_sink_states = g_hash_table_new (NULL, NULL);
+    vol->pa_idle_enabled = vol->input_control ? FALSE : pa_any_suspend_idle (vol);
+    vol->pa_idle_adopt = TRUE;
+    vol->pa_sinks_changed = TRUE;
+
+    /* Create the display update source - this is dispatched whenever its ready time is set */
+    vol->pa_update_source = g_source_new (&pa_update_source_funcs, sizeof (GSource));
+    g_source_set_callback (vol->pa_update_source, pa_update_disp_cb, vol, NULL);
+    g_source_set_ready_time (vol->pa_update_source, -1);
+    g_source_attach (vol->pa_update_source, NULL);
+
     vol->pa_mainloop = pa_threaded_mainloop_new ();
     pa_threaded_mainloop_start (vol->pa_mainloop);
 
@@ -174,13 +293,11 @@ void pulse_init (VolumePulsePlugin *vol)
         return;
     }
 
-    vol->pa_default_sink = NULL;
-    vol->pa_default_source = NULL;
-    vol->pa_profile = NULL;
-    vol->pa_indices = NULL;
-
     pa_set_subscription (vol);
     pulse_get_default_sink_source (vol);
+    pa_get_device_names (vol);
+    pulse_restore_latency_offsets (vol, NULL);
+    pa_update_idle_sinks (vol);
 }
 
 /* Callback for changes in context state during initialisation */
@@ -204,6 +321,83 @@ static void pa_cb_state (pa_context *pacontext, void *userdata)
 /* Teardown PulseAudio controller */
 
 void pulse_terminate (VolumePulsePlugin *vol)
+{
+    /* Put back any sink changed for low latency mode */
+    if (vol->pa_low_latency) pulse_set_low_latency (vol, FALSE);
+
+    /* Put back any sinks suspended when idle */
+    pa_resume_idle_sinks (vol);
+
+    /* Save the level of the output in use for the next time it is chosen */
+    if (!vol->input_control && vol->pa_default_sink && vol->pa_mainloop)
+        pa_remember_level (vol, vol->pa_default_sink, vol->pa_volume / PA_VOL_SCALE, vol->pa_mute);
+
+    pa_close_connection (vol);
+
+    /* Remove the display update source */
+    if (vol->pa_update_source)
+    {
+        g_source_destroy (vol->pa_update_source);
+        g_source_unref (vol->pa_update_source);
+        vol->pa_update_source = NULL;
+    }
+
+    if (vol->pa_indices)
+    {
+        g_array_free (vol->pa_indices, TRUE);
+        vol->pa_indices = NULL;
+    }
+
+    if (vol->pa_cards)
+    {
+        g_hash_table_destroy (vol->pa_cards);
+        vol->pa_cards = NULL;
+    }
+
+    if (vol->pa_levels)
+    {
+        g_hash_table_destroy (vol->pa_levels);
+        vol->pa_levels = NULL;
+    }
+
+    if (vol->pa_idle_timers)
+    {
+        g_hash_table_destroy (vol->pa_idle_timers);
+        g_hash_table_destroy (vol->pa_suspended);
+        g_hash_table_destroy (vol->pa_busy_sinks);
+        g_hash_table_destroy (vol->pa_sink_states);
+        vol->pa_idle_timers = NULL;
+    }
+
+    if (vol->pa_routes)
+    {
+        g_hash_table_destroy (vol->pa_routes);
+        g_ptr_array_free (vol->pa_route_props, TRUE);
+        vol->pa_routes = NULL;
+    }
+
+    if (vol->pa_ports)
+    {
+        g_hash_table_destroy (vol->pa_ports);
+        vol->pa_ports = NULL;
+    }
+
+    if (vol->pa_device_names)
+    {
+        g_hash_table_destroy (vol->pa_device_names);
+        vol->pa_device_names = NULL;
+    }
+
+    if (vol->pa_auto_switch)
+    {
+        g_hash_table_destroy (vol->pa_auto_switch);
+        vol->pa_auto_switch = NULL;
+    }
+}
+
+/* Disconnect from the controller and stop its thread */
+
+static void pa_close_connection (VolumePulsePlugin *vol)
 {
     if (vol->pa_mainloop != NULL)
     {
@@ -220,6 +414,7 @@ void pulse_terminate (VolumePulsePlugin *vol)
         /* Terminate the control loop */
         pa_threaded_mainloop_stop (vol->pa_mainloop);
         pa_threaded_mainloop_free (vol->pa_mainloop);
+        vol->pa_mainloop = NULL;
     }
 }
 
@@ -232,7 +427,7 @@ static void pa_error_handler (VolumePulsePlugin *vol, char *name)
         int code = pa_context_errno (vol->pa_context);
         g_warning ("%s: err:%d %s\n", name, code, pa_strerror (code));
     }
-    pulse_terminate (vol);
+    pa_close_connection (vol);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -280,18 +475,69 @@ static void pa_cb_subscription (pa_context *pacontext, pa_subscription_event_typ
     DEBUG ("PulseAudio event : %s %s", type, fac);
 #endif
 
-    g_idle_add (pa_update_disp_cb, vol);
+    // card events are queued to update the device count on the main thread
+    if ((event & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) == PA_SUBSCRIPTION_EVENT_CARD)
+        pa_queue_card_event (vol, event & PA_SUBSCRIPTION_EVENT_TYPE_MASK, idx);
+
+    // events on the card of the default sink are flagged to check for an unplugged port on the main thread
+    if ((event & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) == PA_SUBSCRIPTION_EVENT_CARD && idx == vol->pa_default_card)
+    {
+        if ((event & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_REMOVE) vol->pa_card_removed = TRUE;
+        else vol->pa_card_changed = TRUE;
+    }
+
+    // sink or source events keep the cached device set up to date, and flag removal of the default device
+    if ((event & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) == (vol->input_control ? PA_SUBSCRIPTION_EVENT_SOURCE : PA_SUBSCRIPTION_EVENT_SINK))
+        pa_device_event (vol, event & PA_SUBSCRIPTION_EVENT_TYPE_MASK, idx);
+
+    // new streams are routed by the rules here on the controller thread, without waiting for the main thread
+    if ((event & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_NEW
+        && (event & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) == (vol->input_control ? PA_SUBSCRIPTION_EVENT_SOURCE_OUTPUT : PA_SUBSCRIPTION_EVENT_SINK_INPUT))
+        pa_route_new_stream (vol, idx);
+
+    // stream events are queued to update the application controls on the main thread
+    if ((event & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) == PA_SUBSCRIPTION_EVENT_SINK_INPUT)
+        pa_queue_stream_event (vol, event & PA_SUBSCRIPTION_EVENT_TYPE_MASK, idx);
+
+    // sink state changes and new or removed streams mean sink states need to be checked for suspension when idle,
+    // but only if a sink is set to suspend or has been suspended - stream changes only matter for the latter
+    if (!vol->input_control && (vol->pa_idle_enabled || g_hash_table_size (vol->pa_suspended)))
+    {
+        if ((event & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) == PA_SUBSCRIPTION_EVENT_SINK)
+            pa_sink_state_event (vol, event & PA_SUBSCRIPTION_EVENT_TYPE_MASK, idx);
+        else if ((event & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) == PA_SUBSCRIPTION_EVENT_SINK_INPUT
+            && ((event & PA_SUBSCRIPTION_EVENT_TYPE_MASK) != PA_SUBSCRIPTION_EVENT_CHANGE || g_hash_table_size (vol->pa_suspended)))
+            vol->pa_sinks_changed = TRUE;
+    }
+
+    // mark the update source as ready - repeated notifications before it runs are merged
+    g_source_set_ready_time (vol->pa_update_source, 0);
 
     pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
 }
 
+/* Dispatch function for the display update source - disarms the source until the next notification */
+
+static gboolean pa_update_source_dispatch (GSource *source, GSourceFunc callback, gpointer userdata)
+{
+    g_source_set_ready_time (source, -1);
+    if (callback) callback (userdata);
+    return TRUE;
+}
+
 /* Function to update display called when idle after a notification - needs not to be in main loop  */
 
 static gboolean pa_update_disp_cb (gpointer userdata)
 {
     VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
 
+    pa_check_unplug (vol);
+    pa_check_default_removed (vol);
+    pa_check_auto_switch (vol);
+    pa_update_idle_sinks (vol);
+    pulse_update_stream_controls (vol, FALSE);
     volumepulse_update_display (vol);
+    pa_update_port_states (vol);
     return FALSE;
 }
 
@@ -304,7 +550,8 @@ static void pa_cb_generic_success (pa_context *context, int success, void *userd
     if (!success)
     {
         DEBUG ("pulse success callback failed : %s", pa_strerror (pa_context_errno (context)));
-        vol->pa_error_msg = g_strdup (pa_strerror (pa_context_errno (context)));
+        vol->pa_error = pa_context_errno (context);
+        if (vol->pa_error == PA_OK) vol->pa_error = PA_ERR_UNKNOWN;
     }
 
     pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
@@ -323,7 +570,16 @@ static void pa_cb_generic_success (pa_context *context, int success, void *userd
 
 int pulse_get_volume (VolumePulsePlugin *vol)
 {
+    int volume;
+
     pa_get_current_vol_mute (vol);
+
+    // a Bluetooth output with hardware volume which the sink does not forward is read from the headset
+    if (!vol->pa_hw_volume)
+    {
+        volume = bluetooth_get_volume (vol);
+        if (volume >= 0) return volume;
+    }
     return vol->pa_volume / PA_VOL_SCALE;
 }
 
@@ -332,6 +588,10 @@ int pulse_set_volume (VolumePulsePlugin *vol, int volume)
     pa_cvolume cvol;
     int i;
 
+    // a sink with hardware volume control passes its volume on to a Bluetooth headset itself, so the headset
+    // is only set directly if the sink does not - and the sink is then left as it is
+    if (!vol->pa_hw_volume && bluetooth_set_volume (vol, volume)) return 1;
+
     vol->pa_volume = volume * PA_VOL_SCALE;
     if (vol->pa_volume < 0) vol->pa_volume = 0;
     if (vol->pa_volume > 65535) vol->pa_volume = 65535;
@@ -389,6 +649,13 @@ static void pa_cb_get_current_vol_mute (pa_context *context, const pa_sink_info
         vol->pa_channels = i->volume.channels;
         vol->pa_volume = i->volume.values[0];
         vol->pa_mute = i->mute;
+        vol->pa_hw_volume = (i->flags & PA_SINK_HW_VOLUME_CTRL) ? TRUE : FALSE;
+
+        // the card and port in use are cached so an unplug can be recognised from the card notification
+        if (i->card != vol->pa_default_card) vol->pa_ports_stale = TRUE;
+        vol->pa_default_card = i->card;
+        if (i->active_port) vol->pa_default_port = g_intern_string (i->active_port->name);
+        else vol->pa_default_port = NULL;
     }
 
     pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
@@ -408,53 +675,51 @@ static void pa_cb_get_current_input_vol_mute (pa_context *context, const pa_sour
     pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
 }
 
-/* Set volume for new sink to global value read from old sink */
-
-static int pa_restore_volume (VolumePulsePlugin *vol)
-{
-    pa_cvolume cvol;
-    int i;
-
-    cvol.channels = vol->pa_channels;
-    for (i = 0; i < cvol.channels; i++) cvol.values[i] = vol->pa_volume;
-
-    DEBUG ("pa_restore_volume");
-    START_PA_OPERATION
-    op = pa_context_set_sink_volume_by_name (vol->pa_context, vol->pa_default_sink, &cvol, &pa_cb_generic_success, vol);
-    END_PA_OPERATION ("set_sink_volume_by_name")
-}
+/*
+ * The volume and mute state of each sink is remembered when it stops being the
+ * default, so that it can be put back when the sink is next chosen. The table is
+ * keyed by sink name, which stays the same across reconnections, and each entry
+ * holds the level in percent with PA_LEVEL_MUTED added for a muted sink. It is
+ * saved to the settings DeviceVolume and DeviceMute for each sink, and read from
+ * them the first time a sink is looked up.
+ */
 
-/* Set mute for new sink to global value read from old sink */
+/* Remember the level of a sink, saving it to the settings if it has changed */
 
-static int pa_restore_mute (VolumePulsePlugin *vol)
+static void pa_remember_level (VolumePulsePlugin *vol, const char *sinkname, int volume, int mute)
 {
-    DEBUG ("pa_restore_mute");
-    START_PA_OPERATION
-    op = pa_context_set_sink_mute_by_name (vol->pa_context, vol->pa_default_sink, vol->pa_mute, &pa_cb_generic_success, vol);
-    END_PA_OPERATION ("set_sink_mute_by_name");
-}
+    gpointer old;
+    int level = volume + (mute ? PA_LEVEL_MUTED : 0);
 
-/* Query the controller for the number of channels on the current default sink */
+    if (vol->pa_levels == NULL) return;
+    if (g_hash_table_lookup_extended (vol->pa_levels, g_intern_string (sinkname), NULL, &old) && GPOINTER_TO_INT (old) == level) return;
 
-static int pa_get_channels (VolumePulsePlugin *vol)
-{
-    START_PA_OPERATION
-    op = pa_context_get_sink_info_by_name (vol->pa_context, vol->pa_default_sink, &pa_cb_get_channels, vol);
-    END_PA_OPERATION ("get_sink_info_by_name")
+    DEBUG ("Remembering level %d mute %d for %s", volume, mute, sinkname);
+    g_hash_table_insert (vol->pa_levels, (gpointer) g_intern_string (sinkname), GINT_TO_POINTER (level));
+    device_setting_store_int (vol, "DeviceVolume", sinkname, volume);
+    device_setting_store_int (vol, "DeviceMute", sinkname, mute ? 1 : 0);
+    lxpanel_config_save (vol->panel);
 }
 
-/* Callback for volume / mute query */
+/* Look up the remembered level of a sink - returns FALSE if it has none */
 
-static void pa_cb_get_channels (pa_context *context, const pa_sink_info *i, int eol, void *userdata)
+static gboolean pa_recall_level (VolumePulsePlugin *vol, const char *sinkname, int *volume, int *mute)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+    gpointer val;
+    int level;
 
-    if (!eol)
+    if (vol->pa_levels == NULL) return FALSE;
+    if (g_hash_table_lookup_extended (vol->pa_levels, g_intern_string (sinkname), NULL, &val)) level = GPOINTER_TO_INT (val);
+    else
     {
-        vol->pa_channels = i->volume.channels;
+        if (!device_setting_get_int (vol, "DeviceVolume", sinkname, &level)) return FALSE;
+        if (device_setting_get_int (vol, "DeviceMute", sinkname, mute) && *mute) level += PA_LEVEL_MUTED;
+        g_hash_table_insert (vol->pa_levels, (gpointer) g_intern_string (sinkname), GINT_TO_POINTER (level));
     }
 
-    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+    *volume = level & (PA_LEVEL_MUTED - 1);
+    *mute = (level & PA_LEVEL_MUTED) ? 1 : 0;
+    return TRUE;
 }
 
 /*----------------------------------------------------------------------------*/
@@ -478,31 +743,39 @@ static void pa_cb_get_default_sink_source (pa_context *context, const pa_server_
     VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
 
     DEBUG ("pa_cb_get_default_sink_source %s %s", i->default_sink_name, i->default_source_name);
-    if (vol->pa_default_sink) g_free (vol->pa_default_sink);
-    vol->pa_default_sink = g_strdup (i->default_sink_name);
-
-    if (vol->pa_default_source) g_free (vol->pa_default_source);
-    vol->pa_default_source = g_strdup (i->default_source_name);
+    vol->pa_default_sink = g_intern_string (i->default_sink_name);
+    vol->pa_default_source = g_intern_string (i->default_source_name);
 
     pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
 }
 
 /*
- * To change sink, first the default sink is updated to the new sink.
+ * To change sink, first the default sink is updated to the new sink, in the
+ * same batch as putting back the level remembered for it, if there is one.
  * Then, all currently active output streams are listed in pa_indices.
  * Finally, all streams listed in pa_indices are moved to the new sink.
  */
 
 void pulse_change_sink (VolumePulsePlugin *vol, const char *sinkname)
 {
+    int volume, mute;
+
     DEBUG ("pulse_change_sink %s", sinkname);
-    if (vol->pa_default_sink) g_free (vol->pa_default_sink);
-    vol->pa_default_sink = g_strdup (sinkname);
+    if (vol->pa_default_sink && g_strcmp0 (vol->pa_default_sink, sinkname))
+        pa_remember_level (vol, vol->pa_default_sink, vol->pa_volume / PA_VOL_SCALE, vol->pa_mute);
+    vol->pa_default_sink = g_intern_string (sinkname);
+    vol->pa_default_card = PA_INVALID_INDEX;
+
+    if (pa_recall_level (vol, sinkname, &volume, &mute))
+    {
+        vol->pa_volume = volume * PA_VOL_SCALE;
+        vol->pa_mute = mute;
+    }
+    else volume = mute = -1;
 
-    pa_set_default_sink (vol, sinkname);
-    pa_get_channels (vol);
-    pa_restore_volume (vol);
-    pa_restore_mute (vol);
+    // a single channel volume applies to every channel, so the channel count need not be read before the next display refresh
+    vol->pa_channels = 1;
+    pa_apply_sink_batch (vol, sinkname, TRUE, mute, volume);
 
     DEBUG ("pulse_change_sink done");
 }
@@ -511,24 +784,18 @@ void pulse_change_sink (VolumePulsePlugin *vol, const char *sinkname)
 
 void pulse_move_output_streams (VolumePulsePlugin *vol)
 {
+    guint index;
+
     DEBUG ("pulse_move_output_streams");
-    vol->pa_indices = NULL;
+    g_array_set_size (vol->pa_indices, 0);
+    vol->pa_keep_routed = TRUE;
     pa_get_output_streams (vol);
-    g_list_foreach (vol->pa_indices, pa_list_move_to_default_sink, vol);
-    g_list_free (vol->pa_indices);
+    vol->pa_keep_routed = FALSE;
+    for (index = 0; index < vol->pa_indices->len; index++)
+        pa_move_stream_to_default_sink (vol, g_array_index (vol->pa_indices, uint32_t, index));
     DEBUG ("pulse_move_output_streams done");
 }
 
-/* Call the PulseAudio set default sink operation */
-
-static int pa_set_default_sink (VolumePulsePlugin *vol, const char *sinkname)
-{
-    DEBUG ("pa_set_default_sink %s", sinkname);
-    START_PA_OPERATION
-    op = pa_context_set_default_sink (vol->pa_context, sinkname, &pa_cb_generic_success, vol);
-    END_PA_OPERATION ("set_default_sink")
-}
-
 /* Query the controller for a list of current output streams */
 
 static int pa_get_output_streams (VolumePulsePlugin *vol)
@@ -548,21 +815,16 @@ static void pa_cb_get_output_streams (pa_context *context, const pa_sink_input_i
     if (!eol)
     {
         DEBUG ("pa_cb_get_output_streams %d", i->index);
-        vol->pa_indices = g_list_append (vol->pa_indices, (void *) i->index);
+        if (vol->pa_keep_routed && pa_route_target (vol, i->proplist))
+        {
+            DEBUG ("Stream %d is routed by rule", i->index);
+        }
+        else g_array_append_val (vol->pa_indices, i->index);
     }
 
     pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
 }
 
-/* Callback for per-stream operation by looping through pa_indices, moving stream for each */
-
-static void pa_list_move_to_default_sink (gpointer data, gpointer userdata)
-{
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
-
-    pa_move_stream_to_default_sink (vol, (int) data);
-}
-
 /* Call the PulseAudio move stream operation for the supplied index to move the stream to the default sink */
 
 static int pa_move_stream_to_default_sink (VolumePulsePlugin *vol, int index)
@@ -582,8 +844,7 @@ static int pa_move_stream_to_default_sink (VolumePulsePlugin *vol, int index)
 void pulse_change_source (VolumePulsePlugin *vol, const char *sourcename)
 {
     DEBUG ("pulse_change_source %s", sourcename);
-    if (vol->pa_default_source) g_free (vol->pa_default_source);
-    vol->pa_default_source = g_strdup (sourcename);
+    vol->pa_default_source = g_intern_string (sourcename);
 
     pa_set_default_source (vol, sourcename);
 
@@ -604,11 +865,15 @@ static int pa_set_default_source (VolumePulsePlugin *vol, const char *sourcename
 
 void pulse_move_input_streams (VolumePulsePlugin *vol)
 {
+    guint index;
+
     DEBUG ("pulse_move_input_streams");
-    vol->pa_indices = NULL;
+    g_array_set_size (vol->pa_indices, 0);
+    vol->pa_keep_routed = TRUE;
     pa_get_input_streams (vol);
-    g_list_foreach (vol->pa_indices, pa_list_move_to_default_source, vol);
-    g_list_free (vol->pa_indices);
+    vol->pa_keep_routed = FALSE;
+    for (index = 0; index < vol->pa_indices->len; index++)
+        pa_move_stream_to_default_source (vol, g_array_index (vol->pa_indices, uint32_t, index));
     DEBUG ("pulse_move_input_streams done");
 }
 
@@ -631,21 +896,16 @@ static void pa_cb_get_input_streams (pa_context *context, const pa_source_output
     if (!eol)
     {
         DEBUG ("pa_cb_get_input_streams %d", i->index);
-        vol->pa_indices = g_list_append (vol->pa_indices, (void *) i->index);
+        if (vol->pa_keep_routed && pa_route_target (vol, i->proplist))
+        {
+            DEBUG ("Stream %d is routed by rule", i->index);
+        }
+        else g_array_append_val (vol->pa_indices, i->index);
     }
 
     pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
 }
 
-/* Callback for per-stream operation by looping through pa_indices, moving stream for each */
-
-static void pa_list_move_to_default_source (gpointer data, gpointer userdata)
-{
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
-
-    pa_move_stream_to_default_source (vol, (int) data);
-}
-
 /* Call the PulseAudio move stream operation for the supplied index to move the stream to the default source */
 
 static int pa_move_stream_to_default_source (VolumePulsePlugin *vol, int index)
@@ -662,24 +922,17 @@ static int pa_move_stream_to_default_source (VolumePulsePlugin *vol, int index)
 
 void pulse_mute_all_streams (VolumePulsePlugin *vol)
 {
+    guint index;
+
     DEBUG ("pulse_mute_all_streams");
 
-    vol->pa_indices = NULL;
+    g_array_set_size (vol->pa_indices, 0);
     pa_get_output_streams (vol);
-    g_list_foreach (vol->pa_indices, pa_list_mute_stream, vol);
-    g_list_free (vol->pa_indices);
+    for (index = 0; index < vol->pa_indices->len; index++)
+        pa_mute_stream (vol, g_array_index (vol->pa_indices, uint32_t, index));
     DEBUG ("pulse_mute_all_streams done");
 }
 
-/* Callback for per-stream operation by looping through pa_indices, muting stream for each */
-
-static void pa_list_mute_stream (gpointer data, gpointer userdata)
-{
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
-
-    pa_mute_stream (vol, (int) data);
-}
-
 /* Call the PulseAudio mute stream operation for the supplied index*/
 
 static int pa_mute_stream (VolumePulsePlugin *vol, int index)
@@ -692,24 +945,17 @@ static int pa_mute_stream (VolumePulsePlugin *vol, int index)
 
 void pulse_unmute_all_streams (VolumePulsePlugin *vol)
 {
+    guint index;
+
     DEBUG ("pulse_unmute_all_streams");
 
-    vol->pa_indices = NULL;
+    g_array_set_size (vol->pa_indices, 0);
     pa_get_output_streams (vol);
-    g_list_foreach (vol->pa_indices, pa_list_unmute_stream, vol);
-    g_list_free (vol->pa_indices);
+    for (index = 0; index < vol->pa_indices->len; index++)
+        pa_unmute_stream (vol, g_array_index (vol->pa_indices, uint32_t, index));
     DEBUG ("pulse_unmute_all_streams done");
 }
 
-/* Callback for per-stream operation by looping through pa_indices, unmuting stream for each */
-
-static void pa_list_unmute_stream (gpointer data, gpointer userdata)
-{
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
-
-    pa_unmute_stream (vol, (int) data);
-}
-
 /* Call the PulseAudio unmute stream operation for the supplied index*/
 
 static int pa_unmute_stream (VolumePulsePlugin *vol, int index)
@@ -721,401 +967,2024 @@ static int pa_unmute_stream (VolumePulsePlugin *vol, int index)
 }
 
 /*----------------------------------------------------------------------------*/
-/* Profiles                                                                   */
+/* Application stream controls                                                */
 /*----------------------------------------------------------------------------*/
 
-/* 
- * Read the profile of the supplied card - this is polled to check if a Bluetooth device has
- * successfully connected to PulseAudio, hence why the profile is NULLed before starting so
- * that old profile data does not spuriously cause the poll to succeed prematurely.
- */ 
+/*
+ * The application controls in the popup are updated from stream notifications,
+ * which are queued by the notification callback and applied at the next display
+ * refresh. Only the streams named in the queue are queried, once each however
+ * many notifications arrived for them; the whole list is only read when the popup
+ * is created or the queue has overflowed.
+ */
 
-int pulse_get_profile (VolumePulsePlugin *vol, const char *card)
+/* Add a stream event to the queue - called from the controller thread, so the mainloop lock is already held */
+
+static void pa_queue_stream_event (VolumePulsePlugin *vol, pa_subscription_event_type_t event, uint32_t idx)
+{
+    // nothing to do until the popup has been created
+    if (vol->popup_streams == NULL) return;
+
+    if (vol->pa_stream_event_count < PA_STREAM_EVENTS)
+    {
+        vol->pa_stream_events[vol->pa_stream_event_count].index = idx;
+        vol->pa_stream_events[vol->pa_stream_event_count].type = event;
+        vol->pa_stream_event_count++;
+    }
+    else vol->pa_stream_rescan = TRUE;
+}
+
+/* Apply queued stream events to the application controls, or read all streams if full is set */
+
+void pulse_update_stream_controls (VolumePulsePlugin *vol, gboolean full)
 {
-    if (vol->pa_profile)
+    pa_event_t events[PA_STREAM_EVENTS];
+    int count, ev, later;
+
+    if (vol->input_control || vol->popup_streams == NULL || vol->pa_mainloop == NULL) return;
+
+    // take a copy of the queue so the lock is not held during the queries below
+    pa_threaded_mainloop_lock (vol->pa_mainloop);
+    count = vol->pa_stream_event_count;
+    memcpy (events, vol->pa_stream_events, count * sizeof (pa_event_t));
+    if (vol->pa_stream_rescan) full = TRUE;
+    vol->pa_stream_event_count = 0;
+    vol->pa_stream_rescan = FALSE;
+    pa_threaded_mainloop_unlock (vol->pa_mainloop);
+
+    if (full)
+    {
+        DEBUG ("pulse_update_stream_controls - full update");
+        popup_streams_mark (vol);
+        pa_get_stream_info (vol, PA_INVALID_INDEX);
+        popup_streams_sweep (vol);
+        return;
+    }
+
+    for (ev = 0; ev < count; ev++)
     {
-        g_free (vol->pa_profile);
-        vol->pa_profile = NULL;
+        // a later event for the same stream supersedes this one
+        for (later = ev + 1; later < count; later++)
+            if (events[later].index == events[ev].index) break;
+        if (later < count) continue;
+
+        DEBUG ("pulse_update_stream_controls - stream %d event %d", events[ev].index, events[ev].type);
+        if (events[ev].type == PA_SUBSCRIPTION_EVENT_REMOVE)
+            popup_stream_remove (vol, events[ev].index);
+        else
+            pa_get_stream_info (vol, events[ev].index);
     }
+}
+
+/* Query the controller for a single output stream, or for all streams if the index is PA_INVALID_INDEX */
 
+static int pa_get_stream_info (VolumePulsePlugin *vol, uint32_t index)
+{
     START_PA_OPERATION
-    op = pa_context_get_card_info_by_name (vol->pa_context, card, &pa_cb_get_profile, vol);
-    END_PA_OPERATION ("get_card_info_by_name")
+    if (index == PA_INVALID_INDEX)
+        op = pa_context_get_sink_input_info_list (vol->pa_context, &pa_cb_get_stream_info, vol);
+    else
+        op = pa_context_get_sink_input_info (vol->pa_context, index, &pa_cb_get_stream_info, vol);
+    END_PA_OPERATION ("get_sink_input_info")
 }
 
-/* Callback for profile query */
+/* Callback for output stream query - adds or updates the row for the stream in the popup */
 
-static void pa_cb_get_profile (pa_context *c, const pa_card_info *i, int eol, void *userdata)
+static void pa_cb_get_stream_info (pa_context *c, const pa_sink_input_info *i, int eol, void *userdata)
 {
     VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+    const char *name, *icon;
 
     if (!eol)
     {
-        DEBUG ("pa_cb_get_profile %s", i->active_profile2->name);
-        if (vol->pa_profile) g_free (vol->pa_profile);
-        vol->pa_profile = g_strdup (i->active_profile2->name);
+        name = pa_proplist_gets (i->proplist, PA_PROP_APPLICATION_NAME);
+        if (!name) name = i->name;
+        icon = pa_proplist_gets (i->proplist, PA_PROP_APPLICATION_ICON_NAME);
+        if (!icon) icon = pa_proplist_gets (i->proplist, PA_PROP_MEDIA_ICON_NAME);
+        if (!icon) icon = "audio-x-generic";
+
+        popup_stream_update (vol, i->index, name, pa_proplist_gets (i->proplist, PA_PROP_MEDIA_NAME), icon,
+            i->volume.channels, i->volume.values[0] / PA_VOL_SCALE, i->mute);
     }
 
     pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
 }
 
-/* Call the PulseAudio set profile operation for the supplied card */
+/* Set the volume of an output stream */
 
-int pulse_set_profile (VolumePulsePlugin *vol, const char *card, const char *profile)
+int pulse_set_stream_volume (VolumePulsePlugin *vol, uint32_t index, int channels, int volume)
 {
-    DEBUG ("pulse_set_profile %s %s", card, profile);
+    pa_cvolume cvol;
+    int i;
+
+    cvol.channels = channels;
+    for (i = 0; i < cvol.channels; i++) cvol.values[i] = volume * PA_VOL_SCALE;
+
+    DEBUG ("pulse_set_stream_volume %d %d", index, volume);
     START_PA_OPERATION
-    op = pa_context_set_card_profile_by_name (vol->pa_context, card, profile, &pa_cb_generic_success, vol);
-    END_PA_OPERATION ("set_card_profile_by_name")
+    op = pa_context_set_sink_input_volume (vol->pa_context, index, &cvol, &pa_cb_generic_success, vol);
+    END_PA_OPERATION ("set_sink_input_volume")
 }
 
-/*----------------------------------------------------------------------------*/
-/* Device menu                                                                */
-/*----------------------------------------------------------------------------*/
-
-/* 
- * To populate the device select menu, the controller is initially queried for the
- * list of audio cards, which are stored with their card names. After discovery is
- * complete, the controller is queried for the list of sinks and sources, which is
- * used to replace the card name with the relevant sink or source name, allowing
- * cards which are have the wrong profile set to be shown greyed-out in the menu.
- */
- 
-/* Loop through all cards, adding each to relevant part of device menu */
+/* Set the mute state of an output stream */
 
-int pulse_add_devices_to_menu (VolumePulsePlugin *vol, gboolean internal)
+int pulse_set_stream_mute (VolumePulsePlugin *vol, uint32_t index, int mute)
 {
-    if (internal && vol->input_control) return 0;
-    vol->separator = FALSE;
-    DEBUG ("pulse_add_devices_to_menu %d %d", vol->input_control, internal);
+    DEBUG ("pulse_set_stream_mute %d %d", index, mute);
     START_PA_OPERATION
-    if (vol->input_control)
-        op = pa_context_get_card_info_list (vol->pa_context, &pa_cb_get_info_inputs, vol);
-    else if (internal)
-        op = pa_context_get_card_info_list (vol->pa_context, &pa_cb_get_info_internal, vol);
-    else
-        op = pa_context_get_card_info_list (vol->pa_context, &pa_cb_get_info_external, vol);
-    END_PA_OPERATION ("get_card_info_list")
+    op = pa_context_set_sink_input_mute (vol->pa_context, index, mute, &pa_cb_generic_success, vol);
+    END_PA_OPERATION ("set_sink_input_mute")
 }
 
+/*----------------------------------------------------------------------------*/
+/* Routing rules                                                              */
+/*----------------------------------------------------------------------------*/
+
 /*
- * Callbacks for card info query, each of which checks to see if the device should
- * be in the menu in question and adding it if so
+ * Routing rules send new streams with a given property value to a given device,
+ * and streams they match are left where they are when the default device changes.
+ * They are read from the RoutingRules setting, as a semicolon-separated list of
+ * property=value>device, for example
+ *
+ *   media.role=phone>bluez_sink.00_11_22_33_44_55.handsfree_head_unit;application.name=Chromium>alsa_output.platform-fef00700.hdmi.hdmi-stereo
+ *
+ * with sinks as the devices for the output plugin and sources for the input plugin.
+ * The rules are held in a table keyed by property, of tables keyed by value, so a
+ * stream is matched by two lookups for each property the rules use, whatever the
+ * number of rules, and without building a key; where rules on different properties
+ * match, the property used first in the list wins.
  */
 
-static void pa_cb_get_info_inputs (pa_context *c, const pa_card_info *i, int eol, void *userdata)
+/* Read the routing rules into the rule table */
+
+static void pa_load_routing_rules (VolumePulsePlugin *vol)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+    const char *setting;
+    char **rules, *target, *value, *prop;
+    GHashTable *values;
+    int rule;
 
-    if (!eol)
+    vol->pa_routes = NULL;
+    vol->pa_route_props = NULL;
+    if (!config_setting_lookup_string (vol->settings, "RoutingRules", &setting) || !*setting) return;
+
+    // the property names are owned by the list, which outlives the table
+    vol->pa_routes = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) g_hash_table_destroy);
+    vol->pa_route_props = g_ptr_array_new_with_free_func (g_free);
+
+    rules = g_strsplit (setting, ";", -1);
+    for (rule = 0; rules[rule]; rule++)
     {
-        if (pa_card_has_port (i, PA_DIRECTION_INPUT))
+        g_strstrip (rules[rule]);
+        target = strchr (rules[rule], '>');
+        value = strchr (rules[rule], '=');
+        if (!target || !value || value > target)
         {
-            const char *nam = pa_proplist_gets (i->proplist, "alsa.card_name");
-            if (nam)
-            {
-                DEBUG ("pa_cb_get_info_inputs %s", nam);
-                menu_add_item (vol, nam, nam);
-            }
+            if (*rules[rule]) g_warning ("volumepulse: ignoring invalid routing rule '%s'", rules[rule]);
+            continue;
         }
-    }
+        *target++ = 0;
+        *value++ = 0;
+        DEBUG ("Routing rule %s=%s > %s", rules[rule], value, target);
 
-    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+        values = g_hash_table_lookup (vol->pa_routes, rules[rule]);
+        if (!values)
+        {
+            prop = g_strdup (rules[rule]);
+            g_ptr_array_add (vol->pa_route_props, prop);
+            values = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+            g_hash_table_insert (vol->pa_routes, prop, values);
+        }
+
+        // later rules for the same property value do not replace earlier ones
+        if (!g_hash_table_contains (values, value))
+            g_hash_table_insert (values, g_strdup (value), g_strdup (target));
+    }
+    g_strfreev (rules);
 }
 
-static void pa_cb_get_info_internal (pa_context *c, const pa_card_info *i, int eol, void *userdata)
+/* Find the device to which a stream is routed by the rules - returns NULL if no rule matches */
+
+static const char *pa_route_target (VolumePulsePlugin *vol, pa_proplist *proplist)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+    const char *prop, *value, *target = NULL;
+    guint index;
 
-    if (!eol)
+    if (vol->pa_routes == NULL) return NULL;
+
+    for (index = 0; index < vol->pa_route_props->len && !target; index++)
     {
-        if (!g_strcmp0 (pa_proplist_gets (i->proplist, "device.description"), "Built-in Audio"))
-        {
-            if (pa_card_has_port (i, PA_DIRECTION_OUTPUT))
-            {
-                const char *nam = pa_proplist_gets (i->proplist, "alsa.card_name");
-                if (nam)
-                {
-                    if (!strcmp (nam, "bcm2835 Headphones") && vsystem ("raspi-config nonint has_analog")) return;
-                    DEBUG ("pa_cb_get_info_internal %s", nam);
-                    menu_add_item (vol, nam, nam);
-                }
-            }
-        }
+        prop = g_ptr_array_index (vol->pa_route_props, index);
+        value = pa_proplist_gets (proplist, prop);
+        if (value) target = g_hash_table_lookup (g_hash_table_lookup (vol->pa_routes, prop), value);
     }
-
-    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+    return target;
 }
 
-static void pa_cb_get_info_external (pa_context *c, const pa_card_info *i, int eol, void *userdata)
+/* Query a new stream to route it - called from the controller thread, so the query is not waited for */
+
+static void pa_route_new_stream (VolumePulsePlugin *vol, uint32_t idx)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+    pa_operation *op;
 
-    if (!eol)
+    if (vol->pa_routes == NULL) return;
+
+    if (vol->input_control)
+        op = pa_context_get_source_output_info (vol->pa_context, idx, &pa_cb_route_input_stream, vol);
+    else
+        op = pa_context_get_sink_input_info (vol->pa_context, idx, &pa_cb_route_output_stream, vol);
+    if (op) pa_operation_unref (op);
+}
+
+/* Callback for new output stream query - moves the stream to the sink given by any rule it matches */
+
+static void pa_cb_route_output_stream (pa_context *c, const pa_sink_input_info *i, int eol, void *userdata)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+    const char *target;
+    pa_operation *op;
+
+    if (eol) return;
+
+    target = pa_route_target (vol, i->proplist);
+    if (target)
+    {
+        DEBUG ("Routing output stream %d to %s", i->index, target);
+        op = pa_context_move_sink_input_by_name (c, i->index, target, &pa_cb_route_moved, GUINT_TO_POINTER (i->index));
+        if (op) pa_operation_unref (op);
+    }
+}
+
+/* Callback for new input stream query - moves the stream to the source given by any rule it matches */
+
+static void pa_cb_route_input_stream (pa_context *c, const pa_source_output_info *i, int eol, void *userdata)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+    const char *target;
+    pa_operation *op;
+
+    if (eol) return;
+
+    target = pa_route_target (vol, i->proplist);
+    if (target)
+    {
+        DEBUG ("Routing input stream %d to %s", i->index, target);
+        op = pa_context_move_source_output_by_name (c, i->index, target, &pa_cb_route_moved, GUINT_TO_POINTER (i->index));
+        if (op) pa_operation_unref (op);
+    }
+}
+
+/* Callback for a stream move by the rules - nothing waits for the move, so a failure is only logged */
+
+static void pa_cb_route_moved (pa_context *c, int success, void *userdata)
+{
+    if (!success) DEBUG ("Routing stream %d failed : %s", GPOINTER_TO_UINT (userdata), pa_strerror (pa_context_errno (c)));
+}
+
+/*----------------------------------------------------------------------------*/
+/* Port unplug policy                                                         */
+/*----------------------------------------------------------------------------*/
+
+/*
+ * The availability of each output port on the card of the default sink is cached,
+ * and re-read whenever a notification arrives for that card. If the port in use
+ * becomes unavailable, or the card is removed, the unplug policy is applied at the
+ * same display refresh. The policy comes from the settings UnplugMute, to mute the
+ * output; UnplugFallback, naming a sink to switch to, or failing that, only if the
+ * card has gone, the device priority list; and UnplugRestoreVolume, to set the
+ * output to the level last used on that sink and port. If none of these is set,
+ * nothing is done. The level of each unplugged port is saved, if it has changed,
+ * for UnplugRestoreVolume. The mute and level are sent to the controller as one
+ * batch, before the default sink change and the moves of all streams are sent as
+ * another, so that nothing is heard at the wrong level.
+ */
+
+/* Check for an unplugged port after a notification for the card of the default sink */
+
+static void pa_check_unplug (VolumePulsePlugin *vol)
+{
+    gboolean changed, removed;
+
+    if (vol->input_control || vol->pa_ports == NULL || vol->pa_mainloop == NULL) return;
+
+    pa_threaded_mainloop_lock (vol->pa_mainloop);
+    changed = vol->pa_card_changed;
+    removed = vol->pa_card_removed;
+    vol->pa_card_changed = FALSE;
+    vol->pa_card_removed = FALSE;
+    pa_threaded_mainloop_unlock (vol->pa_mainloop);
+
+    vol->pa_unplugged = FALSE;
+    if (removed)
+    {
+        DEBUG ("Card of default sink removed");
+        vol->pa_unplugged = TRUE;
+        vol->pa_ports_stale = TRUE;
+    }
+    else if (changed && !vol->pa_ports_stale && vol->pa_default_card != PA_INVALID_INDEX)
+        pa_get_port_states (vol, vol->pa_default_card);
+
+    // a removal of the default sink for which there is no policy is left to the device priority list
+    if (vol->pa_unplugged && !pa_apply_unplug_policy (vol, removed)) vol->pa_unplugged = FALSE;
+}
+
+/* Read the port availability afresh once the default sink has moved to another card */
+
+static void pa_update_port_states (VolumePulsePlugin *vol)
+{
+    if (vol->input_control || vol->pa_ports == NULL || !vol->pa_ports_stale || vol->pa_default_card == PA_INVALID_INDEX) return;
+
+    g_hash_table_remove_all (vol->pa_ports);
+    vol->pa_ports_stale = FALSE;
+    pa_get_port_states (vol, vol->pa_default_card);
+}
+
+/* Query the controller for the ports of a card */
+
+static int pa_get_port_states (VolumePulsePlugin *vol, uint32_t card)
+{
+    START_PA_OPERATION
+    op = pa_context_get_card_info_by_index (vol->pa_context, card, &pa_cb_get_port_states, vol);
+    END_PA_OPERATION ("get_card_info_by_index")
+}
+
+/* Callback for card query - updates the cached availability of each output port, noting if the port in use has gone */
+
+static void pa_cb_get_port_states (pa_context *c, const pa_card_info *i, int eol, void *userdata)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+    pa_card_port_info **port;
+    gpointer old;
+
+    if (!eol)
+    {
+        for (port = i->ports; port && *port; port++)
+        {
+            if ((*port)->direction != PA_DIRECTION_OUTPUT) continue;
+            if (g_hash_table_lookup_extended (vol->pa_ports, (*port)->name, NULL, &old)
+                && GPOINTER_TO_INT (old) != PA_PORT_AVAILABLE_NO && (*port)->available == PA_PORT_AVAILABLE_NO
+                && !g_strcmp0 ((*port)->name, vol->pa_default_port))
+            {
+                DEBUG ("Port %s on default sink unplugged", (*port)->name);
+                vol->pa_unplugged = TRUE;
+            }
+            g_hash_table_insert (vol->pa_ports, (gpointer) g_intern_string ((*port)->name), GINT_TO_POINTER ((*port)->available));
+        }
+    }
+
+    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+}
+
+/* Apply the unplug policy, after a port unplug or the removal of the card - returns FALSE if there is no policy to apply */
+
+static gboolean pa_apply_unplug_policy (VolumePulsePlugin *vol, gboolean removed)
+{
+    const char *fallback, *target;
+    int mute, restore, level = -1, saved;
+    gboolean moved;
+    char *device;
+
+    if (!config_setting_lookup_int (vol->settings, "UnplugMute", &mute)) mute = 0;
+    if (!config_setting_lookup_int (vol->settings, "UnplugRestoreVolume", &restore)) restore = 0;
+    if (!config_setting_lookup_string (vol->settings, "UnplugFallback", &fallback) || !*fallback) fallback = NULL;
+    if (!mute && !restore && !fallback) return FALSE;
+
+    // save the level of the unplugged port, cached from before the unplug, for when it is next used
+    if (vol->pa_default_sink && vol->pa_default_port)
+    {
+        device = g_strdup_printf ("%s_%s", vol->pa_default_sink, vol->pa_default_port);
+        if (!device_setting_get_int (vol, "PortVolume", device, &saved) || saved != vol->pa_volume / PA_VOL_SCALE)
+        {
+            device_setting_store_int (vol, "PortVolume", device, vol->pa_volume / PA_VOL_SCALE);
+            lxpanel_config_save (vol->panel);
+        }
+        g_free (device);
+    }
+
+    // find where the output goes now - the controller may already have moved to another sink or port
+    pulse_get_default_sink_source (vol);
+    target = NULL;
+    if (!fallback && removed) fallback = pa_best_device (vol);
+    if (fallback && pa_get_sink_info (vol, fallback)) target = fallback;
+    else if (vol->pa_default_sink && pa_get_sink_info (vol, vol->pa_default_sink)) target = vol->pa_default_sink;
+    if (!target) return TRUE;
+
+    if (restore && vol->pa_sink_port)
+    {
+        device = g_strdup_printf ("%s_%s", target, vol->pa_sink_port);
+        if (!device_setting_get_int (vol, "PortVolume", device, &level)) level = -1;
+        g_free (device);
+    }
+
+    moved = g_strcmp0 (target, vol->pa_default_sink) != 0;
+    DEBUG ("Unplug policy - sink %s mute %d volume %d", target, mute, level);
+    if (!moved && !mute && level < 0) return TRUE;
+
+    // set the level of the new sink before any streams reach it, then move them all in one batch with the default
+    if (mute || level >= 0) pa_apply_sink_batch (vol, target, FALSE, mute ? 1 : -1, level);
+    if (moved)
+    {
+        target = g_intern_string (target);
+        vol->pa_default_sink = target;
+        vol->pa_default_card = PA_INVALID_INDEX;
+        pa_move_streams_batch (vol, target, TRUE);
+    }
+    return TRUE;
+}
+
+/* Send mute, volume and default sink changes for a sink as one batch, then wait for them all - mute or volume of -1 is left as it is */
+
+static int pa_apply_sink_batch (VolumePulsePlugin *vol, const char *sinkname, gboolean set_default, int mute, int volume)
+{
+    pa_operation *ops[3];
+    pa_cvolume cvol;
+    int nops = 0;
+
+    if (vol->pa_mainloop == NULL) return 0;
+    vol->pa_error = PA_OK;
+    pa_threaded_mainloop_lock (vol->pa_mainloop);
+
+    if (mute >= 0)
+        ops[nops++] = pa_context_set_sink_mute_by_name (vol->pa_context, sinkname, mute, &pa_cb_generic_success, vol);
+    if (volume >= 0)
+    {
+        pa_cvolume_set (&cvol, 1, volume * PA_VOL_SCALE);
+        ops[nops++] = pa_context_set_sink_volume_by_name (vol->pa_context, sinkname, &cvol, &pa_cb_generic_success, vol);
+    }
+    if (set_default)
+        ops[nops++] = pa_context_set_default_sink (vol->pa_context, sinkname, &pa_cb_generic_success, vol);
+
+    if (!pa_wait_batch (vol, ops, nops))
+    {
+        pa_threaded_mainloop_unlock (vol->pa_mainloop);
+        pa_error_handler (vol, "sink_batch");
+        return 0;
+    }
+
+    pa_threaded_mainloop_unlock (vol->pa_mainloop);
+    if (vol->pa_error) DEBUG ("Sink batch failed : %s", pa_strerror (vol->pa_error));
+    return vol->pa_error ? 0 : 1;
+}
+
+/* Wait for a batch of operations - the requests are all queued before waiting, so they reach the controller together */
+/* Returns FALSE if any request could not be sent - the caller must then unlock and call the error handler, as for a single operation */
+
+static gboolean pa_wait_batch (VolumePulsePlugin *vol, pa_operation **ops, int nops)
+{
+    gboolean sent = TRUE;
+    int index;
+
+    for (index = 0; index < nops; index++)
+    {
+        if (!ops[index])
+        {
+            sent = FALSE;
+            continue;
+        }
+        while (pa_operation_get_state (ops[index]) == PA_OPERATION_RUNNING)
+            pa_threaded_mainloop_wait (vol->pa_mainloop);
+        pa_operation_unref (ops[index]);
+    }
+    return sent;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Device priority                                                            */
+/*----------------------------------------------------------------------------*/
+
+/*
+ * The names of all sinks (or sources, for the input plugin) are cached, keyed by
+ * index, and kept up to date from notifications. When the default device is
+ * removed, the setting DevicePriority - a list of device names separated by
+ * semicolons, most preferred first - is checked against the cache, and the first
+ * device still present becomes the default, with all streams moved to it in the
+ * same batch. The time from the removal notification to the streams arriving on
+ * the new device is reported. If an unplug policy fallback has already been
+ * applied for the removal, or the plugin has itself set a new default which is
+ * present, that is left in place.
+ */
+
+/* Query the controller for all sinks or sources to fill the cached device set */
+
+static int pa_get_device_names (VolumePulsePlugin *vol)
+{
+    START_PA_OPERATION
+    if (vol->input_control) op = pa_context_get_source_info_list (vol->pa_context, &pa_cb_get_source_name, vol);
+    else op = pa_context_get_sink_info_list (vol->pa_context, &pa_cb_get_sink_name, vol);
+    END_PA_OPERATION ("get_device_names")
+}
+
+/* Callback for sink query - adds the sink to the cached device set */
+
+static void pa_cb_get_sink_name (pa_context *c, const pa_sink_info *i, int eol, void *userdata)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+
+    if (!eol && vol->pa_device_names)
+        g_hash_table_insert (vol->pa_device_names, GUINT_TO_POINTER (i->index), g_strdup (i->name));
+
+    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+}
+
+/* Callback for source query - adds the source to the cached device set, leaving out monitors */
+
+static void pa_cb_get_source_name (pa_context *c, const pa_source_info *i, int eol, void *userdata)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+
+    if (!eol && vol->pa_device_names && i->monitor_of_sink == PA_INVALID_INDEX)
+        g_hash_table_insert (vol->pa_device_names, GUINT_TO_POINTER (i->index), g_strdup (i->name));
+
+    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+}
+
+/* Update the cached device set for a sink or source event - called from the controller thread, so the mainloop lock is already held */
+
+static void pa_device_event (VolumePulsePlugin *vol, pa_subscription_event_type_t event, uint32_t idx)
+{
+    pa_operation *op;
+    const char *name;
+
+    if (vol->pa_device_names == NULL) return;
+
+    if (event == PA_SUBSCRIPTION_EVENT_NEW)
+    {
+        if (vol->input_control) op = pa_context_get_source_info_by_index (vol->pa_context, idx, &pa_cb_new_source, vol);
+        else op = pa_context_get_sink_info_by_index (vol->pa_context, idx, &pa_cb_new_sink, vol);
+        if (op) pa_operation_unref (op);
+    }
+    else if (event == PA_SUBSCRIPTION_EVENT_REMOVE)
+    {
+        name = g_hash_table_lookup (vol->pa_device_names, GUINT_TO_POINTER (idx));
+        if (name && !g_strcmp0 (name, vol->input_control ? vol->pa_default_source : vol->pa_default_sink))
+        {
+            DEBUG ("Default device %s removed", name);
+            vol->pa_default_removed = TRUE;
+            vol->pa_removed_time = g_get_monotonic_time ();
+        }
+        g_hash_table_remove (vol->pa_device_names, GUINT_TO_POINTER (idx));
+    }
+}
+
+/* Hash table find function to match a device name */
+
+static gboolean pa_match_name (gpointer key, gpointer value, gpointer user_data)
+{
+    return !g_strcmp0 ((const char *) value, (const char *) user_data);
+}
+
+/* Find the most preferred device in the priority list which is still present - returns NULL if there is none */
+
+static const char *pa_best_device (VolumePulsePlugin *vol)
+{
+    const char *list, *best = NULL;
+    char **names, **name;
+
+    if (!config_setting_lookup_string (vol->settings, "DevicePriority", &list) || !*list) return NULL;
+    if (vol->pa_device_names == NULL || vol->pa_mainloop == NULL) return NULL;
+
+    names = g_strsplit (list, ";", -1);
+    pa_threaded_mainloop_lock (vol->pa_mainloop);
+    for (name = names; *name; name++)
+    {
+        g_strstrip (*name);
+        if (**name && g_hash_table_find (vol->pa_device_names, pa_match_name, *name))
+        {
+            best = g_intern_string (*name);
+            break;
+        }
+    }
+    pa_threaded_mainloop_unlock (vol->pa_mainloop);
+    g_strfreev (names);
+    return best;
+}
+
+/* Move to the most preferred remaining device after the default device has been removed */
+
+static void pa_check_default_removed (VolumePulsePlugin *vol)
+{
+    const char *best, *current;
+    gboolean removed, present;
+    gint64 start;
+
+    if (vol->pa_mainloop == NULL) return;
+
+    pa_threaded_mainloop_lock (vol->pa_mainloop);
+    removed = vol->pa_default_removed;
+    start = vol->pa_removed_time;
+    vol->pa_default_removed = FALSE;
+    pa_threaded_mainloop_unlock (vol->pa_mainloop);
+    if (!removed) return;
+
+    // the unplug policy has already chosen a device for this removal
+    if (vol->pa_unplugged)
+    {
+        DEBUG ("Default device removed - unplug policy applied in %d ms", (int) ((g_get_monotonic_time () - start) / 1000));
+        return;
+    }
+
+    // the plugin may have set a new default itself since the removal, as a Bluetooth profile change does - the
+    // controller is not asked, as it reports a replacement of its own choosing once the default has gone
+    current = vol->input_control ? vol->pa_default_source : vol->pa_default_sink;
+    pa_threaded_mainloop_lock (vol->pa_mainloop);
+    present = current && g_hash_table_find (vol->pa_device_names, pa_match_name, (gpointer) current);
+    pa_threaded_mainloop_unlock (vol->pa_mainloop);
+    if (present)
+    {
+        DEBUG ("Default device removed - %s already chosen in its place", current);
+        return;
+    }
+
+    best = pa_best_device (vol);
+    if (!best)
+    {
+        DEBUG ("Default device removed - no device in priority list present");
+        return;
+    }
+
+    if (vol->input_control) vol->pa_default_source = best;
+    else
+    {
+        vol->pa_default_sink = best;
+        vol->pa_default_card = PA_INVALID_INDEX;
+    }
+    pa_move_streams_batch (vol, best, TRUE);
+    DEBUG ("Default device removed - recovered to %s with %d streams in %d ms", best, vol->pa_indices->len,
+        (int) ((g_get_monotonic_time () - start) / 1000));
+}
+
+/* Send the moves of all streams to a device, and optionally a default device change, as one batch, then wait for them all */
+
+static int pa_move_streams_batch (VolumePulsePlugin *vol, const char *name, gboolean set_default)
+{
+    pa_operation **ops;
+    uint32_t stream;
+    guint index;
+    int nops = 0;
+
+    // list the streams first - any which follow a routing rule are left where they are
+    g_array_set_size (vol->pa_indices, 0);
+    vol->pa_keep_routed = TRUE;
+    if (vol->input_control) pa_get_input_streams (vol);
+    else pa_get_output_streams (vol);
+    vol->pa_keep_routed = FALSE;
+
+    if (vol->pa_mainloop == NULL) return 0;
+    ops = g_new (pa_operation *, vol->pa_indices->len + 1);
+    vol->pa_error = PA_OK;
+    pa_threaded_mainloop_lock (vol->pa_mainloop);
+
+    if (set_default)
+    {
+        if (vol->input_control)
+            ops[nops++] = pa_context_set_default_source (vol->pa_context, name, &pa_cb_generic_success, vol);
+        else
+            ops[nops++] = pa_context_set_default_sink (vol->pa_context, name, &pa_cb_generic_success, vol);
+    }
+    for (index = 0; index < vol->pa_indices->len; index++)
+    {
+        stream = g_array_index (vol->pa_indices, uint32_t, index);
+        if (vol->input_control)
+            ops[nops++] = pa_context_move_source_output_by_name (vol->pa_context, stream, name, &pa_cb_generic_success, vol);
+        else
+            ops[nops++] = pa_context_move_sink_input_by_name (vol->pa_context, stream, name, &pa_cb_generic_success, vol);
+    }
+    if (!pa_wait_batch (vol, ops, nops))
+    {
+        pa_threaded_mainloop_unlock (vol->pa_mainloop);
+        g_free (ops);
+        pa_error_handler (vol, "move_streams_batch");
+        return 0;
+    }
+
+    pa_threaded_mainloop_unlock (vol->pa_mainloop);
+    g_free (ops);
+    if (vol->pa_error) DEBUG ("Stream move batch failed : %s", pa_strerror (vol->pa_error));
+    return vol->pa_error ? 0 : 1;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Auto-switching                                                             */
+/*----------------------------------------------------------------------------*/
+
+/*
+ * The setting AutoSwitch lists, separated by semicolons, the sinks (or sources,
+ * for the input plugin) which become the default as soon as they appear. Both a
+ * newly added card and a newly connected Bluetooth device end in a sink or source
+ * being created, so the decision is made from that notification, using the query
+ * which adds the device to the cached device set; no further queries are needed.
+ * The switch itself is made at the display refresh which follows.
+ */
+
+/* Read the auto-switch device list into a set of device names */
+
+static void pa_load_auto_switch (VolumePulsePlugin *vol)
+{
+    const char *list;
+    char **names, **name;
+
+    vol->pa_auto_switch = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    if (!config_setting_lookup_string (vol->settings, "AutoSwitch", &list)) return;
+
+    names = g_strsplit (list, ";", -1);
+    for (name = names; *name; name++)
+    {
+        g_strstrip (*name);
+        if (**name) g_hash_table_add (vol->pa_auto_switch, g_strdup (*name));
+    }
+    g_strfreev (names);
+    DEBUG ("Loaded %d auto-switch devices", g_hash_table_size (vol->pa_auto_switch));
+}
+
+/* Callback for new sink query */
+
+static void pa_cb_new_sink (pa_context *c, const pa_sink_info *i, int eol, void *userdata)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+
+    if (!eol) pa_new_device (vol, i->index, i->name);
+
+    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+}
+
+/* Callback for new source query - monitors are left out */
+
+static void pa_cb_new_source (pa_context *c, const pa_source_info *i, int eol, void *userdata)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+
+    if (!eol && i->monitor_of_sink == PA_INVALID_INDEX) pa_new_device (vol, i->index, i->name);
+
+    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+}
+
+/* Add a new device to the cached device set, and flag a switch to it if it is an auto-switch device - called from the controller thread */
+
+static void pa_new_device (VolumePulsePlugin *vol, uint32_t index, const char *name)
+{
+    if (vol->pa_device_names == NULL) return;
+
+    g_hash_table_insert (vol->pa_device_names, GUINT_TO_POINTER (index), g_strdup (name));
+    if (vol->pa_auto_switch && g_hash_table_contains (vol->pa_auto_switch, name))
+    {
+        DEBUG ("Auto-switch device %s added", name);
+        vol->pa_switch_target = g_intern_string (name);
+        vol->pa_switch_time = g_get_monotonic_time ();
+        g_source_set_ready_time (vol->pa_update_source, 0);
+    }
+}
+
+/* Make a newly added auto-switch device the default and move all streams to it */
+
+static void pa_check_auto_switch (VolumePulsePlugin *vol)
+{
+    const char *target;
+    gint64 start;
+
+    if (vol->pa_mainloop == NULL) return;
+
+    pa_threaded_mainloop_lock (vol->pa_mainloop);
+    target = vol->pa_switch_target;
+    start = vol->pa_switch_time;
+    vol->pa_switch_target = NULL;
+    pa_threaded_mainloop_unlock (vol->pa_mainloop);
+    if (!target) return;
+
+    if (target == (vol->input_control ? vol->pa_default_source : vol->pa_default_sink))
+    {
+        DEBUG ("Auto-switch device %s is already the default", target);
+        return;
+    }
+
+    if (vol->input_control) pulse_change_source (vol, target);
+    else pulse_change_sink (vol, target);
+    pa_move_streams_batch (vol, target, FALSE);
+    DEBUG ("Auto-switched to %s with %d streams in %d ms", target, vol->pa_indices->len,
+        (int) ((g_get_monotonic_time () - start) / 1000));
+}
+
+/*----------------------------------------------------------------------------*/
+/* Profiles                                                                   */
+/*----------------------------------------------------------------------------*/
+
+/* 
+ * Read the profile of the supplied card - this is polled to check if a Bluetooth device has
+ * successfully connected to PulseAudio, hence why the profile is NULLed before starting so
+ * that old profile data does not spuriously cause the poll to succeed prematurely.
+ */ 
+
+int pulse_get_profile (VolumePulsePlugin *vol, const char *card)
+{
+    vol->pa_profile = NULL;
+    vol->pa_headset_profile = NULL;
+
+    START_PA_OPERATION
+    op = pa_context_get_card_info_by_name (vol->pa_context, card, &pa_cb_get_profile, vol);
+    END_PA_OPERATION ("get_card_info_by_name")
+}
+
+/* Callback for profile query - also notes which headset profile a Bluetooth card offers, preferring HSP to HFP */
+
+static void pa_cb_get_profile (pa_context *c, const pa_card_info *i, int eol, void *userdata)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+    pa_card_profile_info2 **profile;
+
+    if (!eol)
+    {
+        DEBUG ("pa_cb_get_profile %s", i->active_profile2->name);
+        vol->pa_profile = g_intern_string (i->active_profile2->name);
+        pa_index_bt_device (vol, i->proplist);
+
+        for (profile = i->profiles2; profile && *profile; profile++)
+        {
+            if (!(*profile)->available) continue;
+            if (!g_strcmp0 ((*profile)->name, "headset_head_unit")
+                || (!g_strcmp0 ((*profile)->name, "handsfree_head_unit") && vol->pa_headset_profile == NULL))
+                vol->pa_headset_profile = g_intern_string ((*profile)->name);
+        }
+    }
+
+    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+}
+
+/* Call the PulseAudio set profile operation for the supplied card */
+
+int pulse_set_profile (VolumePulsePlugin *vol, const char *card, const char *profile)
+{
+    DEBUG ("pulse_set_profile %s %s", card, profile);
+    START_PA_OPERATION
+    op = pa_context_set_card_profile_by_name (vol->pa_context, card, profile, &pa_cb_generic_success, vol);
+    END_PA_OPERATION ("set_card_profile_by_name")
+}
+
+/*----------------------------------------------------------------------------*/
+/* Device menu                                                                */
+/*----------------------------------------------------------------------------*/
+
+/* 
+ * To populate the device select menu, the controller is initially queried for the
+ * list of audio cards, which are stored with their card names. After discovery is
+ * complete, the controller is queried for the list of sinks and sources, which is
+ * used to replace the card name with the relevant sink or source name, allowing
+ * cards which are have the wrong profile set to be shown greyed-out in the menu.
+ */
+ 
+/* Loop through all cards, adding each to relevant part of device menu */
+
+int pulse_add_devices_to_menu (VolumePulsePlugin *vol, gboolean internal)
+{
+    if (internal && vol->input_control) return 0;
+    vol->separator = FALSE;
+    DEBUG ("pulse_add_devices_to_menu %d %d", vol->input_control, internal);
+    START_PA_OPERATION
+    if (vol->input_control)
+        op = pa_context_get_card_info_list (vol->pa_context, &pa_cb_get_info_inputs, vol);
+    else if (internal)
+        op = pa_context_get_card_info_list (vol->pa_context, &pa_cb_get_info_internal, vol);
+    else
+        op = pa_context_get_card_info_list (vol->pa_context, &pa_cb_get_info_external, vol);
+    END_PA_OPERATION ("get_card_info_list")
+}
+
+/*
+ * Callbacks for card info query, each of which checks to see if the device should
+ * be in the menu in question and adding it if so
+ */
+
+static void pa_cb_get_info_inputs (pa_context *c, const pa_card_info *i, int eol, void *userdata)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+
+    if (!eol)
+    {
+        if (pa_card_has_port (i, PA_DIRECTION_INPUT))
+        {
+            const char *nam = pa_proplist_gets (i->proplist, "alsa.card_name");
+            if (nam)
+            {
+                DEBUG ("pa_cb_get_info_inputs %s", nam);
+                menu_add_item (vol, nam, nam);
+            }
+        }
+    }
+
+    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+}
+
+static void pa_cb_get_info_internal (pa_context *c, const pa_card_info *i, int eol, void *userdata)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+
+    if (!eol)
+    {
+        if (!g_strcmp0 (pa_proplist_gets (i->proplist, "device.description"), "Built-in Audio"))
+        {
+            if (pa_card_has_port (i, PA_DIRECTION_OUTPUT))
+            {
+                const char *nam = pa_proplist_gets (i->proplist, "alsa.card_name");
+                if (nam)
+                {
+                    if (!strcmp (nam, "bcm2835 Headphones") && vsystem ("raspi-config nonint has_analog")) return;
+                    DEBUG ("pa_cb_get_info_internal %s", nam);
+                    menu_add_item (vol, nam, nam);
+                }
+            }
+        }
+    }
+
+    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+}
+
+static void pa_cb_get_info_external (pa_context *c, const pa_card_info *i, int eol, void *userdata)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+
+    if (!eol)
+    {
+        if (g_strcmp0 (pa_proplist_gets (i->proplist, "device.description"), "Built-in Audio"))
+        {
+            if (pa_card_has_port (i, PA_DIRECTION_OUTPUT))
+            {
+                const char *nam = pa_proplist_gets (i->proplist, "alsa.card_name");
+                if (nam)
+                {
+                    DEBUG ("pa_cb_get_info_external %s", nam);
+                    menu_add_separator (vol, vol->menu_devices);
+                    menu_add_item (vol, nam, nam);
+                }
+            }
+        }
+    }
+
+    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+}
+
+/* Function to determine whether or not a card has either input or output ports */
+
+static gboolean pa_card_has_port (const pa_card_info *i, pa_direction_t dir)
+{
+    pa_card_port_info **port = i->ports;
+    while (*port)
+    {
+        if ((*port)->direction == dir) return TRUE;
+        port++;
+    }
+    return FALSE;
+}
+
+/* Loop through all sinks and sources, updating device menu as appropriate */
+
+void pulse_update_devices_in_menu (VolumePulsePlugin *vol)
+{
+    if (vol->input_control) pa_replace_cards_with_sources (vol);
+    else pa_replace_cards_with_sinks (vol);
+}
+
+/* Query controller for list of sinks */
+
+static int pa_replace_cards_with_sinks (VolumePulsePlugin *vol)
+{
+    DEBUG ("pa_replace_cards_with_sinks");
+    START_PA_OPERATION
+    op = pa_context_get_sink_info_list (vol->pa_context, &pa_cb_replace_cards_with_sinks, vol);
+    END_PA_OPERATION ("get_sink_info_list")
+}
+
+/* Callback for sink list query, which updates ALSA devices in menu as appropriate */
+
+static void pa_cb_replace_cards_with_sinks (pa_context *context, const pa_sink_info *i, int eol, void *userdata)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+
+    if (!eol && vol->menu_devices)
+    {
+        const char *api = pa_proplist_gets (i->proplist, "device.api");
+        if (!g_strcmp0 (api, "alsa"))
+            gtk_container_foreach (GTK_CONTAINER (vol->menu_devices), pa_replace_card_with_sink_on_match, (void *) i);
+        else
+        {
+            pa_index_bt_device (vol, i->proplist);
+            gtk_container_foreach (GTK_CONTAINER (vol->menu_devices), pa_card_check_bt_output_profile, (void *) i);
+        }
+    }
+
+    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+}
+
+/* Callback for per-menu-item operation which checks to see if each matches the card name and updates with sink data if so */
+
+static void pa_replace_card_with_sink_on_match (GtkWidget *widget, gpointer data)
+{
+    pa_sink_info *i = (pa_sink_info *) data;
+    const char *alsaname = pa_proplist_gets (i->proplist, "alsa.card_name");
+
+    if (!strcmp (alsaname, gtk_widget_get_name (widget)))
+    {
+        gtk_widget_set_name (widget, i->name);
+        gtk_widget_set_sensitive (widget, TRUE);
+        pa_show_sink_state (widget, i);
+    }
+}
+
+/* Callback for per-menu-item operation which checks to see if a Bluetooth device is in a profile with an output */
+
+static void pa_card_check_bt_output_profile (GtkWidget *widget, gpointer data)
+{
+    pa_sink_info *i = (pa_sink_info *) data;
+    const char *btpath = pa_proplist_gets (i->proplist, "bluez.path");
+
+    if (!g_strcmp0 (btpath, gtk_widget_get_name (widget)))
+    {
+        const char *profile = pa_proplist_gets (i->proplist, "bluetooth.protocol");
+        if (!g_strcmp0 (profile, "a2dp_sink") || !g_strcmp0 (profile, "headset_head_unit") || !g_strcmp0 (profile, "handsfree_head_unit"))
+        {
+            gtk_widget_set_sensitive (widget, TRUE);
+            pa_show_sink_state (widget, i);
+        }
+    }
+}
+
+/* Query controller for list of sources */
+
+static int pa_replace_cards_with_sources (VolumePulsePlugin *vol)
+{
+    DEBUG ("pa_replace_cards_with_sources");
+    START_PA_OPERATION
+    op = pa_context_get_source_info_list (vol->pa_context, &pa_cb_replace_cards_with_sources, vol);
+    END_PA_OPERATION ("get_source_info_list")
+}
+
+/* Callback for source list query, which updates ALSA devices in menu as appropriate */
+
+static void pa_cb_replace_cards_with_sources (pa_context *context, const pa_source_info *i, int eol, void *userdata)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+
+    if (!eol && vol->menu_devices)
     {
-        if (g_strcmp0 (pa_proplist_gets (i->proplist, "device.description"), "Built-in Audio"))
+        const char *api = pa_proplist_gets (i->proplist, "device.api");
+        if (!g_strcmp0 (api, "alsa"))
+            gtk_container_foreach (GTK_CONTAINER (vol->menu_devices), pa_replace_card_with_source_on_match, (void *) i);
+        else
         {
-            if (pa_card_has_port (i, PA_DIRECTION_OUTPUT))
+            pa_index_bt_device (vol, i->proplist);
+            gtk_container_foreach (GTK_CONTAINER (vol->menu_devices), pa_card_check_bt_input_profile, (void *) i);
+        }
+    }
+
+    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+}
+
+/* Callback for per-menu-item operation which checks to see if each matches the card name and updates with source data if so */
+
+static void pa_replace_card_with_source_on_match (GtkWidget *widget, gpointer data)
+{
+    pa_source_info *i = (pa_source_info *) data;
+    const char *alsaname = pa_proplist_gets (i->proplist, "alsa.card_name");
+
+    if (!strcmp (alsaname, gtk_widget_get_name (widget)))
+    {
+        gtk_widget_set_name (widget, i->name);
+        gtk_widget_set_sensitive (widget, TRUE);
+        gtk_widget_set_tooltip_text (widget, NULL);
+    }
+}
+
+/* Callback for per-menu-item operation which checks to see if a Bluetooth device is in a profile with an input */
+
+static void pa_card_check_bt_input_profile (GtkWidget *widget, gpointer data)
+{
+    pa_source_info *i = (pa_source_info *) data;
+    const char *btpath = pa_proplist_gets (i->proplist, "bluez.path");
+
+    if (!g_strcmp0 (btpath, gtk_widget_get_name (widget)))
+    {
+        const char *profile = pa_proplist_gets (i->proplist, "bluetooth.protocol");
+        if (!g_strcmp0 (profile, "headset_head_unit") || !g_strcmp0 (profile, "handsfree_head_unit"))
+        {
+            gtk_widget_set_sensitive (widget, TRUE);
+            gtk_widget_set_tooltip_text (widget, NULL);
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/* Profiles dialog                                                            */
+/*----------------------------------------------------------------------------*/
+
+/* Query controller for list of cards */
+
+int pulse_add_devices_to_profile_dialog (VolumePulsePlugin *vol)
+{
+    DEBUG ("pulse_add_devices_to_profile_dialog");
+    START_PA_OPERATION
+    op = pa_context_get_card_info_list (vol->pa_context, &pa_cb_add_devices_to_profile_dialog, vol);
+    END_PA_OPERATION ("get_card_info_list")
+}
+
+/* Callback for card list query - reads profiles for card and adds as a combo box to profiles dialog */
+
+static void pa_cb_add_devices_to_profile_dialog (pa_context *c, const pa_card_info *i, int eol, void *userdata)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+
+    GtkListStore *ls;
+    int index = 0, sel = -1;
+    gboolean bt;
+    const char *info;
+    char *desc;
+
+    if (!eol)
+    {
+        // loop through profiles, adding each to list store - Bluetooth profiles also show what each codec offers
+        bt = !g_strcmp0 (pa_proplist_gets (i->proplist, "device.api"), "bluez");
+        ls = gtk_list_store_new (2, G_TYPE_STRING, G_TYPE_STRING);
+        pa_card_profile_info2 **profile = i->profiles2;
+        while (*profile)
+        {
+            if (*profile == i->active_profile2) sel = index;
+            info = bt ? pa_bt_profile_info ((*profile)->name) : NULL;
+            if (info) desc = g_strdup_printf ("%s - %s", (*profile)->description, info);
+            else desc = g_strdup ((*profile)->description);
+            gtk_list_store_insert_with_values (ls, NULL, index++, 0, (*profile)->name, 1, desc, -1);
+            g_free (desc);
+            profile++;
+        }
+
+        if (bt)
+        {
+            pa_index_bt_device (vol, i->proplist);
+            profiles_dialog_add_combo (vol, ls, vol->profiles_bt_box, sel, pa_proplist_gets (i->proplist, "device.description"), i->name);
+        }
+        else
+        {
+            if (g_strcmp0 (pa_proplist_gets (i->proplist, "device.description"), "Built-in Audio"))
+                profiles_dialog_add_combo (vol, ls, vol->profiles_ext_box, sel, pa_proplist_gets (i->proplist, "alsa.card_name"), i->name);
+            else
+                profiles_dialog_add_combo (vol, ls, vol->profiles_int_box, sel, pa_proplist_gets (i->proplist, "alsa.card_name"), i->name);
+        }
+
+        // add a latency offset control, with the offsets of all output ports - the port in use is given by the sink query
+        GHashTable *offsets = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        pa_card_port_info **port;
+        for (port = i->ports; port && *port; port++)
+            if ((*port)->direction == PA_DIRECTION_OUTPUT)
+                g_hash_table_insert (offsets, g_strdup ((*port)->name), GINT_TO_POINTER ((int) ((*port)->latency_offset / 1000)));
+        if (g_hash_table_size (offsets)) profiles_dialog_add_latency (vol, i->name, i->index, offsets);
+        else g_hash_table_destroy (offsets);
+    }
+
+    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+}
+
+/*
+ * PulseAudio does not report the bitrate or latency of Bluetooth profiles, so these are
+ * shown from the typical figures for each codec. Entries are matched in order against
+ * the profile name, so more specific names come before those they contain.
+ */
+
+static const char *pa_bt_profile_info (const char *profile)
+{
+    static const char *codecs[][2] =
+    {
+        { "msbc",       N_("wideband voice quality, lowest latency") },
+        { "sbc_xq",     N_("up to 552 kbps, standard latency") },
+        { "sbc",        N_("up to 328 kbps, standard latency") },
+        { "aac",        N_("up to 320 kbps, high latency") },
+        { "aptx_ll",    N_("352 kbps, low latency") },
+        { "aptx_hd",    N_("576 kbps, standard latency") },
+        { "aptx",       N_("352 kbps, standard latency") },
+        { "ldac",       N_("up to 990 kbps, high latency") },
+        { "faststream", N_("up to 212 kbps, low latency") },
+        { "a2dp_sink",  N_("up to 328 kbps, standard latency") },
+        { "head_unit",  N_("voice quality, lowest latency") },
+        { "head-unit",  N_("voice quality, lowest latency") },
+        { NULL, NULL }
+    };
+    int codec;
+
+    for (codec = 0; codecs[codec][0]; codec++)
+        if (strstr (profile, codecs[codec][0])) return _(codecs[codec][1]);
+    return NULL;
+}
+
+/* Query controller for list of sinks to show their latencies in the profiles dialog */
+
+int pulse_add_latencies_to_profile_dialog (VolumePulsePlugin *vol)
+{
+    DEBUG ("pulse_add_latencies_to_profile_dialog");
+    START_PA_OPERATION
+    op = pa_context_get_sink_info_list (vol->pa_context, &pa_cb_add_latencies_to_profile_dialog, vol);
+    END_PA_OPERATION ("get_sink_info_list")
+}
+
+/* Callback for sink list query - shows the current and configured latency, the latency offset of the active port, and the idle suspension setting, against the card for each sink */
+
+static void pa_cb_add_latencies_to_profile_dialog (pa_context *c, const pa_sink_info *i, int eol, void *userdata)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+    gboolean enable;
+    int timeout;
+
+    if (!eol && i->card != PA_INVALID_INDEX && !strstr (i->name, "monitor"))
+    {
+        profiles_dialog_set_latency (vol, i->card, i->active_port ? i->active_port->name : NULL, i->latency / 1000, i->configured_latency / 1000);
+        enable = pa_suspend_idle_setting (vol, i->name, &timeout);
+        profiles_dialog_add_suspend (vol, i->card, i->name, enable, timeout);
+    }
+
+    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+}
+
+/*
+ * Latency offsets set in the profiles dialog are saved per card and port, and
+ * restored when the plugin starts and whenever a Bluetooth device connects, as
+ * a Bluetooth card and its ports are created afresh on each connection.
+ */
+
+static char *pa_latency_setting (const char *card, const char *port)
+{
+    return g_strdup_printf ("%s_%s", card, port);
+}
+
+/* Set the latency offset in ms for a port on a card - the caller saves the config */
+
+int pulse_set_latency_offset (VolumePulsePlugin *vol, const char *card, const char *port, int offset)
+{
+    char *device = pa_latency_setting (card, port);
+
+    DEBUG ("pulse_set_latency_offset %s %s %d", card, port, offset);
+    device_setting_store_int (vol, "LatencyOffset", device, offset);
+    g_free (device);
+
+    START_PA_OPERATION
+    op = pa_context_set_port_latency_offset (vol->pa_context, card, port, (int64_t) offset * 1000, &pa_cb_generic_success, vol);
+    END_PA_OPERATION ("set_port_latency_offset")
+}
+
+/* Query controller for one card, or all cards if card is NULL, to restore saved latency offsets */
+
+int pulse_restore_latency_offsets (VolumePulsePlugin *vol, const char *card)
+{
+    DEBUG ("pulse_restore_latency_offsets %s", card ? card : "all");
+    START_PA_OPERATION
+    if (card) op = pa_context_get_card_info_by_name (vol->pa_context, card, &pa_cb_restore_latency_offsets, vol);
+    else op = pa_context_get_card_info_list (vol->pa_context, &pa_cb_restore_latency_offsets, vol);
+    END_PA_OPERATION ("get_card_info")
+}
+
+/* Callback for card query - sets the latency offset of any port which has one saved and differs from it */
+
+static void pa_cb_restore_latency_offsets (pa_context *c, const pa_card_info *i, int eol, void *userdata)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+    pa_card_port_info **port;
+    char *device;
+    int offset;
+
+    if (!eol)
+    {
+        for (port = i->ports; port && *port; port++)
+        {
+            device = pa_latency_setting (i->name, (*port)->name);
+            if (device_setting_get_int (vol, "LatencyOffset", device, &offset) && (int64_t) offset * 1000 != (*port)->latency_offset)
             {
-                const char *nam = pa_proplist_gets (i->proplist, "alsa.card_name");
-                if (nam)
-                {
-                    DEBUG ("pa_cb_get_info_external %s", nam);
-                    menu_add_separator (vol, vol->menu_devices);
-                    menu_add_item (vol, nam, nam);
-                }
+                DEBUG ("Restoring latency offset %d ms on %s", offset, device);
+                pa_operation *op = pa_context_set_port_latency_offset (c, i->name, (*port)->name, (int64_t) offset * 1000, NULL, NULL);
+                if (op) pa_operation_unref (op);
+            }
+            g_free (device);
+        }
+    }
+
+    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Low latency mode                                                           */
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Low latency mode reduces the buffering of the default sink, for uses such as
+ * monitoring an instrument. A card which offers a low latency profile, such as a
+ * Bluetooth device with aptX Low Latency, is switched to that profile. Otherwise,
+ * an ALSA sink is reloaded with timer-based scheduling off and a small fixed
+ * number of fragments, which PulseAudio cannot change on a running sink. The
+ * previous profile, or module arguments, are kept so the change can be undone.
+ * Reloading the module removes the card and sink of the default output, but as
+ * the plugin puts them back itself, that removal must not set off the unplug
+ * policy or the fall back to the device priority list.
+ */
+
+void pulse_set_low_latency (VolumePulsePlugin *vol, gboolean enable)
+{
+    const char *keys[] = { "tsched", "fragments", "fragment_size", NULL };
+    const char *sink;
+    char *stripped, *args;
+
+    if (enable == vol->pa_low_latency) return;
+
+    pulse_get_default_sink_source (vol);
+    sink = vol->pa_default_sink;
+
+    if (!enable)
+    {
+        DEBUG ("Low latency mode off");
+        if (vol->pa_ll_card) pulse_set_profile (vol, vol->pa_ll_card, vol->pa_ll_profile);
+        if (vol->pa_ll_index != PA_INVALID_INDEX)
+        {
+            pa_unload_module (vol, vol->pa_ll_index);
+            pa_load_module (vol, vol->pa_ll_module, vol->pa_ll_args);
+            pulse_change_sink (vol, sink);
+            pulse_move_output_streams (vol);
+            pa_ignore_reload_removal (vol);
+        }
+        pa_reset_low_latency (vol);
+        return;
+    }
+
+    if (!pa_get_sink_info (vol, sink)) return;
+    vol->pa_ll_before = vol->pa_sink_latency;
+    vol->pa_ll_index = PA_INVALID_INDEX;
+
+    // use a low latency profile if the card has one...
+    if (vol->pa_sink_card != PA_INVALID_INDEX && pa_find_low_latency_profile (vol, vol->pa_sink_card) && vol->pa_ll_target)
+    {
+        DEBUG ("Low latency mode on - profile %s on %s", vol->pa_ll_target, vol->pa_ll_card);
+        if (!pulse_set_profile (vol, vol->pa_ll_card, vol->pa_ll_target))
+        {
+            pa_reset_low_latency (vol);
+            return;
+        }
+    }
+    else
+    {
+        // ...otherwise reduce the buffering of an ALSA card
+        g_free (vol->pa_ll_card);
+        vol->pa_ll_card = NULL;
+        if (!pa_get_module_info (vol, vol->pa_sink_module) || g_strcmp0 (vol->pa_ll_module, "module-alsa-card"))
+        {
+            DEBUG ("Low latency mode not available for %s", sink);
+            pa_reset_low_latency (vol);
+            return;
+        }
+
+        stripped = pa_strip_module_args (vol->pa_ll_args, keys);
+        args = g_strdup_printf ("%s tsched=0 fragments=%d fragment_size=%d", stripped, PA_LL_FRAGMENTS, PA_LL_FRAGMENT_SIZE);
+        g_free (stripped);
+        DEBUG ("Low latency mode on - reloading %s %s", vol->pa_ll_module, args);
+        pa_unload_module (vol, vol->pa_sink_module);
+        if (!pa_load_module (vol, vol->pa_ll_module, args))
+        {
+            DEBUG ("Failed to reload module - restoring original");
+            pa_load_module (vol, vol->pa_ll_module, vol->pa_ll_args);
+            vol->pa_ll_index = PA_INVALID_INDEX;
+            pulse_change_sink (vol, sink);
+            pulse_move_output_streams (vol);
+            pa_ignore_reload_removal (vol);
+            pa_reset_low_latency (vol);
+            g_free (args);
+            return;
+        }
+        g_free (args);
+        pulse_change_sink (vol, sink);
+        pulse_move_output_streams (vol);
+        pa_ignore_reload_removal (vol);
+    }
+
+    vol->pa_low_latency = TRUE;
+    DEBUG ("Sink latency was %d ms, now %d ms", vol->pa_ll_before, pulse_get_sink_latency (vol));
+}
+
+/* Discard the removal of the default card and sink caused by reloading its module - the notifications have all arrived by now, as the reload and sink change have been waited for since */
+
+static void pa_ignore_reload_removal (VolumePulsePlugin *vol)
+{
+    if (vol->pa_mainloop == NULL) return;
+
+    pa_threaded_mainloop_lock (vol->pa_mainloop);
+    vol->pa_card_removed = FALSE;
+    vol->pa_card_changed = FALSE;
+    vol->pa_default_removed = FALSE;
+    pa_threaded_mainloop_unlock (vol->pa_mainloop);
+    vol->pa_ports_stale = TRUE;
+}
+
+/* Clear the record of changes made for low latency mode */
+
+static void pa_reset_low_latency (VolumePulsePlugin *vol)
+{
+    g_free (vol->pa_ll_card);
+    g_free (vol->pa_ll_module);
+    g_free (vol->pa_ll_args);
+    vol->pa_ll_card = NULL;
+    vol->pa_ll_module = NULL;
+    vol->pa_ll_args = NULL;
+    vol->pa_ll_profile = NULL;
+    vol->pa_ll_target = NULL;
+    vol->pa_ll_index = PA_INVALID_INDEX;
+    vol->pa_low_latency = FALSE;
+}
+
+/* Get the current latency of the default sink in ms, or -1 if it cannot be read */
+
+int pulse_get_sink_latency (VolumePulsePlugin *vol)
+{
+    if (!pa_get_sink_info (vol, vol->pa_default_sink)) return -1;
+    return vol->pa_sink_latency;
+}
+
+/* Query controller for the card, owner module and latency of a sink */
+
+static int pa_get_sink_info (VolumePulsePlugin *vol, const char *sinkname)
+{
+    vol->pa_sink_card = PA_INVALID_INDEX;
+    vol->pa_sink_module = PA_INVALID_INDEX;
+    vol->pa_sink_latency = -1;
+
+    START_PA_OPERATION
+    op = pa_context_get_sink_info_by_name (vol->pa_context, sinkname, &pa_cb_get_sink_info, vol);
+    END_PA_OPERATION ("get_sink_info_by_name")
+}
+
+/* Callback for sink info query */
+
+static void pa_cb_get_sink_info (pa_context *c, const pa_sink_info *i, int eol, void *userdata)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+
+    if (!eol)
+    {
+        vol->pa_sink_card = i->card;
+        vol->pa_sink_module = i->owner_module;
+        vol->pa_sink_latency = i->latency / 1000;
+        if (i->active_port) vol->pa_sink_port = g_intern_string (i->active_port->name);
+        else vol->pa_sink_port = NULL;
+    }
+
+    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+}
+
+/* Query controller for a low latency profile on a card */
+
+static int pa_find_low_latency_profile (VolumePulsePlugin *vol, uint32_t card)
+{
+    vol->pa_ll_target = NULL;
+
+    START_PA_OPERATION
+    op = pa_context_get_card_info_by_index (vol->pa_context, card, &pa_cb_find_low_latency_profile, vol);
+    END_PA_OPERATION ("get_card_info_by_index")
+}
+
+/* Callback for card query - records the card name, its current profile, and any available low latency output profile */
+
+static void pa_cb_find_low_latency_profile (pa_context *c, const pa_card_info *i, int eol, void *userdata)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+    pa_card_profile_info2 **profile;
+
+    if (!eol)
+    {
+        g_free (vol->pa_ll_card);
+        vol->pa_ll_card = g_strdup (i->name);
+        vol->pa_ll_profile = NULL;
+        if (i->active_profile2) vol->pa_ll_profile = g_intern_string (i->active_profile2->name);
+        for (profile = i->profiles2; profile && *profile; profile++)
+        {
+            if (!(*profile)->available || (*profile)->n_sinks == 0) continue;
+            if (strstr ((*profile)->name, "aptx_ll") || strstr ((*profile)->name, "faststream"))
+            {
+                vol->pa_ll_target = g_intern_string ((*profile)->name);
+                break;
             }
         }
+        if (vol->pa_ll_target && !g_strcmp0 (vol->pa_ll_target, vol->pa_ll_profile)) vol->pa_ll_target = NULL;
     }
 
     pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
 }
 
-/* Function to determine whether or not a card has either input or output ports */
+/* Query controller for the name and arguments of a module */
+
+static int pa_get_module_info (VolumePulsePlugin *vol, uint32_t index)
+{
+    g_free (vol->pa_ll_module);
+    g_free (vol->pa_ll_args);
+    vol->pa_ll_module = NULL;
+    vol->pa_ll_args = NULL;
+    if (index == PA_INVALID_INDEX) return 0;
+
+    START_PA_OPERATION
+    op = pa_context_get_module_info (vol->pa_context, index, &pa_cb_get_module_info, vol);
+    END_PA_OPERATION ("get_module_info")
+}
+
+/* Callback for module info query */
 
-static gboolean pa_card_has_port (const pa_card_info *i, pa_direction_t dir)
+static void pa_cb_get_module_info (pa_context *c, const pa_module_info *i, int eol, void *userdata)
 {
-    pa_card_port_info **port = i->ports;
-    while (*port)
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+
+    if (!eol)
     {
-        if ((*port)->direction == dir) return TRUE;
-        port++;
+        vol->pa_ll_module = g_strdup (i->name);
+        vol->pa_ll_args = g_strdup (i->argument ? i->argument : "");
     }
-    return FALSE;
-}
-
-/* Loop through all sinks and sources, updating device menu as appropriate */
 
-void pulse_update_devices_in_menu (VolumePulsePlugin *vol)
-{
-    if (vol->input_control) pa_replace_cards_with_sources (vol);
-    else pa_replace_cards_with_sinks (vol);
+    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
 }
 
-/* Query controller for list of sinks */
+/* Load a module */
 
-static int pa_replace_cards_with_sinks (VolumePulsePlugin *vol)
+static int pa_load_module (VolumePulsePlugin *vol, const char *name, const char *args)
 {
-    DEBUG ("pa_replace_cards_with_sinks");
+    vol->pa_ll_index = PA_INVALID_INDEX;
+
     START_PA_OPERATION
-    op = pa_context_get_sink_info_list (vol->pa_context, &pa_cb_replace_cards_with_sinks, vol);
-    END_PA_OPERATION ("get_sink_info_list")
+    op = pa_context_load_module (vol->pa_context, name, args, &pa_cb_load_module, vol);
+    END_PA_OPERATION ("load_module")
 }
 
-/* Callback for sink list query, which updates ALSA devices in menu as appropriate */
+/* Callback for module load - records the index of the new module */
 
-static void pa_cb_replace_cards_with_sinks (pa_context *context, const pa_sink_info *i, int eol, void *userdata)
+static void pa_cb_load_module (pa_context *c, uint32_t idx, void *userdata)
 {
     VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
 
-    if (!eol && vol->menu_devices)
-    {
-        const char *api = pa_proplist_gets (i->proplist, "device.api");
-        if (!g_strcmp0 (api, "alsa"))
-            gtk_container_foreach (GTK_CONTAINER (vol->menu_devices), pa_replace_card_with_sink_on_match, (void *) i);
-        else
-            gtk_container_foreach (GTK_CONTAINER (vol->menu_devices), pa_card_check_bt_output_profile, (void *) i);
-    }
+    vol->pa_ll_index = idx;
+    if (idx == PA_INVALID_INDEX) vol->pa_error = pa_context_errno (c);
 
     pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
 }
 
-/* Callback for per-menu-item operation which checks to see if each matches the card name and updates with sink data if so */
+/* Unload a module */
 
-static void pa_replace_card_with_sink_on_match (GtkWidget *widget, gpointer data)
+static int pa_unload_module (VolumePulsePlugin *vol, uint32_t index)
 {
-    pa_sink_info *i = (pa_sink_info *) data;
-    const char *alsaname = pa_proplist_gets (i->proplist, "alsa.card_name");
-
-    if (!strcmp (alsaname, gtk_widget_get_name (widget)))
-    {
-        gtk_widget_set_name (widget, i->name);
-        gtk_widget_set_sensitive (widget, TRUE);
-        gtk_widget_set_tooltip_text (widget, NULL);
-    }
+    START_PA_OPERATION
+    op = pa_context_unload_module (vol->pa_context, index, &pa_cb_generic_success, vol);
+    END_PA_OPERATION ("unload_module")
 }
 
-/* Callback for per-menu-item operation which checks to see if a Bluetooth device is in a profile with an output */
+/* Remove the named keys from a module argument string - returns a new string */
 
-static void pa_card_check_bt_output_profile (GtkWidget *widget, gpointer data)
+static char *pa_strip_module_args (const char *args, const char **keys)
 {
-    pa_sink_info *i = (pa_sink_info *) data;
-    const char *btpath = pa_proplist_gets (i->proplist, "bluez.path");
+    GString *res = g_string_new (NULL);
+    const char *start, *end, **key;
+    char quote;
 
-    if (!g_strcmp0 (btpath, gtk_widget_get_name (widget)))
+    start = args;
+    while (*start)
     {
-        const char *profile = pa_proplist_gets (i->proplist, "bluetooth.protocol");
-        if (!g_strcmp0 (profile, "a2dp_sink") || !g_strcmp0 (profile, "headset_head_unit"))
+        // find the end of this argument, allowing for quoted values containing spaces
+        while (*start == ' ') start++;
+        if (*start == 0) break;
+        quote = 0;
+        for (end = start; *end && (quote || *end != ' '); end++)
         {
-            gtk_widget_set_sensitive (widget, TRUE);
-            gtk_widget_set_tooltip_text (widget, NULL);
+            if (quote && *end == quote) quote = 0;
+            else if (!quote && (*end == '"' || *end == '\'')) quote = *end;
+        }
+
+        for (key = keys; *key; key++)
+            if (!strncmp (start, *key, strlen (*key)) && start[strlen (*key)] == '=') break;
+        if (*key == NULL)
+        {
+            if (res->len) g_string_append_c (res, ' ');
+            g_string_append_len (res, start, end - start);
         }
+        start = end;
     }
+    return g_string_free (res, FALSE);
 }
 
-/* Query controller for list of sources */
+/*----------------------------------------------------------------------------*/
+/* Suspension when idle                                                       */
+/*----------------------------------------------------------------------------*/
 
-static int pa_replace_cards_with_sources (VolumePulsePlugin *vol)
+/*
+ * A sink which is set to suspend when idle is suspended by the plugin once it has
+ * been idle for its timeout, as module-suspend-on-idle may not be loaded, and its
+ * timeout cannot be changed per sink once the sink exists. A sink suspended by a
+ * client is not resumed by PulseAudio when a stream starts, so the plugin resumes
+ * sinks it has suspended as soon as an uncorked stream is connected to them. Sink
+ * states are checked on the main thread, at the display refresh following a sink
+ * state change or a new or removed stream. Nothing is checked unless a sink is set
+ * to suspend or has been suspended by the plugin. The set of suspended sinks is
+ * only kept in memory, so when the plugin starts, any sink which is set to suspend
+ * and is found suspended is added to it, in case an earlier run of the plugin left
+ * it suspended when lxpanel was restarted or crashed. The set of suspended sinks is
+ * read in notifications on the controller thread, so the main thread only changes
+ * it with the mainloop lock held.
+ */
+
+typedef struct {
+    VolumePulsePlugin *vol;             /* Plugin for which timer is running */
+    char *sink;                         /* Name of sink to suspend */
+} idle_timer_t;
+
+/* Show the state of a sink in the tooltip of its menu item */
+
+static void pa_show_sink_state (GtkWidget *widget, const pa_sink_info *i)
 {
-    DEBUG ("pa_replace_cards_with_sources");
-    START_PA_OPERATION
-    op = pa_context_get_source_info_list (vol->pa_context, &pa_cb_replace_cards_with_sources, vol);
-    END_PA_OPERATION ("get_source_info_list")
+    switch (i->state)
+    {
+        case PA_SINK_RUNNING :      gtk_widget_set_tooltip_text (widget, _("Playing"));
+                                    break;
+        case PA_SINK_IDLE :         gtk_widget_set_tooltip_text (widget, _("Idle"));
+                                    break;
+        case PA_SINK_SUSPENDED :    gtk_widget_set_tooltip_text (widget, _("Suspended"));
+                                    break;
+        default :                   gtk_widget_set_tooltip_text (widget, NULL);
+                                    break;
+    }
 }
 
-/* Callback for source list query, which updates ALSA devices in menu as appropriate */
+/* Read whether a sink is set to suspend when idle - the timeout in seconds is returned even if not */
 
-static void pa_cb_replace_cards_with_sources (pa_context *context, const pa_source_info *i, int eol, void *userdata)
+static gboolean pa_suspend_idle_setting (VolumePulsePlugin *vol, const char *sink, int *timeout)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+    int enable;
 
-    if (!eol && vol->menu_devices)
+    if (!device_setting_get_int (vol, "SuspendTimeout", sink, timeout) || *timeout < 1) *timeout = PA_SUSPEND_TIMEOUT;
+    if (!device_setting_get_int (vol, "SuspendIdle", sink, &enable)) return FALSE;
+    return enable ? TRUE : FALSE;
+}
+
+/* Set whether a sink suspends when idle and after what timeout and apply it - the caller saves the config */
+
+void pulse_set_suspend_idle (VolumePulsePlugin *vol, const char *sink, gboolean enable, int timeout)
+{
+    DEBUG ("pulse_set_suspend_idle %s %d %d", sink, enable, timeout);
+    device_setting_store_int (vol, "SuspendIdle", sink, enable);
+    device_setting_store_int (vol, "SuspendTimeout", sink, timeout);
+
+    // drop any running timer so the new timeout is used, and put back the sink if it no longer suspends
+    pa_cancel_idle_timer (vol, sink);
+    if (!enable && g_hash_table_contains (vol->pa_suspended, sink))
     {
-        const char *api = pa_proplist_gets (i->proplist, "device.api");
-        if (!g_strcmp0 (api, "alsa"))
-            gtk_container_foreach (GTK_CONTAINER (vol->menu_devices), pa_replace_card_with_source_on_match, (void *) i);
-        else
-            gtk_container_foreach (GTK_CONTAINER (vol->menu_devices), pa_card_check_bt_input_profile, (void *) i);
+        pa_suspend_sink (vol, sink, FALSE);
+        pa_threaded_mainloop_lock (vol->pa_mainloop);
+        g_hash_table_remove (vol->pa_suspended, sink);
+        pa_threaded_mainloop_unlock (vol->pa_mainloop);
     }
 
-    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+    vol->pa_idle_enabled = pa_any_suspend_idle (vol);
+    vol->pa_sinks_changed = TRUE;
+    pa_update_idle_sinks (vol);
 }
 
-/* Callback for per-menu-item operation which checks to see if each matches the card name and updates with source data if so */
+/* Check whether any device is set to suspend when idle, so that sink events can be ignored if none is */
 
-static void pa_replace_card_with_source_on_match (GtkWidget *widget, gpointer data)
+static gboolean pa_any_suspend_idle (VolumePulsePlugin *vol)
 {
-    pa_source_info *i = (pa_source_info *) data;
-    const char *alsaname = pa_proplist_gets (i->proplist, "alsa.card_name");
+    config_setting_t *setting;
+    unsigned int index;
 
-    if (!strcmp (alsaname, gtk_widget_get_name (widget)))
+    for (index = 0; (setting = config_setting_get_elem (vol->settings, index)) != NULL; index++)
     {
-        gtk_widget_set_name (widget, i->name);
-        gtk_widget_set_sensitive (widget, TRUE);
-        gtk_widget_set_tooltip_text (widget, NULL);
+        if (g_str_has_prefix (config_setting_get_name (setting), "SuspendIdle_") && config_setting_get_int (setting))
+            return TRUE;
     }
+    return FALSE;
 }
 
-/* Callback for per-menu-item operation which checks to see if a Bluetooth device is in a profile with an input */
+/* Handle a sink event for idle suspension - called from the controller thread, so the mainloop lock is already held */
 
-static void pa_card_check_bt_input_profile (GtkWidget *widget, gpointer data)
+static void pa_sink_state_event (VolumePulsePlugin *vol, pa_subscription_event_type_t event, uint32_t idx)
 {
-    pa_source_info *i = (pa_source_info *) data;
-    const char *btpath = pa_proplist_gets (i->proplist, "bluez.path");
+    pa_operation *op;
 
-    if (!g_strcmp0 (btpath, gtk_widget_get_name (widget)))
+    // changes are mostly to volume, so query the sink and only flag a check if its state has changed
+    if (event == PA_SUBSCRIPTION_EVENT_CHANGE)
     {
-        const char *profile = pa_proplist_gets (i->proplist, "bluetooth.protocol");
-        if (!g_strcmp0 (profile, "headset_head_unit"))
+        op = pa_context_get_sink_info_by_index (vol->pa_context, idx, &pa_cb_sink_state, vol);
+        if (op) pa_operation_unref (op);
+        return;
+    }
+
+    if (event == PA_SUBSCRIPTION_EVENT_REMOVE) g_hash_table_remove (vol->pa_sink_states, GUINT_TO_POINTER (idx));
+    vol->pa_sinks_changed = TRUE;
+}
+
+/* Callback for sink query after a change - flags a check of sink states if the state differs from the last check */
+
+static void pa_cb_sink_state (pa_context *c, const pa_sink_info *i, int eol, void *userdata)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+    gpointer state;
+
+    if (!eol && vol->pa_sink_states)
+    {
+        if (!g_hash_table_lookup_extended (vol->pa_sink_states, GUINT_TO_POINTER (i->index), NULL, &state)
+            || GPOINTER_TO_INT (state) != i->state)
         {
-            gtk_widget_set_sensitive (widget, TRUE);
-            gtk_widget_set_tooltip_text (widget, NULL);
+            vol->pa_sinks_changed = TRUE;
+            g_source_set_ready_time (vol->pa_update_source, 0);
         }
     }
+
+    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
 }
 
-/*----------------------------------------------------------------------------*/
-/* Profiles dialog                                                            */
-/*----------------------------------------------------------------------------*/
+/* Check sink states, if any have changed, to start and stop idle timers and to resume sinks which are in use */
 
-/* Query controller for list of cards */
+static void pa_update_idle_sinks (VolumePulsePlugin *vol)
+{
+    gboolean changed;
 
-int pulse_add_devices_to_profile_dialog (VolumePulsePlugin *vol)
+    if (vol->input_control || vol->pa_idle_timers == NULL || vol->pa_mainloop == NULL) return;
+
+    pa_threaded_mainloop_lock (vol->pa_mainloop);
+    changed = vol->pa_sinks_changed;
+    vol->pa_sinks_changed = FALSE;
+    pa_threaded_mainloop_unlock (vol->pa_mainloop);
+    if (!changed || (!vol->pa_idle_enabled && !g_hash_table_size (vol->pa_suspended))) return;
+
+    // streams only need to be listed if there is a sink which might need to be resumed
+    g_hash_table_remove_all (vol->pa_busy_sinks);
+    if (g_hash_table_size (vol->pa_suspended) || vol->pa_idle_adopt) pa_get_busy_sinks (vol);
+    pa_check_idle_sinks (vol);
+    vol->pa_idle_adopt = FALSE;
+}
+
+/* Query controller for the list of output streams to find which sinks are in use */
+
+static int pa_get_busy_sinks (VolumePulsePlugin *vol)
 {
-    DEBUG ("pulse_add_devices_to_profile_dialog");
+    DEBUG ("pa_get_busy_sinks");
     START_PA_OPERATION
-    op = pa_context_get_card_info_list (vol->pa_context, &pa_cb_add_devices_to_profile_dialog, vol);
-    END_PA_OPERATION ("get_card_info_list")
+    op = pa_context_get_sink_input_info_list (vol->pa_context, &pa_cb_get_busy_sinks, vol);
+    END_PA_OPERATION ("get_sink_input_info_list")
 }
 
-/* Callback for card list query - reads profiles for card and adds as a combo box to profiles dialog */
+/* Callback for output stream query - corked streams do not count, as they do not need the sink */
 
-static void pa_cb_add_devices_to_profile_dialog (pa_context *c, const pa_card_info *i, int eol, void *userdata)
+static void pa_cb_get_busy_sinks (pa_context *c, const pa_sink_input_info *i, int eol, void *userdata)
 {
     VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
 
-    GtkListStore *ls;
-    int index = 0, sel = -1;
+    if (!eol && !i->corked) g_hash_table_add (vol->pa_busy_sinks, GUINT_TO_POINTER (i->sink));
+
+    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+}
+
+/* Query controller for the states of all sinks */
+
+static int pa_check_idle_sinks (VolumePulsePlugin *vol)
+{
+    DEBUG ("pa_check_idle_sinks");
+    START_PA_OPERATION
+    op = pa_context_get_sink_info_list (vol->pa_context, &pa_cb_check_idle_sinks, vol);
+    END_PA_OPERATION ("get_sink_info_list")
+}
+
+/* Callback for sink list query - times idle sinks which are set to suspend, and resumes suspended sinks with streams */
+
+static void pa_cb_check_idle_sinks (pa_context *c, const pa_sink_info *i, int eol, void *userdata)
+{
+    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+    pa_operation *op;
+    int timeout;
 
     if (!eol)
     {
-        // loop through profiles, adding each to list store
-        ls = gtk_list_store_new (2, G_TYPE_STRING, G_TYPE_STRING);
-        pa_card_profile_info2 **profile = i->profiles2;
-        while (*profile)
+        g_hash_table_insert (vol->pa_sink_states, GUINT_TO_POINTER (i->index), GINT_TO_POINTER (i->state));
+
+        // at startup, a suspended sink which is set to suspend is taken to have been suspended by an earlier run
+        if (vol->pa_idle_adopt && i->state == PA_SINK_SUSPENDED && !g_hash_table_contains (vol->pa_suspended, i->name)
+            && pa_suspend_idle_setting (vol, i->name, &timeout))
         {
-            if (*profile == i->active_profile2) sel = index;
-            gtk_list_store_insert_with_values (ls, NULL, index++, 0, (*profile)->name, 1, (*profile)->description, -1);
-            profile++;
+            DEBUG ("Taking over suspended sink %s", i->name);
+            g_hash_table_add (vol->pa_suspended, g_strdup (i->name));
         }
 
-        if (!g_strcmp0 (pa_proplist_gets (i->proplist, "device.api"), "bluez"))
-            profiles_dialog_add_combo (vol, ls, vol->profiles_bt_box, sel, pa_proplist_gets (i->proplist, "device.description"), i->name);
-        else
+        if (g_hash_table_contains (vol->pa_suspended, i->name))
         {
-            if (g_strcmp0 (pa_proplist_gets (i->proplist, "device.description"), "Built-in Audio"))
-                profiles_dialog_add_combo (vol, ls, vol->profiles_ext_box, sel, pa_proplist_gets (i->proplist, "alsa.card_name"), i->name);
-            else
-                profiles_dialog_add_combo (vol, ls, vol->profiles_int_box, sel, pa_proplist_gets (i->proplist, "alsa.card_name"), i->name);
+            if (i->state != PA_SINK_SUSPENDED)
+            {
+                // resumed by another client
+                g_hash_table_remove (vol->pa_suspended, i->name);
+            }
+            else if (g_hash_table_contains (vol->pa_busy_sinks, GUINT_TO_POINTER (i->index)))
+            {
+                DEBUG ("Resuming %s for new stream", i->name);
+                op = pa_context_suspend_sink_by_name (c, i->name, 0, NULL, NULL);
+                if (op) pa_operation_unref (op);
+                g_hash_table_remove (vol->pa_suspended, i->name);
+            }
+        }
+
+        if (i->state == PA_SINK_IDLE && pa_suspend_idle_setting (vol, i->name, &timeout))
+        {
+            if (!g_hash_table_contains (vol->pa_idle_timers, i->name)) pa_start_idle_timer (vol, i->name, timeout);
         }
+        else pa_cancel_idle_timer (vol, i->name);
     }
 
     pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
 }
 
+/* Start the timer to suspend an idle sink */
+
+static void pa_start_idle_timer (VolumePulsePlugin *vol, const char *sink, int timeout)
+{
+    idle_timer_t *timer;
+    guint id;
+
+    DEBUG ("Suspending %s in %d seconds if still idle", sink, timeout);
+    timer = g_new0 (idle_timer_t, 1);
+    timer->vol = vol;
+    timer->sink = g_strdup (sink);
+    id = g_timeout_add_seconds_full (G_PRIORITY_DEFAULT, timeout, pa_idle_timeout, timer, pa_idle_timer_free);
+    g_hash_table_insert (vol->pa_idle_timers, g_strdup (sink), GUINT_TO_POINTER (id));
+}
+
+/* Stop the timer for a sink, if there is one */
+
+static void pa_cancel_idle_timer (VolumePulsePlugin *vol, const char *sink)
+{
+    guint id = GPOINTER_TO_UINT (g_hash_table_lookup (vol->pa_idle_timers, sink));
+
+    if (id)
+    {
+        g_source_remove (id);
+        g_hash_table_remove (vol->pa_idle_timers, sink);
+    }
+}
+
+/* Handler for idle timer - suspends the sink */
+
+static gboolean pa_idle_timeout (gpointer userdata)
+{
+    idle_timer_t *timer = (idle_timer_t *) userdata;
+    VolumePulsePlugin *vol = timer->vol;
+
+    g_hash_table_remove (vol->pa_idle_timers, timer->sink);
+
+    DEBUG ("Suspending idle sink %s", timer->sink);
+    if (pa_suspend_sink (vol, timer->sink, TRUE))
+    {
+        pa_threaded_mainloop_lock (vol->pa_mainloop);
+        g_hash_table_add (vol->pa_suspended, g_strdup (timer->sink));
+        pa_threaded_mainloop_unlock (vol->pa_mainloop);
+    }
+    return FALSE;
+}
+
+/* Free the data for an idle timer once it has been removed */
+
+static void pa_idle_timer_free (gpointer userdata)
+{
+    idle_timer_t *timer = (idle_timer_t *) userdata;
+
+    g_free (timer->sink);
+    g_free (timer);
+}
+
+/* Suspend or resume a sink */
+
+static int pa_suspend_sink (VolumePulsePlugin *vol, const char *sinkname, int suspend)
+{
+    DEBUG ("pa_suspend_sink %s %d", sinkname, suspend);
+    START_PA_OPERATION
+    op = pa_context_suspend_sink_by_name (vol->pa_context, sinkname, suspend, &pa_cb_generic_success, vol);
+    END_PA_OPERATION ("suspend_sink_by_name")
+}
+
+/* Stop all idle timers and resume any sinks which the plugin has suspended */
+
+static void pa_resume_idle_sinks (VolumePulsePlugin *vol)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if (vol->pa_idle_timers == NULL) return;
+
+    g_hash_table_iter_init (&iter, vol->pa_idle_timers);
+    while (g_hash_table_iter_next (&iter, &key, &value)) g_source_remove (GPOINTER_TO_UINT (value));
+    g_hash_table_remove_all (vol->pa_idle_timers);
+
+    g_hash_table_iter_init (&iter, vol->pa_suspended);
+    while (g_hash_table_iter_next (&iter, &key, &value)) pa_suspend_sink (vol, (const char *) key, FALSE);
+    if (vol->pa_mainloop) pa_threaded_mainloop_lock (vol->pa_mainloop);
+    g_hash_table_remove_all (vol->pa_suspended);
+    if (vol->pa_mainloop) pa_threaded_mainloop_unlock (vol->pa_mainloop);
+}
+
 /*----------------------------------------------------------------------------*/
 /* Utility functions                                                          */
 /*----------------------------------------------------------------------------*/
 
-/* Get a count of the number of input or output devices */
+/*
+ * The number of input or output devices is needed every time the display is
+ * updated, so it is kept as a set of matching card indices. The set is built
+ * by a full query the first time the count is requested, and after that is
+ * updated only for cards which PulseAudio reports as added, changed or removed.
+ */
 
 int pulse_count_devices (VolumePulsePlugin *vol)
 {
-    vol->pa_devices = 0;
-    START_PA_OPERATION
-    if (vol->input_control)
-        op = pa_context_get_card_info_list (vol->pa_context, &pa_cb_count_inputs, vol);
-    else
-        op = pa_context_get_card_info_list (vol->pa_context, &pa_cb_count_outputs, vol);
-    END_PA_OPERATION ("get_card_info_list")
+    if (vol->pa_cards == NULL) return 0;
+
+    pa_process_card_events (vol);
+    vol->pa_devices = g_hash_table_size (vol->pa_cards);
+    return vol->pa_devices;
 }
 
-/*
- * Callbacks for card count query, each of which just increments the global device counter
- * whenever a matching device is found
- */
+/* Add a card event to the queue - called from the controller thread, so the mainloop lock is already held */
 
-static void pa_cb_count_inputs (pa_context *c, const pa_card_info *i, int eol, void *userdata)
+static void pa_queue_card_event (VolumePulsePlugin *vol, pa_subscription_event_type_t event, uint32_t idx)
 {
-    VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
+    if (vol->pa_cards == NULL) return;
 
-    if (!eol)
+    if (vol->pa_card_event_count < PA_CARD_EVENTS)
     {
-        if (pa_card_has_port (i, PA_DIRECTION_INPUT))
-        {
-            const char *nam = pa_proplist_gets (i->proplist, "alsa.card_name");
-            if (nam) vol->pa_devices++;
-        }
+        vol->pa_card_events[vol->pa_card_event_count].index = idx;
+        vol->pa_card_events[vol->pa_card_event_count].type = event;
+        vol->pa_card_event_count++;
+    }
+    else vol->pa_card_rescan = TRUE;
+}
+
+/* Apply queued card events to the set of counted cards */
+
+static void pa_process_card_events (VolumePulsePlugin *vol)
+{
+    pa_event_t events[PA_CARD_EVENTS];
+    gboolean rescan;
+    int count, ev;
+
+    if (vol->pa_mainloop == NULL) return;
+
+    // take a copy of the queue so the lock is not held during the queries below
+    pa_threaded_mainloop_lock (vol->pa_mainloop);
+    count = vol->pa_card_event_count;
+    memcpy (events, vol->pa_card_events, count * sizeof (pa_event_t));
+    rescan = vol->pa_card_rescan;
+    vol->pa_card_event_count = 0;
+    vol->pa_card_rescan = FALSE;
+    pa_threaded_mainloop_unlock (vol->pa_mainloop);
+
+    if (rescan)
+    {
+        DEBUG ("pa_process_card_events - full count");
+        g_hash_table_remove_all (vol->pa_cards);
+        pa_count_card (vol, PA_INVALID_INDEX);
+        return;
     }
 
-    pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
+    for (ev = 0; ev < count; ev++)
+    {
+        DEBUG ("pa_process_card_events - card %d event %d", events[ev].index, events[ev].type);
+        if (events[ev].type == PA_SUBSCRIPTION_EVENT_REMOVE)
+            g_hash_table_remove (vol->pa_cards, GUINT_TO_POINTER (events[ev].index));
+        else
+            pa_count_card (vol, events[ev].index);
+    }
+}
+
+/* Query the controller for a single card, or for all cards if the index is PA_INVALID_INDEX */
+
+static int pa_count_card (VolumePulsePlugin *vol, uint32_t index)
+{
+    START_PA_OPERATION
+    if (index == PA_INVALID_INDEX)
+        op = pa_context_get_card_info_list (vol->pa_context, &pa_cb_count_cards, vol);
+    else
+        op = pa_context_get_card_info_by_index (vol->pa_context, index, &pa_cb_count_cards, vol);
+    END_PA_OPERATION ("get_card_info")
 }
 
-static void pa_cb_count_outputs (pa_context *c, const pa_card_info *i, int eol, void *userdata)
+/*
+ * Callback for card count query, which adds the card to the set of counted cards
+ * if it has ports in the relevant direction, and removes it otherwise
+ */
+
+static void pa_cb_count_cards (pa_context *c, const pa_card_info *i, int eol, void *userdata)
 {
     VolumePulsePlugin *vol = (VolumePulsePlugin *) userdata;
 
     if (!eol)
     {
-        if (pa_card_has_port (i, PA_DIRECTION_OUTPUT))
-        {
-            const char *nam = pa_proplist_gets (i->proplist, "alsa.card_name");
-            if (nam) vol->pa_devices++;
-        }
+        if (pa_card_has_port (i, vol->input_control ? PA_DIRECTION_INPUT : PA_DIRECTION_OUTPUT)
+            && pa_proplist_gets (i->proplist, "alsa.card_name"))
+            g_hash_table_add (vol->pa_cards, GUINT_TO_POINTER (i->index));
+        else
+            g_hash_table_remove (vol->pa_cards, GUINT_TO_POINTER (i->index));
     }
 
     pa_threaded_mainloop_signal (vol->pa_mainloop, 0);
 }
 
+/* Add the BlueZ object path and address of a Bluetooth card / sink / source to the Bluetooth index */
+
+static void pa_index_bt_device (VolumePulsePlugin *vol, pa_proplist *proplist)
+{
+    bluetooth_index_device (vol, pa_proplist_gets (proplist, "bluez.path"), pa_proplist_gets (proplist, "device.string"));
+}
+
 /* End of file */
 /*----------------------------------------------------------------------------*/
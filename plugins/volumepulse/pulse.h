@@ -38,6 +38,10 @@ extern int pulse_get_default_sink_source (VolumePulsePlugin *vol);
 extern void pulse_change_sink (VolumePulsePlugin *vol, const char *sinkname);
 extern void pulse_change_source (VolumePulsePlugin *vol, const char *sourcename);
 
+extern void pulse_update_stream_controls (VolumePulsePlugin *vol, gboolean full);
+extern int pulse_set_stream_volume (VolumePulsePlugin *vol, uint32_t index, int channels, int volume);
+extern int pulse_set_stream_mute (VolumePulsePlugin *vol, uint32_t index, int mute);
+
 extern void pulse_mute_all_streams (VolumePulsePlugin *vol);
 extern void pulse_unmute_all_streams (VolumePulsePlugin *vol);
 
@@ -50,6 +54,14 @@ extern int pulse_set_profile (VolumePulsePlugin *vol, const char *card, const ch
 extern int pulse_add_devices_to_menu (VolumePulsePlugin *vol, gboolean internal);
 extern void pulse_update_devices_in_menu (VolumePulsePlugin *vol);
 extern int pulse_add_devices_to_profile_dialog (VolumePulsePlugin *vol);
+extern int pulse_add_latencies_to_profile_dialog (VolumePulsePlugin *vol);
+extern int pulse_set_latency_offset (VolumePulsePlugin *vol, const char *card, const char *port, int offset);
+extern int pulse_restore_latency_offsets (VolumePulsePlugin *vol, const char *card);
+
+extern void pulse_set_low_latency (VolumePulsePlugin *vol, gboolean enable);
+extern int pulse_get_sink_latency (VolumePulsePlugin *vol);
+
+extern void pulse_set_suspend_idle (VolumePulsePlugin *vol, const char *sink, gboolean enable, int timeout);
 
 extern int pulse_count_devices (VolumePulsePlugin *vol);
 
@@ -30,6 +30,14 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "pulse.h"
 #include "bluetooth.h"
 
+/*----------------------------------------------------------------------------*/
+/* Local macros and definitions                                               */
+/*----------------------------------------------------------------------------*/
+
+#define LATENCY_OFFSET_MAX  2000    /* Largest latency offset in ms which can be set in the profiles dialog */
+#define LATENCY_OFFSET_STEP 10      /* Step size in ms of latency offset control */
+#define SUSPEND_TIMEOUT_MAX 3600    /* Longest idle time in seconds before suspend which can be set in the profiles dialog */
+
 /*----------------------------------------------------------------------------*/
 /* Static function prototypes                                                 */
 /*----------------------------------------------------------------------------*/
@@ -41,11 +49,16 @@ static const char *device_display_name (VolumePulsePlugin *vol, const char *name
 
 /* Menu popup */
 static void menu_open_profile_dialog (GtkWidget *widget, VolumePulsePlugin *vol);
+static void menu_toggle_low_latency (GtkWidget *widget, VolumePulsePlugin *vol);
 
 /* Profiles dialog */
 static void profiles_dialog_show (VolumePulsePlugin *vol);
 static void profiles_dialog_relocate_last_item (GtkWidget *box);
 static void profiles_dialog_combo_changed (GtkComboBox *combo, VolumePulsePlugin *vol);
+static GtkWidget *profiles_dialog_find_row (VolumePulsePlugin *vol, const char *name, int index);
+static void profiles_dialog_latency_changed (GtkSpinButton *spin, VolumePulsePlugin *vol);
+static void profiles_dialog_suspend_changed (GtkWidget *widget, VolumePulsePlugin *vol);
+static void profiles_dialog_close (VolumePulsePlugin *vol);
 static void profiles_dialog_ok (GtkButton *button, VolumePulsePlugin *vol);
 static gboolean profiles_dialog_delete (GtkWidget *wid, GdkEvent *event, VolumePulsePlugin *vol);
 
@@ -125,6 +138,8 @@ void menu_show (VolumePulsePlugin *vol)
 {
     GtkWidget *mi;
     GList *items;
+    char *label;
+    int latency;
 
     // create the menu
     menu_create (vol);
@@ -140,6 +155,17 @@ void menu_show (VolumePulsePlugin *vol)
         g_signal_connect (mi, "activate", G_CALLBACK (menu_open_profile_dialog), (gpointer) vol);
         gtk_menu_shell_append (GTK_MENU_SHELL (vol->menu_devices), mi);
 
+        // add the low latency option, showing the latency of the default sink
+        latency = pulse_get_sink_latency (vol);
+        if (vol->pa_low_latency) label = g_strdup_printf (_("Low Latency (%d ms, was %d ms)"), latency, vol->pa_ll_before);
+        else if (latency >= 0) label = g_strdup_printf (_("Low Latency (now %d ms)"), latency);
+        else label = g_strdup (_("Low Latency"));
+        mi = gtk_check_menu_item_new_with_label (label);
+        gtk_check_menu_item_set_active (GTK_CHECK_MENU_ITEM (mi), vol->pa_low_latency);
+        g_signal_connect (mi, "toggled", G_CALLBACK (menu_toggle_low_latency), (gpointer) vol);
+        gtk_menu_shell_append (GTK_MENU_SHELL (vol->menu_devices), mi);
+        g_free (label);
+
         g_list_free (items);
     }
 
@@ -206,6 +232,14 @@ static void menu_open_profile_dialog (GtkWidget *widget, VolumePulsePlugin *vol)
     profiles_dialog_show (vol);
 }
 
+/* Handler for menu click to turn low latency mode on or off */
+
+static void menu_toggle_low_latency (GtkWidget *widget, VolumePulsePlugin *vol)
+{
+    pulse_set_low_latency (vol, gtk_check_menu_item_get_active (GTK_CHECK_MENU_ITEM (widget)));
+    volumepulse_update_display (vol);
+}
+
 /*----------------------------------------------------------------------------*/
 /* Profiles dialog                                                            */
 /*----------------------------------------------------------------------------*/
@@ -234,8 +268,9 @@ static void profiles_dialog_show (VolumePulsePlugin *vol)
     gtk_box_pack_start (GTK_BOX (box), vol->profiles_ext_box, FALSE, FALSE, 0);
     gtk_box_pack_start (GTK_BOX (box), vol->profiles_bt_box, FALSE, FALSE, 0);
 
-    // first loop through cards
+    // first loop through cards, then add the latencies of their sinks
     pulse_add_devices_to_profile_dialog (vol);
+    pulse_add_latencies_to_profile_dialog (vol);
 
     // then loop through Bluetooth devices
     bluetooth_add_devices_to_profile_dialog (vol);
@@ -255,7 +290,7 @@ static void profiles_dialog_show (VolumePulsePlugin *vol)
 
 void profiles_dialog_add_combo (VolumePulsePlugin *vol, GtkListStore *ls, GtkWidget *dest, int sel, const char *label, const char *name)
 {
-    GtkWidget *lbl, *comb;
+    GtkWidget *lbl, *comb, *row;
     GtkCellRenderer *rend;
     char *ltext;
 
@@ -280,7 +315,11 @@ void profiles_dialog_add_combo (VolumePulsePlugin *vol, GtkListStore *ls, GtkWid
         gtk_widget_set_sensitive (comb, FALSE);
     }
     gtk_combo_box_set_active (GTK_COMBO_BOX (comb), sel);
-    gtk_box_pack_start (GTK_BOX (dest), comb, FALSE, FALSE, 5);
+
+    // the combo is in a row of its own, so controls for the device can be added alongside it
+    row = gtk_box_new (GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_box_pack_start (GTK_BOX (row), comb, TRUE, TRUE, 0);
+    gtk_box_pack_start (GTK_BOX (dest), row, FALSE, FALSE, 5);
 
     profiles_dialog_relocate_last_item (dest);
 
@@ -325,18 +364,180 @@ static void profiles_dialog_combo_changed (GtkComboBox *combo, VolumePulsePlugin
     bluetooth_reconnect (vol, name, option);
 }
 
+/*
+ * Each card row also has a control for the latency offset of its active port, which
+ * is used to line up audio with video on outputs with very different delays, and a
+ * label showing the current latency of the sink for the card. The control is added
+ * with the offsets of all the output ports of the card, and enabled for the port the
+ * sink is actually using once that is known from the sink query.
+ */
+
+void profiles_dialog_add_latency (VolumePulsePlugin *vol, const char *card, int index, GHashTable *offsets)
+{
+    GtkWidget *row, *spin, *lbl;
+
+    row = profiles_dialog_find_row (vol, card, -1);
+    if (!row)
+    {
+        g_hash_table_destroy (offsets);
+        return;
+    }
+
+    spin = gtk_spin_button_new_with_range (-LATENCY_OFFSET_MAX, LATENCY_OFFSET_MAX, LATENCY_OFFSET_STEP);
+    gtk_widget_set_tooltip_text (spin, _("Latency offset in milliseconds"));
+    gtk_widget_set_sensitive (spin, FALSE);
+    g_object_set_data_full (G_OBJECT (spin), "card", g_strdup (card), g_free);
+    g_object_set_data_full (G_OBJECT (spin), "offsets", offsets, (GDestroyNotify) g_hash_table_destroy);
+    gtk_box_pack_start (GTK_BOX (row), spin, FALSE, FALSE, 0);
+
+    lbl = gtk_label_new (_("ms"));
+    gtk_box_pack_start (GTK_BOX (row), lbl, FALSE, FALSE, 0);
+
+    g_object_set_data (G_OBJECT (row), "card-index", GINT_TO_POINTER (index + 1));
+    g_object_set_data (G_OBJECT (row), "latency", spin);
+    g_signal_connect (spin, "value-changed", G_CALLBACK (profiles_dialog_latency_changed), vol);
+}
+
+/* Show the current latency of the sink for a card, and point the latency offset control at the port the sink is using */
+
+void profiles_dialog_set_latency (VolumePulsePlugin *vol, int index, const char *port, int latency, int configured)
+{
+    GtkWidget *row, *lbl, *spin;
+    gpointer offset;
+    char *text;
+
+    row = profiles_dialog_find_row (vol, NULL, index);
+    if (!row) return;
+
+    spin = g_object_get_data (G_OBJECT (row), "latency");
+    if (spin && port && g_hash_table_lookup_extended (g_object_get_data (G_OBJECT (spin), "offsets"), port, NULL, &offset))
+    {
+        gtk_widget_set_name (spin, port);
+        g_signal_handlers_block_by_func (spin, profiles_dialog_latency_changed, vol);
+        gtk_spin_button_set_value (GTK_SPIN_BUTTON (spin), GPOINTER_TO_INT (offset));
+        g_signal_handlers_unblock_by_func (spin, profiles_dialog_latency_changed, vol);
+        gtk_widget_set_sensitive (spin, TRUE);
+    }
+
+    text = g_strdup_printf (_("Latency %d ms (configured %d ms)"), latency, configured);
+    lbl = gtk_label_new (text);
+    gtk_widget_set_sensitive (lbl, FALSE);
+    gtk_box_pack_end (GTK_BOX (row), lbl, FALSE, FALSE, 0);
+    g_free (text);
+}
+
+/* Add the controls for suspending the sink of a card when idle */
+
+void profiles_dialog_add_suspend (VolumePulsePlugin *vol, int index, const char *sink, gboolean enable, int timeout)
+{
+    GtkWidget *row, *check, *spin, *lbl;
+
+    row = profiles_dialog_find_row (vol, NULL, index);
+    if (!row) return;
+
+    check = gtk_check_button_new_with_label (_("Suspend when idle"));
+    gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (check), enable);
+    gtk_widget_set_name (check, sink);
+    gtk_widget_set_tooltip_text (check, _("Power down the device when nothing has played to it for a time"));
+    gtk_box_pack_start (GTK_BOX (row), check, FALSE, FALSE, 0);
+
+    spin = gtk_spin_button_new_with_range (1, SUSPEND_TIMEOUT_MAX, 1);
+    gtk_spin_button_set_value (GTK_SPIN_BUTTON (spin), timeout);
+    gtk_widget_set_tooltip_text (spin, _("Time in seconds before an idle device is suspended"));
+    gtk_widget_set_sensitive (spin, enable);
+    gtk_box_pack_start (GTK_BOX (row), spin, FALSE, FALSE, 0);
+
+    lbl = gtk_label_new (_("s"));
+    gtk_box_pack_start (GTK_BOX (row), lbl, FALSE, FALSE, 0);
+
+    g_object_set_data (G_OBJECT (check), "timeout", spin);
+    g_object_set_data (G_OBJECT (spin), "enable", check);
+    g_signal_connect (check, "toggled", G_CALLBACK (profiles_dialog_suspend_changed), vol);
+    g_signal_connect (spin, "value-changed", G_CALLBACK (profiles_dialog_suspend_changed), vol);
+}
+
+/* Find the row in the profiles dialog for a card, either by name or by index */
+
+static GtkWidget *profiles_dialog_find_row (VolumePulsePlugin *vol, const char *name, int index)
+{
+    GtkWidget *boxes[3] = { vol->profiles_int_box, vol->profiles_ext_box, vol->profiles_bt_box };
+    GtkWidget *row = NULL;
+    GList *children, *child, *widgets;
+    int box;
+
+    for (box = 0; box < 3 && !row; box++)
+    {
+        children = gtk_container_get_children (GTK_CONTAINER (boxes[box]));
+        for (child = children; child != NULL && !row; child = child->next)
+        {
+            if (!GTK_IS_BOX (child->data)) continue;
+            if (name)
+            {
+                widgets = gtk_container_get_children (GTK_CONTAINER (child->data));
+                if (widgets && !g_strcmp0 (gtk_widget_get_name (GTK_WIDGET (widgets->data)), name)) row = GTK_WIDGET (child->data);
+                g_list_free (widgets);
+            }
+            else if (GPOINTER_TO_INT (g_object_get_data (G_OBJECT (child->data), "card-index")) == index + 1)
+                row = GTK_WIDGET (child->data);
+        }
+        g_list_free (children);
+    }
+    return row;
+}
+
+/* Handler for "value-changed" signal from a latency offset spin button */
+
+static void profiles_dialog_latency_changed (GtkSpinButton *spin, VolumePulsePlugin *vol)
+{
+    const char *card = g_object_get_data (G_OBJECT (spin), "card");
+    const char *port = gtk_widget_get_name (GTK_WIDGET (spin));
+    int offset = gtk_spin_button_get_value_as_int (spin);
+
+    pulse_set_latency_offset (vol, card, port, offset);
+    vol->profiles_unsaved = TRUE;
+}
+
+/* Handler for "toggled" signal from a suspend check box and "value-changed" signal from its timeout spin button */
+
+static void profiles_dialog_suspend_changed (GtkWidget *widget, VolumePulsePlugin *vol)
+{
+    GtkWidget *check, *spin;
+    gboolean enable;
+
+    check = g_object_get_data (G_OBJECT (widget), "enable");
+    if (!check) check = widget;
+    spin = g_object_get_data (G_OBJECT (check), "timeout");
+
+    enable = gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (check));
+    gtk_widget_set_sensitive (spin, enable);
+    pulse_set_suspend_idle (vol, gtk_widget_get_name (check), enable, gtk_spin_button_get_value_as_int (GTK_SPIN_BUTTON (spin)));
+    vol->profiles_unsaved = TRUE;
+}
+
+/* Close the profiles dialog, saving any settings changed in it once */
+
+static void profiles_dialog_close (VolumePulsePlugin *vol)
+{
+    close_widget (&vol->profiles_dialog);
+    if (vol->profiles_unsaved)
+    {
+        lxpanel_config_save (vol->panel);
+        vol->profiles_unsaved = FALSE;
+    }
+}
+
 /* Handler for 'OK' button on profiles dialog */
 
 static void profiles_dialog_ok (GtkButton *button, VolumePulsePlugin *vol)
 {
-    close_widget (&vol->profiles_dialog);
+    profiles_dialog_close (vol);
 }
 
 /* Handler for "delete-event" signal from profiles dialog */
 
 static gboolean profiles_dialog_delete (GtkWidget *wid, GdkEvent *event, VolumePulsePlugin *vol)
 {
-    close_widget (&vol->profiles_dialog);
+    profiles_dialog_close (vol);
     return TRUE;
 }
 
@@ -362,26 +563,7 @@ void volumepulse_update_display (VolumePulsePlugin *vol)
         else if (level > 0) icon = "audio-volume-low";
         else icon = "audio-volume-silent";
     }
-    lxpanel_plugin_set_taskbar_icon (vol->panel, vol->tray_icon, icon);
-
-    /* update popup window controls */
-    if (vol->popup_window)
-    {
-        g_signal_handler_block (vol->popup_mute_check, vol->mute_check_handler);
-        gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (vol->popup_mute_check), mute);
-        g_signal_handler_unblock (vol->popup_mute_check, vol->mute_check_handler);
-
-        g_signal_handler_block (vol->popup_volume_scale, vol->volume_scale_handler);
-        gtk_range_set_value (GTK_RANGE (vol->popup_volume_scale), level);
-        g_signal_handler_unblock (vol->popup_volume_scale, vol->volume_scale_handler);
-
-        gtk_widget_set_sensitive (vol->popup_volume_scale, !mute);
-    }
-
-    /* update tooltip */
-    char *tooltip = g_strdup_printf ("%s %d", _("Volume control"), level);
-    gtk_widget_set_tooltip_text (vol->plugin, tooltip);
-    g_free (tooltip);
+    display_update (vol, icon, level, mute);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -415,13 +597,17 @@ static GtkWidget *volumepulse_constructor (LXPanel *panel, config_setting_t *set
     gtk_button_set_relief (GTK_BUTTON (vol->plugin), GTK_RELIEF_NONE);
     g_signal_connect (vol->plugin, "button-press-event", G_CALLBACK (volumepulse_button_press_event), vol);
     g_signal_connect (vol->plugin, "scroll-event", G_CALLBACK (volumepulse_mouse_scrolled), vol);
-    gtk_widget_add_events (vol->plugin, GDK_SCROLL_MASK);
+    gtk_widget_add_events (vol->plugin, GDK_SCROLL_MASK | GDK_SMOOTH_SCROLL_MASK);
+    gtk_widget_set_has_tooltip (vol->plugin, TRUE);
+    g_signal_connect (vol->plugin, "query-tooltip", G_CALLBACK (volumepulse_query_tooltip), vol);
 
     /* Set up variables */
     vol->input_control = FALSE;
 
     vol->menu_devices = NULL;
     vol->popup_window = NULL;
+    vol->disp_icon = NULL;
+    vol->disp_level = -1;
     vol->profiles_dialog = NULL;
     vol->conn_dialog = NULL;
 
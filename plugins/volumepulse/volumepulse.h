@@ -43,6 +43,34 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define DEBUG(fmt,args...)
 #endif
 
+#define PA_CARD_EVENTS 32
+#define PA_STREAM_EVENTS 64
+
+typedef struct {
+    uint32_t index;                     /* Index of card or stream which generated event */
+    pa_subscription_event_type_t type;  /* Event type - new, change or remove */
+} pa_event_t;
+
+#define BT_HISTORY 8
+
+typedef enum {
+    BT_PHASE_DISCONNECT,
+    BT_PHASE_TRUST,
+    BT_PHASE_CONNECT,
+    BT_PHASE_CARD,
+    BT_PHASE_PROFILE,
+    BT_PHASE_DEFAULT,
+    BT_PHASE_STREAMS,
+    BT_PHASES
+} bt_phase_t;
+
+typedef struct {
+    char device[64];                    /* BlueZ object path of device */
+    gint64 start;                       /* Time at which operation started */
+    int phase_ms[BT_PHASES];            /* Time taken by each phase, or -1 if phase was not run */
+    gboolean ok;                        /* Flag to show operation completed without error */
+} bt_timing_t;
+
 typedef struct {
     /* plugin */
     GtkWidget *plugin;                  /* Back pointer to widget */
@@ -54,16 +82,31 @@ typedef struct {
     GtkWidget *popup_window;            /* Top level window for popup */
     GtkWidget *popup_volume_scale;      /* Scale for volume */
     GtkWidget *popup_mute_check;        /* Checkbox for mute state */
+    GtkWidget *popup_streams_window;    /* Scrolled window for application stream rows */
+    GtkWidget *popup_streams_box;       /* Vbox for application stream rows */
+    GHashTable *popup_streams;          /* Map of stream indices to rows in popup */
     GtkWidget *menu_devices;            /* Right-click menu */
     GtkWidget *profiles_dialog;         /* Device profiles dialog */
     GtkWidget *profiles_int_box;        /* Vbox for profile combos */
     GtkWidget *profiles_ext_box;        /* Vbox for profile combos */
     GtkWidget *profiles_bt_box;         /* Vbox for profile combos */
+    gboolean profiles_unsaved;          /* Settings changed in profiles dialog not yet saved */
     GtkWidget *conn_dialog;             /* Connection dialog box */
     GtkWidget *conn_label;              /* Dialog box text field */
     GtkWidget *conn_ok;                 /* Dialog box button */
     guint volume_scale_handler;         /* Handler for volume_scale widget */
     guint mute_check_handler;           /* Handler for mute_check widget */
+    guint scroll_tick;                  /* Tick callback for coalesced scroll updates */
+    gint64 scroll_time;                 /* Time of last scroll event */
+    double scroll_delta;                /* Scroll distance not yet applied to volume */
+    int scroll_volume;                  /* Volume level being driven by scrolling */
+    const char *disp_icon;              /* Icon currently displayed */
+    int disp_level;                     /* Volume level currently displayed, used for tooltip */
+    int popup_level;                    /* Volume level currently shown on popup scale */
+    int popup_mute;                     /* Mute state currently shown on popup checkbox */
+    gint64 popup_show_time;             /* Time popup was last asked to show, for debug latency report */
+    guint disp_applied;                 /* Counter for display refreshes which changed something */
+    guint disp_skipped;                 /* Counter for display refreshes which changed nothing */
     gboolean separator;                 /* Flag to show whether a menu separator has been added */
     gboolean input_control;             /* Flag to show whether this is an input or output controller */
 
@@ -74,25 +117,84 @@ typedef struct {
     pa_threaded_mainloop *pa_mainloop;  /* Controller loop variable */
     pa_context *pa_context;             /* Controller context */
     pa_context_state_t pa_state;        /* Current controller state */
-    char *pa_default_sink;              /* Current default sink name */
-    char *pa_default_source;            /* Current default source name */
-    char *pa_profile;                   /* Current profile for card */
+    const char *pa_default_sink;        /* Current default sink name (interned) */
+    const char *pa_default_source;      /* Current default source name (interned) */
+    const char *pa_profile;             /* Current profile for card (interned) */
+    const char *pa_headset_profile;     /* Available headset profile for card read by profile query (interned), or NULL if none */
     int pa_channels;                    /* Number of channels on default sink */
     int pa_volume;                      /* Volume setting on default sink */
     int pa_mute;                        /* Mute setting on default sink */
-    GList *pa_indices;                  /* Indices for current streams */
-    char *pa_error_msg;                 /* Error message from success / fail callback */
+    gboolean pa_hw_volume;              /* Flag to show default sink has hardware volume control, which it forwards to the device */
+    GArray *pa_indices;                 /* Indices for current streams */
+    GHashTable *pa_levels;              /* Map of sink names (interned) to remembered volume and mute */
+    int pa_error;                       /* Error code from success / fail callback */
+    GSource *pa_update_source;          /* Source used to refresh display after notifications */
     int pa_devices;                     /* Counter for pulse devices */
+    GHashTable *pa_cards;               /* Set of indices of cards included in device count */
+    pa_event_t pa_card_events[PA_CARD_EVENTS];      /* Card events not yet applied to device count */
+    int pa_card_event_count;            /* Number of entries in card event queue */
+    gboolean pa_card_rescan;            /* Flag to show card event queue overflowed and a full count is needed */
+    pa_event_t pa_stream_events[PA_STREAM_EVENTS];  /* Stream events not yet applied to popup */
+    int pa_stream_event_count;          /* Number of entries in stream event queue */
+    gboolean pa_stream_rescan;          /* Flag to show stream event queue overflowed and a full update is needed */
+    GHashTable *pa_routes;              /* Map of stream properties to maps of their values to device names */
+    GPtrArray *pa_route_props;          /* Stream properties used by routing rules, in order of priority */
+    gboolean pa_keep_routed;            /* Flag to show stream queries should leave out streams matched by a rule */
+    uint32_t pa_default_card;           /* Card index of default sink, cached at display refresh */
+    const char *pa_default_port;        /* Active port of default sink, cached at display refresh (interned) */
+    const char *pa_sink_port;           /* Active port of sink read by sink info query (interned) */
+    GHashTable *pa_ports;               /* Map of output port names (interned) on card of default sink to their availability */
+    gboolean pa_ports_stale;            /* Flag to show port availability needs to be read afresh for a new card */
+    gboolean pa_card_changed;           /* Flag to show a notification has arrived for card of default sink */
+    gboolean pa_card_removed;           /* Flag to show card of default sink has been removed */
+    gboolean pa_unplugged;              /* Flag to show port in use has been unplugged, set by port query */
+    GHashTable *pa_device_names;        /* Map of sink or source indices to names, kept up to date from notifications */
+    gboolean pa_default_removed;        /* Flag to show default sink or source has been removed */
+    gint64 pa_removed_time;             /* Time at which default sink or source was removed */
+    GHashTable *pa_auto_switch;         /* Set of names of devices to make default as soon as they appear */
+    const char *pa_switch_target;       /* Auto-switch device added since the last display refresh (interned) */
+    gint64 pa_switch_time;              /* Time at which auto-switch device was added */
+    uint32_t pa_sink_card;              /* Card index of sink read by sink info query */
+    uint32_t pa_sink_module;            /* Owner module index of sink read by sink info query */
+    int pa_sink_latency;                /* Latency in ms of sink read by sink info query */
+    gboolean pa_low_latency;            /* Flag to show low latency mode is on */
+    int pa_ll_before;                   /* Sink latency in ms before low latency mode was turned on */
+    char *pa_ll_card;                   /* Card whose profile was changed for low latency mode */
+    const char *pa_ll_profile;          /* Profile of card before low latency mode (interned) */
+    const char *pa_ll_target;           /* Low latency profile found for card (interned) */
+    char *pa_ll_module;                 /* Name of module reloaded for low latency mode */
+    char *pa_ll_args;                   /* Arguments of module before low latency mode */
+    uint32_t pa_ll_index;               /* Index of module loaded for low latency mode */
+    GHashTable *pa_idle_timers;         /* Map of sink names to timers for suspending them when idle */
+    GHashTable *pa_suspended;           /* Set of names of sinks suspended by the plugin */
+    GHashTable *pa_busy_sinks;          /* Set of indices of sinks with uncorked streams, read by stream query */
+    GHashTable *pa_sink_states;         /* Map of sink indices to states at the last check */
+    gboolean pa_idle_enabled;           /* Flag to show a device is set to suspend when idle */
+    gboolean pa_idle_adopt;             /* Flag to show suspended sinks set to suspend are to be taken over at the first check */
+    gboolean pa_sinks_changed;          /* Flag to show sink states need to be checked after a notification */
 
     /* Bluetooth interface */
     GDBusObjectManager *bt_objmanager;  /* D-Bus BlueZ object manager */
+    GCancellable *bt_cancellable;       /* Cancellable for object manager creation in progress */
     guint bt_watcher_id;                /* D-Bus BlueZ watcher ID */
-    GList *bt_ops;                      /* List of Bluetooth connect and disconnect operations */
-    char *bt_iname;                     /* Input device name for use in list */
-    char *bt_oname;                     /* Output device name for use in list */
-    gboolean bt_input;                  /* Flag to show if current connect operation is for input or output */
-    gboolean bt_force_hsp;              /* Flag to override automatic profile selection */
-    int bt_profile_count;               /* Counter for polling read of profile on connection */
+    GList *bt_ops;                      /* List of Bluetooth operations in progress, one per device */
+    gint64 bt_start_time;               /* Time at which plugin started, until saved devices are reconnected */
+    int bt_call_timeout;                /* Timeout in ms for trust and disconnect calls */
+    int bt_connect_timeout;             /* Timeout in ms for connect calls */
+    int bt_retries;                     /* Number of retries for connect calls which fail with a transient error */
+    bt_timing_t bt_history[BT_HISTORY]; /* Timing of recent Bluetooth operations */
+    int bt_history_next;                /* Index of next entry to write in timing history */
+    int bt_history_batch;               /* Number of history entries written since operations were last finished */
+    GHashTable *bt_devices;             /* Set of object paths of devices included in device count */
+    GHashTable *bt_path_index;          /* Map of BlueZ object paths to device addresses */
+    GHashTable *bt_addr_index;          /* Map of device addresses to BlueZ object paths */
+    GHashTable *bt_transports;          /* Map of BlueZ media transport paths to device paths */
+    GDBusProxy *bt_transport;           /* Media transport of default sink, if it has a hardware volume */
+    const char *bt_transport_sink;      /* Default sink for which media transport was looked up (interned), or NULL if not looked up */
+    GCancellable *bt_volume_cancellable;    /* Cancellable for hardware volume changes in progress */
+    int bt_volume_pending;              /* Number of hardware volume changes in progress */
+    guint16 bt_volume_good;             /* Hardware volume from before the changes in progress */
+    gboolean bt_volume_failed;          /* Flag to show the latest completed hardware volume change failed */
 } VolumePulsePlugin;
 
 /* Functions in volumepulse.c needed in other modules */
@@ -100,6 +202,9 @@ typedef struct {
 extern void menu_show (VolumePulsePlugin *vol);
 extern void menu_add_item (VolumePulsePlugin *vol, const char *label, const char *name);
 extern void profiles_dialog_add_combo (VolumePulsePlugin *vol, GtkListStore *ls, GtkWidget *dest, int sel, const char *label, const char *name);
+extern void profiles_dialog_add_latency (VolumePulsePlugin *vol, const char *card, int index, GHashTable *offsets);
+extern void profiles_dialog_set_latency (VolumePulsePlugin *vol, int index, const char *port, int latency, int configured);
+extern void profiles_dialog_add_suspend (VolumePulsePlugin *vol, int index, const char *sink, gboolean enable, int timeout);
 extern void volumepulse_update_display (VolumePulsePlugin *vol);
 
 /* End of file */
@@ -0,0 +1,357 @@
+/*
+Copyright (c) 2020 Raspberry Pi (Trading) Ltd.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Allocation counter for the volumepulse and micpulse plugins, loaded into
+ * lxpanel with LD_PRELOAD. It replaces the glibc allocator entry points and,
+ * while counting, counts every allocation made by any thread of the panel. Each
+ * one is attributed to the first caller on the stack outside libc, GLib, GObject
+ * and this library, so g_strdup, g_object_new and g_hash_table_insert called
+ * from the plugin count against the plugin, while allocations made inside
+ * libpulse, GIO or GTK count against those libraries. The plugin is the set of
+ * modules named in MALLOCCOUNT_MODULE (a colon-separated list of file names, by
+ * default volumepulse.so:micpulse.so).
+ *
+ * Three totals are kept: every allocation; those with a plugin frame anywhere
+ * on the stack, which includes the pa_operation and tagstruct libpulse allocates
+ * for each request the plugin makes; and those made directly by the plugin.
+ * Direct allocations are counted by call site, and the rest by module.
+ *
+ * SIGUSR1 clears the counts and starts counting; SIGUSR2 stops counting and
+ * writes a report to the file named in MALLOCCOUNT_OUTPUT, or to stderr. The
+ * report has the lines "total <n>", "plugin <n>" and "direct <n>", then a line
+ * "site <module> <offset> <count>" for each direct call site, with the offset
+ * in hex, ready for addr2line, and a line "module <module> <count> <plugin>"
+ * for each other module, giving how many of its allocations had a plugin frame
+ * on the stack. The signals are handled by a thread of this library, which the
+ * allocations of writing the report are never counted against. The signals
+ * stay blocked in programs the panel starts while the library is loaded.
+ *
+ * Build with
+ *
+ *   gcc -shared -fPIC -O2 -o malloccount.so malloccount.c -ldl -lpthread
+ *
+ * and see malloccount.sh for a run against the panel.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MC_FRAMES   64      /* Depth of stack searched for the caller and the plugin */
+#define MC_SITES    128     /* Number of distinct call sites recorded */
+#define MC_OTHERS   128     /* Number of other modules recorded */
+#define MC_MODULES  8       /* Number of module names read from MALLOCCOUNT_MODULE */
+#define MC_NAME_LEN 64      /* Longest module name read from MALLOCCOUNT_MODULE */
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void *__libc_memalign (size_t alignment, size_t size);
+
+typedef struct {
+    const char *module;                 /* File name of module containing call site */
+    uintptr_t offset;                   /* Offset of call site from base of module */
+    unsigned long count;                /* Allocations made at call site */
+} mc_site_t;
+
+typedef struct {
+    const char *module;                 /* File name of module */
+    unsigned long count;                /* Allocations made by module */
+    unsigned long plugin;               /* Allocations made by module with a plugin frame on the stack */
+} mc_other_t;
+
+static volatile int mc_counting;        /* Flag to show allocations are being counted */
+static unsigned long mc_total;          /* Allocations counted since counting started */
+static unsigned long mc_plugin;         /* Allocations counted with a plugin frame on the stack */
+static unsigned long mc_direct;         /* Allocations counted which were made by the plugin */
+static mc_site_t mc_sites[MC_SITES];    /* Call sites of allocations made by the plugin */
+static int mc_nsites;                   /* Number of entries in mc_sites */
+static unsigned long mc_unsited;        /* Allocations made by the plugin after mc_sites filled */
+static mc_other_t mc_others[MC_OTHERS]; /* Other modules which made allocations */
+static int mc_nothers;                  /* Number of entries in mc_others */
+static unsigned long mc_unknown;        /* Allocations by other modules after mc_others filled, or with no module found */
+static pthread_mutex_t mc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char mc_modules[MC_MODULES][MC_NAME_LEN];    /* File names of modules whose allocations are counted */
+static int mc_nmodules;                 /* Number of entries in mc_modules */
+
+static __thread int mc_busy;            /* Flag to show this thread is inside the counter, so its own allocations are not counted */
+
+/*----------------------------------------------------------------------------*/
+/* Attribution                                                                */
+/*----------------------------------------------------------------------------*/
+
+/* Get the file name part of a path */
+
+static const char *mc_basename (const char *path)
+{
+    const char *slash = strrchr (path, '/');
+    return slash ? slash + 1 : path;
+}
+
+/* Check whether a module is one whose calls are passed through to find the real caller */
+
+static int mc_pass_through (const char *name)
+{
+    return !strncmp (name, "libc.so", 7) || !strncmp (name, "libglib-2.0.so", 14) || !strncmp (name, "libgobject-2.0.so", 17)
+        || !strcmp (name, "malloccount.so");
+}
+
+/* Check whether a module is one whose allocations are counted */
+
+static int mc_counted_module (const char *name)
+{
+    int index;
+
+    for (index = 0; index < mc_nmodules; index++)
+        if (!strcmp (name, mc_modules[index])) return 1;
+    return 0;
+}
+
+/* Record an allocation made by the plugin against its call site - called with mc_lock held */
+
+static void mc_record_site (const char *module, uintptr_t offset)
+{
+    int index;
+
+    mc_direct++;
+    for (index = 0; index < mc_nsites; index++)
+    {
+        if (mc_sites[index].offset == offset && mc_sites[index].module == module)
+        {
+            mc_sites[index].count++;
+            break;
+        }
+    }
+    if (index == mc_nsites)
+    {
+        if (mc_nsites < MC_SITES)
+        {
+            mc_sites[index].module = module;
+            mc_sites[index].offset = offset;
+            mc_sites[index].count = 1;
+            mc_nsites++;
+        }
+        else mc_unsited++;
+    }
+}
+
+/* Record an allocation made by another module - called with mc_lock held */
+
+static void mc_record_other (const char *module, int plugin)
+{
+    int index;
+
+    for (index = 0; index < mc_nothers; index++)
+        if (mc_others[index].module == module) break;
+    if (index == mc_nothers)
+    {
+        if (!module || mc_nothers == MC_OTHERS)
+        {
+            mc_unknown++;
+            return;
+        }
+        mc_others[index].module = module;
+        mc_others[index].count = mc_others[index].plugin = 0;
+        mc_nothers++;
+    }
+    mc_others[index].count++;
+    if (plugin) mc_others[index].plugin++;
+}
+
+/* Find the caller of an allocation and whether the plugin is on the stack, and count it */
+
+static void mc_check_caller (void)
+{
+    void *frames[MC_FRAMES];
+    const char *name, *caller = NULL;
+    uintptr_t offset = 0;
+    Dl_info info;
+    int nframes, index, plugin = 0;
+
+    mc_busy = 1;
+    nframes = backtrace (frames, MC_FRAMES);
+    for (index = 1; index < nframes && !plugin; index++)
+    {
+        if (!dladdr (frames[index], &info) || !info.dli_fname) break;
+        name = mc_basename (info.dli_fname);
+        if (mc_counted_module (name)) plugin = 1;
+        if (caller || mc_pass_through (name)) continue;
+
+        // the return address is after the call, so step back into the calling instruction for addr2line
+        caller = name;
+        offset = (uintptr_t) frames[index] - (uintptr_t) info.dli_fbase - 1;
+    }
+
+    pthread_mutex_lock (&mc_lock);
+    mc_total++;
+    if (plugin) mc_plugin++;
+    if (caller && mc_counted_module (caller)) mc_record_site (caller, offset);
+    else mc_record_other (caller, plugin);
+    pthread_mutex_unlock (&mc_lock);
+    mc_busy = 0;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Allocator entry points                                                     */
+/*----------------------------------------------------------------------------*/
+
+void *malloc (size_t size)
+{
+    if (mc_counting && !mc_busy) mc_check_caller ();
+    return __libc_malloc (size);
+}
+
+void *calloc (size_t nmemb, size_t size)
+{
+    if (mc_counting && !mc_busy) mc_check_caller ();
+    return __libc_calloc (nmemb, size);
+}
+
+void *realloc (void *ptr, size_t size)
+{
+    if (mc_counting && !mc_busy) mc_check_caller ();
+    return __libc_realloc (ptr, size);
+}
+
+void *memalign (size_t alignment, size_t size)
+{
+    if (mc_counting && !mc_busy) mc_check_caller ();
+    return __libc_memalign (alignment, size);
+}
+
+void *aligned_alloc (size_t alignment, size_t size)
+{
+    if (mc_counting && !mc_busy) mc_check_caller ();
+    return __libc_memalign (alignment, size);
+}
+
+int posix_memalign (void **memptr, size_t alignment, size_t size)
+{
+    void *ptr;
+
+    if (alignment < sizeof (void *) || (alignment & (alignment - 1))) return EINVAL;
+    if (mc_counting && !mc_busy) mc_check_caller ();
+    ptr = __libc_memalign (alignment, size);
+    if (!ptr) return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Control                                                                    */
+/*----------------------------------------------------------------------------*/
+
+/* Write the counts to the output file */
+
+static void mc_report (void)
+{
+    const char *path = getenv ("MALLOCCOUNT_OUTPUT");
+    FILE *fp = path ? fopen (path, "w") : stderr;
+    int index;
+
+    if (!fp) return;
+    pthread_mutex_lock (&mc_lock);
+    fprintf (fp, "total %lu\nplugin %lu\ndirect %lu\n", mc_total, mc_plugin, mc_direct);
+    for (index = 0; index < mc_nsites; index++)
+        fprintf (fp, "site %s 0x%lx %lu\n", mc_sites[index].module, (unsigned long) mc_sites[index].offset, mc_sites[index].count);
+    if (mc_unsited) fprintf (fp, "site - - %lu\n", mc_unsited);
+    for (index = 0; index < mc_nothers; index++)
+        fprintf (fp, "module %s %lu %lu\n", mc_others[index].module, mc_others[index].count, mc_others[index].plugin);
+    if (mc_unknown) fprintf (fp, "module - %lu -\n", mc_unknown);
+    pthread_mutex_unlock (&mc_lock);
+    if (fp == stderr) fflush (fp);
+    else fclose (fp);
+}
+
+/* Thread which waits for the control signals */
+
+static void *mc_signal_thread (void *arg)
+{
+    sigset_t *signals = (sigset_t *) arg;
+    int sig;
+
+    mc_busy = 1;
+    while (sigwait (signals, &sig) == 0)
+    {
+        if (sig == SIGUSR1)
+        {
+            pthread_mutex_lock (&mc_lock);
+            mc_total = mc_plugin = mc_direct = mc_unsited = mc_unknown = 0;
+            mc_nsites = mc_nothers = 0;
+            pthread_mutex_unlock (&mc_lock);
+            mc_counting = 1;
+        }
+        else
+        {
+            mc_counting = 0;
+            mc_report ();
+        }
+    }
+    return NULL;
+}
+
+/* Read the settings and start the signal thread when the library is loaded */
+
+static void __attribute__ ((constructor)) mc_init (void)
+{
+    static sigset_t signals;
+    const char *list = getenv ("MALLOCCOUNT_MODULE");
+    const char *start, *end;
+    void *frame;
+    pthread_t thread;
+
+    if (!list || !*list) list = "volumepulse.so:micpulse.so";
+    for (start = list; *start && mc_nmodules < MC_MODULES; start = *end ? end + 1 : end)
+    {
+        end = strchrnul (start, ':');
+        if (end - start > 0 && end - start < MC_NAME_LEN)
+        {
+            memcpy (mc_modules[mc_nmodules], start, end - start);
+            mc_modules[mc_nmodules++][end - start] = 0;
+        }
+    }
+
+    // the first backtrace loads the unwinder, which allocates, so get that done now
+    backtrace (&frame, 1);
+
+    // the signals are blocked before any other thread exists, so every thread inherits the mask and only this one takes them
+    sigemptyset (&signals);
+    sigaddset (&signals, SIGUSR1);
+    sigaddset (&signals, SIGUSR2);
+    pthread_sigmask (SIG_BLOCK, &signals, NULL);
+    pthread_create (&thread, NULL, mc_signal_thread, &signals);
+    pthread_detach (thread);
+}
@@ -0,0 +1,144 @@
+#!/bin/sh
+#
+# Count the heap allocations made while the volume and mute of the default sink
+# are changed and the volumepulse plugin handles the notifications for those
+# changes, once it has warmed up. The check runs a panel of its own, holding
+# only the plugin under test, on a virtual X display, so the session's panel is
+# left alone; it needs Xvfb, gcc and pactl, and a PulseAudio server to connect
+# to. The plugin under test is whichever one lxpanel loads, so install the build
+# to be tested first.
+#
+# Usage: malloccount.sh [steps]
+#
+# Every allocation made by the panel between the start and end of the steps is
+# counted, on all threads, and reported by the module which made it, along with
+# how many had the plugin on the stack - those include the operation and
+# message buffers libpulse allocates for each request the plugin makes, and the
+# drawing GTK does when the icon changes. Only allocations made directly by
+# plugin code are required to be absent: they are listed by call site, and the
+# exit status is 0 if there were none, 1 if there were any, and 2 if the check
+# could not be run.
+#
+# PLUGIN names the plugin to load (default volumepulse). WARMUP is the time in
+# seconds given to the panel to start and the plugin to reach its steady state
+# (default 10). DISPLAY_NUM is the number of the virtual display (default 99).
+# If SCROLL is set to the coordinates "x y" of the volume icon on that display,
+# each step also scrolls the mouse wheel over the icon, which needs xdotool; the
+# icon is alone at the top left of the panel, so "16 16" will do.
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+LIB="$DIR/malloccount.so"
+TMP=$(mktemp -d)
+OUT="$TMP/report"
+STEPS=${1:-50}
+PLUGIN=${PLUGIN:-volumepulse}
+WARMUP=${WARMUP:-10}
+DISPLAY_NUM=${DISPLAY_NUM:-99}
+PANEL=
+XSERVER=
+
+cleanup ()
+{
+    [ -n "$PANEL" ] && kill "$PANEL" 2> /dev/null
+    [ -n "$XSERVER" ] && kill "$XSERVER" 2> /dev/null
+    wait 2> /dev/null
+    rm -rf "$TMP"
+}
+trap cleanup EXIT
+trap 'exit 2' INT TERM
+
+if [ ! -f "$LIB" ] || [ "$DIR/malloccount.c" -nt "$LIB" ] ; then
+    gcc -shared -fPIC -O2 -o "$LIB" "$DIR/malloccount.c" -ldl -lpthread || exit 2
+fi
+
+# a panel configuration holding only the plugin, in a configuration directory of its own
+mkdir -p "$TMP/config/lxpanel/malloccount/panels"
+cat > "$TMP/config/lxpanel/malloccount/panels/panel" << EOF
+Global {
+  edge=top
+  align=left
+  widthtype=percent
+  width=100
+  height=32
+  iconsize=32
+}
+Plugin {
+  type=$PLUGIN
+}
+EOF
+[ -d "${XDG_CONFIG_HOME:-$HOME/.config}/pulse" ] && ln -s "${XDG_CONFIG_HOME:-$HOME/.config}/pulse" "$TMP/config/pulse"
+
+# start the display and the panel with the counter loaded
+Xvfb ":$DISPLAY_NUM" -screen 0 1024x768x24 -nolisten tcp > /dev/null 2>&1 &
+XSERVER=$!
+sleep 2
+if ! kill -0 "$XSERVER" 2> /dev/null ; then
+    echo "Display :$DISPLAY_NUM could not be started"
+    exit 2
+fi
+DISPLAY=":$DISPLAY_NUM" XDG_CONFIG_HOME="$TMP/config" MALLOCCOUNT_MODULE="$PLUGIN.so" MALLOCCOUNT_OUTPUT="$OUT" \
+    LD_PRELOAD="$LIB" lxpanel --profile malloccount > /dev/null 2>&1 &
+PANEL=$!
+sleep "$WARMUP"
+if ! kill -0 "$PANEL" 2> /dev/null ; then
+    echo "Panel did not start"
+    exit 2
+fi
+
+# count only the steady state - one change in each direction first, so that anything done once per device is done
+pactl set-sink-volume @DEFAULT_SINK@ +1%
+pactl set-sink-volume @DEFAULT_SINK@ -1%
+sleep 1
+kill -USR1 "$PANEL"
+sleep 1
+
+step=0
+while [ "$step" -lt "$STEPS" ] ; do
+    if [ $((step % 2)) -eq 0 ] ; then
+        pactl set-sink-volume @DEFAULT_SINK@ +2%
+    else
+        pactl set-sink-volume @DEFAULT_SINK@ -2%
+    fi
+    if [ $((step % 10)) -eq 0 ] ; then
+        pactl set-sink-mute @DEFAULT_SINK@ toggle
+        pactl set-sink-mute @DEFAULT_SINK@ toggle
+    fi
+    if [ -n "$SCROLL" ] ; then
+        DISPLAY=":$DISPLAY_NUM" xdotool mousemove $SCROLL click 4 click 5
+    fi
+    sleep 0.1
+    step=$((step + 1))
+done
+sleep 1
+
+kill -USR2 "$PANEL"
+tries=0
+while [ ! -s "$OUT" ] && [ "$tries" -lt 50 ] ; do
+    sleep 0.1
+    tries=$((tries + 1))
+done
+
+if [ ! -s "$OUT" ] ; then
+    echo "No report from the allocation counter"
+    exit 2
+fi
+
+echo "Allocations by panel over $STEPS steps : $(sed -n 's/^total //p' "$OUT")"
+echo "  with $PLUGIN on the stack : $(sed -n 's/^plugin //p' "$OUT")"
+grep '^module ' "$OUT" | sort -k 3 -n -r | while read -r tag module count plugin ; do
+    echo "  $count by $module ($plugin with $PLUGIN on the stack)"
+done
+
+# show each call site in the plugin with its function and line where the debug information allows
+direct=$(sed -n 's/^direct //p' "$OUT")
+echo "Allocations by $PLUGIN itself : $direct"
+path=$(find /usr/lib /usr/local/lib -path "*/lxpanel/plugins/$PLUGIN.so" 2> /dev/null | head -n 1)
+grep '^site ' "$OUT" | while read -r tag module offset count ; do
+    if [ -n "$path" ] && [ "$offset" != "-" ] && command -v addr2line > /dev/null ; then
+        echo "  $count x $(addr2line -f -e "$path" "$offset" | paste -s -d ' ')"
+    else
+        echo "  $count x $module $offset"
+    fi
+done
+
+[ "$direct" = "0" ]
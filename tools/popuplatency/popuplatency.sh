@@ -0,0 +1,101 @@
+#!/bin/sh
+#
+# Measure how long the volume popup takes to appear when the icon is clicked.
+# The check runs a panel of its own, holding only the plugin under test, on a
+# virtual X display, with DEBUG_VP set, and clicks the icon to show and hide the
+# popup a number of times. The plugin logs the time taken by the click handler
+# to show the popup, and the time until the popup window is mapped; both are
+# collected from the log and summarised. It needs Xvfb and xdotool, and a
+# PulseAudio server to connect to. The plugin under test is whichever one
+# lxpanel loads, so install the build to be tested first.
+#
+# Usage: popuplatency.sh [clicks]
+#
+# The first show builds the popup, so it is reported on its own; the minimum,
+# average and maximum are over the rest. PLUGIN names the plugin to load
+# (default volumepulse). WARMUP is the time in seconds given to the panel to
+# start (default 5). DISPLAY_NUM is the number of the virtual display (default
+# 99). The exit status is 0 if every click was measured, and 2 otherwise.
+
+TMP=$(mktemp -d)
+LOG="$TMP/log"
+CLICKS=${1:-20}
+PLUGIN=${PLUGIN:-volumepulse}
+WARMUP=${WARMUP:-5}
+DISPLAY_NUM=${DISPLAY_NUM:-99}
+PANEL=
+XSERVER=
+
+cleanup ()
+{
+    [ -n "$PANEL" ] && kill "$PANEL" 2> /dev/null
+    [ -n "$XSERVER" ] && kill "$XSERVER" 2> /dev/null
+    wait 2> /dev/null
+    rm -rf "$TMP"
+}
+trap cleanup EXIT
+trap 'exit 2' INT TERM
+
+# a panel configuration holding only the plugin, in a configuration directory of its own
+mkdir -p "$TMP/config/lxpanel/popuplatency/panels"
+cat > "$TMP/config/lxpanel/popuplatency/panels/panel" << EOF
+Global {
+  edge=top
+  align=left
+  widthtype=percent
+  width=100
+  height=32
+  iconsize=32
+}
+Plugin {
+  type=$PLUGIN
+}
+EOF
+[ -d "${XDG_CONFIG_HOME:-$HOME/.config}/pulse" ] && ln -s "${XDG_CONFIG_HOME:-$HOME/.config}/pulse" "$TMP/config/pulse"
+
+Xvfb ":$DISPLAY_NUM" -screen 0 1024x768x24 -nolisten tcp > /dev/null 2>&1 &
+XSERVER=$!
+sleep 2
+if ! kill -0 "$XSERVER" 2> /dev/null ; then
+    echo "Display :$DISPLAY_NUM could not be started"
+    exit 2
+fi
+DISPLAY=":$DISPLAY_NUM" XDG_CONFIG_HOME="$TMP/config" DEBUG_VP=1 lxpanel --profile popuplatency > "$LOG" 2>&1 &
+PANEL=$!
+sleep "$WARMUP"
+if ! kill -0 "$PANEL" 2> /dev/null ; then
+    echo "Panel did not start"
+    exit 2
+fi
+
+# the icon is alone at the top left of the panel; the second click lands outside the popup and hides it
+click=0
+while [ "$click" -lt "$CLICKS" ] ; do
+    DISPLAY=":$DISPLAY_NUM" xdotool mousemove 16 16 click 1
+    sleep 0.5
+    DISPLAY=":$DISPLAY_NUM" xdotool mousemove 16 16 click 1
+    sleep 0.5
+    click=$((click + 1))
+done
+sleep 1
+
+summary ()
+{
+    sed -n "s/.*Popup $1 in \([0-9]*\) us.*/\1/p" "$LOG" | awk -v what="$2" '
+        NR == 1 { first = $1; next }
+        { if (n == 0 || $1 < min) min = $1; if ($1 > max) max = $1; sum += $1; n++ }
+        END {
+            if (NR == 0) { print what ": not measured"; exit 1 }
+            printf "%s: first %d us", what, first
+            if (n) printf ", then min %d us, average %d us, max %d us over %d", min, sum / n, max, n
+            printf "\n"
+        }'
+}
+
+shown=$(grep -c "Popup shown in" "$LOG")
+mapped=$(grep -c "Popup mapped in" "$LOG")
+summary shown "Click handler"
+summary mapped "Click to window mapped"
+[ "$shown" -eq "$CLICKS" ] && [ "$mapped" -eq "$CLICKS" ] && exit 0
+echo "$CLICKS clicks, but $shown shows and $mapped maps were logged"
+exit 2